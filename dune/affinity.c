@@ -0,0 +1,327 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "interface.h"
+#include "dune.h"
+
+// vcpu 线程在 host cpu 之间迁移之后，KVM 需要重新加载 guest 的 TLB
+// (kvm_vz_vcpu_load_tlb), 之后 guest 中 512M 的映射会集中地 TLB refill 。
+//
+// DUNE_AFFINITY=none|soft|pin 选择放置策略，线程在 host_loop 开始的时候从进程的
+// cpuset 中选择 home 数量最少的 cpu 作为 home, pin 绑定在 home 上, soft 限制在
+// home 所在的 LLC 中，none 不限制。cpuset 变小之后 sched_setaffinity 失败,
+// 重新读取 cpuset 之后再选择一次。
+//
+// 无论哪一种策略，每一次 KVM_RUN 之前都检查线程所在的 cpu, 变化的时候计数并且
+// 更新 vcpu 的 host_cpu, host_node 和 guest 的 CPUNUM / TIMERID (和上一次写入的
+// 值相同的时候省去 KVM_SET_ONE_REG), 线程刚刚取得 vcpu 之后的第一次检查只同步,
+// 不算迁移。迁移的时候统计之后 AFFINITY_WINDOW_NS 之内 guest 的 TLB refill 。
+// 窗口在到期之后的第一次 exit 结束，post_ns 记录实际的长度。
+//
+// guest 通过 host_cpu 选择 per-cpu 的分片 (dune_getcpu, syscall vector 中的
+// getcpu 和 vDSO), 不需要 exit 。KVM 在 guest 运行的过程中迁移线程的时候不会
+// 返回 host_loop, 所以 guest 看到的值可能落后，直到下一次 exit 。
+
+#define AFFINITY_WINDOW_NS 10000000ULL
+
+static const char *policy_names[AFFINITY_NR] = {
+	[AFFINITY_NONE] = "none",
+	[AFFINITY_SOFT] = "soft",
+	[AFFINITY_PIN] = "pin",
+};
+
+static inline bool cpu_allowed(const struct vm_affinity *a, int cpu)
+{
+	return a->allowed[cpu / 64] & (1ULL << (cpu % 64));
+}
+
+static void read_allowed(struct vm_affinity *a)
+{
+	cpu_set_t set;
+	if (sched_getaffinity(0, sizeof(set), &set))
+		die("sched_getaffinity");
+
+	memset(a->allowed, 0, sizeof(a->allowed));
+	for (int cpu = 0; cpu < AFFINITY_MAX_CPUS && cpu < CPU_SETSIZE; ++cpu)
+		if (CPU_ISSET(cpu, &set))
+			a->allowed[cpu / 64] |= 1ULL << (cpu % 64);
+}
+
+// 最后一级 cache 的 shared_cpu_list 中的第一个 cpu, 读取失败的时候所有的 cpu
+// 都属于同一个 LLC, soft 退化为 none
+static int read_llc(int cpu)
+{
+	for (int index = 3; index >= 0; --index) {
+		char path[128];
+		snprintf(path, sizeof(path),
+			 "/sys/devices/system/cpu/cpu%d/cache/index%d/shared_cpu_list",
+			 cpu, index);
+		FILE *f = fopen(path, "r");
+		if (f == NULL)
+			continue;
+		int first = 0;
+		int n = fscanf(f, "%d", &first);
+		fclose(f);
+		if (n == 1)
+			return first;
+	}
+	return 0;
+}
+
+void affinity_init(struct kvm_vm *vm, const struct kvm_vm *parent)
+{
+	struct vm_affinity *a = &vm->affinity;
+
+	if (pthread_mutex_init(&a->lock, NULL))
+		die("affinity_init");
+	memset(a->load, 0, sizeof(a->load));
+
+	// fork 出来的 child 中调用线程可能已经被 parent 绑定，cpuset 从 parent 继承
+	if (parent) {
+		a->policy = parent->affinity.policy;
+		memcpy(a->allowed, parent->affinity.allowed, sizeof(a->allowed));
+		memcpy(a->llc, parent->affinity.llc, sizeof(a->llc));
+		return;
+	}
+
+	a->policy = AFFINITY_NONE;
+	const char *env = getenv("DUNE_AFFINITY");
+	if (env != NULL) {
+		int i;
+		for (i = 0; i < AFFINITY_NR; ++i)
+			if (strcmp(env, policy_names[i]) == 0)
+				break;
+		if (i == AFFINITY_NR)
+			pr_warn("DUNE_AFFINITY : unknown policy %s", env);
+		else
+			a->policy = i;
+	}
+
+	read_allowed(a);
+	for (int cpu = 0; cpu < AFFINITY_MAX_CPUS; ++cpu)
+		a->llc[cpu] = cpu_allowed(a, cpu) ? read_llc(cpu) : -1;
+}
+
+static bool in_home(const struct vm_affinity *a, int home, int cpu)
+{
+	if (a->policy == AFFINITY_PIN)
+		return cpu == home;
+	return cpu >= 0 && cpu < AFFINITY_MAX_CPUS && a->llc[cpu] == a->llc[home];
+}
+
+// 调用者持有 a->lock
+static int least_loaded(const struct vm_affinity *a)
+{
+	int best = -1;
+	for (int cpu = 0; cpu < AFFINITY_MAX_CPUS; ++cpu) {
+		if (!cpu_allowed(a, cpu))
+			continue;
+		if (best == -1 || a->load[cpu] < a->load[best])
+			best = cpu;
+	}
+	return best;
+}
+
+static int set_home(const struct vm_affinity *a, int home)
+{
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	for (int cpu = 0; cpu < AFFINITY_MAX_CPUS && cpu < CPU_SETSIZE; ++cpu)
+		if (cpu_allowed(a, cpu) && in_home(a, home, cpu))
+			CPU_SET(cpu, &set);
+	return sched_setaffinity(0, sizeof(set), &set);
+}
+
+// 允许所有的 cpu 之后内核会和 cpuset 取交集，再读回来就是当前的 cpuset
+static void refresh_allowed(struct vm_affinity *a)
+{
+	cpu_set_t set;
+	memset(&set, 0xff, sizeof(set));
+	sched_setaffinity(0, sizeof(set), &set);
+	read_allowed(a);
+	for (int cpu = 0; cpu < AFFINITY_MAX_CPUS; ++cpu)
+		if (cpu_allowed(a, cpu) && a->llc[cpu] == -1)
+			a->llc[cpu] = read_llc(cpu);
+}
+
+static void affinity_place(struct kvm_cpu *vcpu)
+{
+	struct vm_affinity *a = &vcpu->vm->affinity;
+	struct vcpu_affinity *v = &vcpu->affinity;
+
+	pthread_mutex_lock(&a->lock);
+	for (int retry = 0; retry < 2; ++retry) {
+		int home = least_loaded(a);
+		if (home == -1)
+			break;
+		if (set_home(a, home) == 0) {
+			a->load[home]++;
+			v->home = home;
+			v->placed = true;
+			break;
+		}
+		refresh_allowed(a);
+	}
+	pthread_mutex_unlock(&a->lock);
+
+	if (!v->placed)
+		pr_warn("DUNE_AFFINITY : unable to place vcpu %d",
+			vcpu_global_id(vcpu));
+}
+
+static void affinity_unplace(struct kvm_cpu *vcpu)
+{
+	struct vm_affinity *a = &vcpu->vm->affinity;
+	struct vcpu_affinity *v = &vcpu->affinity;
+	if (!v->placed)
+		return;
+
+	pthread_mutex_lock(&a->lock);
+	a->load[v->home]--;
+	pthread_mutex_unlock(&a->lock);
+	v->placed = false;
+}
+
+static void window_end(struct kvm_cpu *vcpu, u64 now)
+{
+	struct vcpu_affinity *v = &vcpu->affinity;
+	v->post_refills += vcpu->tlb_refills - v->window_refills;
+	v->post_ns += now - v->window_start;
+	v->windows++;
+	v->window_start = 0;
+}
+
+static void set_host_cpu(struct kvm_cpu *vcpu, unsigned cpu, unsigned node)
+{
+	vcpu->host_cpu = cpu;
+	vcpu->host_node = node;
+	// vcpu 被其他线程重新使用的时候 CSR 保持不变，cpunum 仍然有效
+	if (vcpu->affinity.cpunum != cpu) {
+		arch_set_cpunum(vcpu, cpu);
+		vcpu->affinity.cpunum = cpu;
+	}
+}
+
+// KVM 创建的 vcpu 中 CPUNUM 和 TIMERID 不是 host cpu, 第一次必须写入
+void affinity_init_vcpu(struct kvm_cpu *vcpu)
+{
+	vcpu->affinity.cpunum = -1;
+}
+
+// 在 vcpu 对应的线程中，host_loop 开始的时候调用，host_cpu 在接下来的
+// affinity_check 中同步
+void affinity_enter(struct kvm_cpu *vcpu)
+{
+	struct vcpu_affinity *v = &vcpu->affinity;
+	v->synced = false;
+	if (vcpu->vm->affinity.policy == AFFINITY_NONE || v->placed)
+		return;
+	affinity_place(vcpu);
+}
+
+// vcpu 被释放的时候调用，统计是累计的
+void affinity_exit(struct kvm_cpu *vcpu)
+{
+	if (vcpu->affinity.window_start)
+		window_end(vcpu, stats_now());
+	affinity_unplace(vcpu);
+}
+
+// host_loop 中每一次 KVM_RUN 之前调用
+void affinity_check(struct kvm_cpu *vcpu)
+{
+	struct vcpu_affinity *v = &vcpu->affinity;
+	u64 now = 0;
+
+	if (v->window_start) {
+		now = stats_now();
+		if (now - v->window_start >= AFFINITY_WINDOW_NS)
+			window_end(vcpu, now);
+	}
+
+	unsigned cpu, node;
+	if (getcpu(&cpu, &node))
+		return;
+	if (!v->synced) {
+		set_host_cpu(vcpu, cpu, node);
+		v->synced = true;
+		return;
+	}
+	if (cpu == vcpu->host_cpu)
+		return;
+
+	v->migrations++;
+	set_host_cpu(vcpu, cpu, node);
+
+	// 上一个窗口还没有结束的时候提前结束，refill 归入上一次迁移
+	now = now ? now : stats_now();
+	if (v->window_start)
+		window_end(vcpu, now);
+	v->window_start = now;
+	v->window_refills = vcpu->tlb_refills;
+
+	// cpuset 变化或者其他人修改了线程的 affinity, 重新选择 home
+	if (v->placed && !in_home(&vcpu->vm->affinity, v->home, cpu)) {
+		affinity_unplace(vcpu);
+		affinity_place(vcpu);
+	}
+}
+
+static void affinity_snapshot(struct kvm_vm *vm,
+			      struct dune_affinity_stats *out)
+{
+	memset(out, 0, sizeof(*out));
+	int iter = 0;
+	struct kvm_cpu *vcpu;
+	while ((vcpu = kvm_next_vcpu(vm, &iter)) != NULL) {
+		out->migrations += vcpu->affinity.migrations;
+		out->refills += vcpu->tlb_refills;
+		out->post_migration_refills += vcpu->affinity.post_refills;
+		out->post_migration_ns += vcpu->affinity.post_ns;
+		out->windows += vcpu->affinity.windows;
+	}
+	out->policy = vm->affinity.policy;
+}
+
+long affinity_query(struct kvm_vm *vm, u64 uaddr)
+{
+	struct dune_affinity_stats *out = (struct dune_affinity_stats *)uaddr;
+	if (out == NULL)
+		return -EFAULT;
+	affinity_snapshot(vm, out);
+	return 0;
+}
+
+void affinity_dump(struct kvm_vm *vm, int fd)
+{
+	struct dune_affinity_stats st;
+	affinity_snapshot(vm, &st);
+	dprintf(fd, "affinity : policy=%s migrations=%llu refills=%llu "
+		    "post_migration_refills=%llu post_migration_ns=%llu "
+		    "windows=%llu\n",
+		policy_names[st.policy], st.migrations, st.refills,
+		st.post_migration_refills, st.post_migration_ns, st.windows);
+}
+
+int dune_affinity_stats(struct dune_affinity_stats *stats)
+{
+	long ret = syscall(DUNE_SYS_AFFINITY_STATS, stats);
+	return ret == -1 ? -errno : ret;
+}
+
+int dune_getcpu(void)
+{
+#ifdef ARCH_HAS_HOST_CPU
+	struct kvm_cpu *vcpu =
+		(struct kvm_cpu *)((char *)arch_syscall_parameter() -
+				   offsetof(struct kvm_cpu, syscall_parameter));
+	return __atomic_load_n(&vcpu->host_cpu, __ATOMIC_RELAXED);
+#else
+	return sched_getcpu();
+#endif
+}
@@ -17,6 +17,7 @@
 #include <sys/resource.h>
 
 #include "interface.h"
+#include "dune.h"
 
 // https://stackoverflow.com/questions/22449342/clone-vm-undeclared-first-use-in-this-function
 #define _GNU_SOURCE
@@ -26,7 +27,7 @@
 #include <sched.h>
 #include <pthread.h>
 
-struct kvm_cpu *kvm_init_vm_with_one_cpu();
+struct kvm_cpu *kvm_init_vm_with_one_cpu(const struct kvm_vm *parent);
 
 #define KNRM "\x1B[0m"
 #define KRED "\x1B[31m"
@@ -93,61 +94,30 @@ void die(const char *err, ...)
 
 void kvm_free_vcpu(struct kvm_cpu *vcpu)
 {
-	struct kvm_vm *kvm = vcpu->vm;
-
-	if (pthread_spin_lock(&kvm->lock)) {
-		die("locked failed");
-	}
-	assert(kvm->vcpu_pool[vcpu->cpu_id].valid);
-	kvm->vcpu_pool[vcpu->cpu_id].valid = false;
-
-	if (pthread_spin_unlock(&kvm->lock)) {
-		die("unlocked failed");
-	}
+	ipi_reset_vcpu(vcpu);
+	fault_reset_vcpu(vcpu);
+	affinity_exit(vcpu);
+	// slot 释放之后 vcpu 可能立刻被其他线程取走，不能再访问
+	struct kvm_vm *vm = vcpu->vm;
+	vcpu_slot_release(vcpu->shard, vcpu->cpu_id, false);
+
+	// 让 prewarm 线程重新初始化这个 vcpu
+	prewarm_kick(vm, NULL);
 }
 
-struct kvm_cpu *kvm_alloc_vcpu(struct kvm_vm *kvm)
+// 创建 shard->vcpu_pool[cpu_id] 对应的 vcpu, 调用者已经拥有这个 slot
+struct kvm_cpu *kvm_create_vcpu(struct kvm_shard *shard, int cpu_id)
 {
-	struct kvm_cpu *vcpu;
-	int cpu_id = -1;
-
-	if (pthread_spin_lock(&kvm->lock)) {
-		die("locked failed");
-	}
-
-	for (int i = 0; i < KVM_MAX_VCPUS; ++i) {
-		if (kvm->vcpu_pool[i].valid)
-			continue;
-
-		kvm->vcpu_pool[i].valid = true;
-		if (kvm->vcpu_pool[i].vcpu != NULL) {
-			if (pthread_spin_unlock(&kvm->lock)) {
-				die("unlocked failed");
-			}
-			return kvm->vcpu_pool[i].vcpu;
-		} else {
-			cpu_id = i;
-			break;
-		}
-	}
-
-	if (pthread_spin_unlock(&kvm->lock)) {
-		die("unlocked failed");
-	}
-
-	if (cpu_id == -1) {
-		die("No more vcpu to allocate\n");
-	}
-
-	vcpu = calloc(1, sizeof(struct kvm_cpu));
+	struct kvm_vm *kvm = shard->vm;
+	struct kvm_cpu *vcpu = calloc(1, sizeof(struct kvm_cpu));
 	if (!vcpu)
 		return NULL;
 
-	kvm->vcpu_pool[cpu_id].vcpu = vcpu;
 	vcpu->vm = kvm;
+	vcpu->shard = shard;
 	vcpu->cpu_id = cpu_id;
 
-	vcpu->vcpu_fd = ioctl(vcpu->vm->vm_fd, KVM_CREATE_VCPU, vcpu->cpu_id);
+	vcpu->vcpu_fd = ioctl(shard->vm_fd, KVM_CREATE_VCPU, vcpu->cpu_id);
 	if (vcpu->vcpu_fd < 0) {
 		die("KVM_CREATE_VCPU ioctl");
 	} else {
@@ -159,71 +129,109 @@ struct kvm_cpu *kvm_alloc_vcpu(struct kvm_vm *kvm)
 	if (vcpu->kvm_run == MAP_FAILED)
 		die("unable to mmap vcpu fd");
 
+	trace_open(vcpu);
+	phase_init_vcpu(vcpu);
+	futex_init_vcpu(vcpu);
+	fault_init_vcpu(vcpu);
+	affinity_init_vcpu(vcpu);
+
+	shard->vcpu_pool[cpu_id].vcpu = vcpu;
+	vcpu_slot_set_created(shard, cpu_id);
 	return vcpu;
 }
 
+// 任意 shard 中 prewarm 线程初始化好的 vcpu 优先，否则放在负载最低的 shard 中，
+// 所有的 shard 都满了的时候创建新的 shard
+struct kvm_cpu *kvm_alloc_vcpu(struct kvm_vm *kvm)
+{
+	struct kvm_shard *shard = NULL;
+	int cpu_id = -1;
+
+	int nr_shards = __atomic_load_n(&kvm->nr_shards, __ATOMIC_ACQUIRE);
+	for (int i = 0; i < nr_shards && cpu_id == -1; ++i) {
+		shard = kvm->shards[i];
+		cpu_id = vcpu_slot_claim(shard, VCPU_SLOT_WARM);
+	}
+
+	while (cpu_id == -1) {
+		shard = kvm_least_loaded_shard(kvm);
+		if (shard == NULL)
+			shard = kvm_add_shard(kvm);
+
+		cpu_id = vcpu_slot_claim(shard, VCPU_SLOT_CREATED);
+		if (cpu_id == -1)
+			cpu_id = vcpu_slot_claim(shard, VCPU_SLOT_EMPTY);
+		// 被其他线程抢先，重新选择 shard
+	}
+
+	// 按照 VCPU_SLOT_EMPTY 拿到的 slot 可能刚刚被 prewarm 线程创建
+	struct kvm_cpu *vcpu = shard->vcpu_pool[cpu_id].vcpu;
+	if (vcpu != NULL) {
+		syscall_cache_reset_vcpu(vcpu);
+		phase_init_vcpu(vcpu);
+		futex_init_vcpu(vcpu);
+		return vcpu;
+	}
+
+	return kvm_create_vcpu(shard, cpu_id);
+}
+
 void vacate_current_stack(struct kvm_cpu *cpu)
 {
 	void *host_stack = mmap_one_page();
 	switch_stack(cpu, (u64)host_stack + PAGESIZE);
 }
 
-struct kvm_cpu *kvm_init_vm_with_one_cpu()
+// 每一个 shard 中 vcpu 的上限，见 Documentation/virt/kvm/api.rst 中的
+// KVM_CAP_NR_VCPUS 和 KVM_CAP_MAX_VCPUS
+static int kvm_max_vcpus(int sys_fd)
 {
-	char dev_path[] = "/dev/kvm";
-	int ret;
-	struct kvm_vm *vm;
-
-	vm = calloc(1, sizeof(struct kvm_vm));
-
-	vm->sys_fd = -1;
-	vm->vm_fd = -1;
-	vm->kvm_run_mmap_size = -1;
-
-	if (pthread_spin_init(&vm->lock, PTHREAD_PROCESS_PRIVATE) != 0) {
-		die("pthread_spin_init failed\n");
-	}
+	int n = ioctl(sys_fd, KVM_CHECK_EXTENSION, KVM_CAP_MAX_VCPUS);
+	if (n <= 0)
+		n = ioctl(sys_fd, KVM_CHECK_EXTENSION, KVM_CAP_NR_VCPUS);
+	if (n <= 0)
+		n = 4;
+	return n < KVM_MAX_VCPUS ? n : KVM_MAX_VCPUS;
+}
 
-	for (int i = 0; i < KVM_MAX_VCPUS; ++i) {
-		vm->vcpu_pool[i].valid = false;
-		vm->vcpu_pool[i].vcpu = NULL;
+// 在调用路径中 kvm_create_vm => kvm_init_mmu_notifier =>
+// do_mmu_notifier_register => mm_take_all_locks => signal_pending
+// 如果 parent 正好发送一个信号，那么 KVM_CREATE_VM 会失败
+static int kvm_create_vm(int sys_fd)
+{
+	while (true) {
+		int ret = ioctl(sys_fd, KVM_CREATE_VM, KVM_VM_TYPE);
+		if (ret >= 0) {
+			pr_info("KVM_CREATE_VM");
+			return ret;
+		}
+		if (errno != EINTR)
+			die("KVM_CREATE_VM");
 	}
+}
 
-	ret = open(dev_path, O_RDWR);
-	if (ret < 0) {
-		die("unable to open %s", dev_path);
-	} else {
-		vm->sys_fd = ret;
-		// pr_info("open %s", dev_path);
-	}
+// 创建一个新的 KVM 虚拟机并映射整个地址空间。如果持有 shard_lock 之后发现
+// 其他线程已经添加了有空闲 slot 的 shard, 直接使用它
+struct kvm_shard *kvm_add_shard(struct kvm_vm *vm)
+{
+	pthread_mutex_lock(&vm->shard_lock);
 
-	ret = ioctl(vm->sys_fd, KVM_GET_API_VERSION, 0);
-	if (ret != KVM_API_VERSION) {
-		die("KVM_GET_API_VERSION");
-	} else {
-		// pr_info("KVM_GET_API_VERSION");
+	struct kvm_shard *shard = kvm_least_loaded_shard(vm);
+	if (shard != NULL) {
+		pthread_mutex_unlock(&vm->shard_lock);
+		return shard;
 	}
 
-	// 在调用路径中 kvm_create_vm => kvm_init_mmu_notifier =>
-	// do_mmu_notifier_register => mm_take_all_locks => signal_pending
-	// 如果 parent 正好发送一个信号，那么 KVM_CREATE_VM 会失败
-	while (true) {
-		ret = ioctl(vm->sys_fd, KVM_CREATE_VM, KVM_VM_TYPE);
-		if (ret < 0) {
-			if (errno != EINTR)
-				die("KVM_CREATE_VM");
-			else
-				continue;
-		}
-		vm->vm_fd = ret;
-		pr_info("KVM_CREATE_VM");
-    break;
-	};
+	if (vm->nr_shards == KVM_MAX_SHARDS)
+		die("No more vcpu to allocate\n");
 
-	int mmap_size = ioctl(vm->sys_fd, KVM_GET_VCPU_MMAP_SIZE, 0);
-	if (mmap_size < 0)
-		die("KVM_GET_VCPU_MMAP_SIZE");
-	vm->kvm_run_mmap_size = mmap_size;
+	shard = calloc(1, sizeof(struct kvm_shard));
+	if (shard == NULL)
+		die("calloc shard");
+	shard->index = vm->nr_shards;
+	shard->vm = vm;
+	shard->vm_fd = kvm_create_vm(vm->sys_fd);
+	vcpu_slots_init(shard);
 
 	struct kvm_userspace_memory_region mem =
 		(struct kvm_userspace_memory_region){
@@ -234,21 +242,70 @@ struct kvm_cpu *kvm_init_vm_with_one_cpu()
 			.userspace_addr = 0,
 		};
 
-	ret = ioctl(vm->vm_fd, KVM_SET_USER_MEMORY_REGION, &mem);
-	if (ret < 0) {
+	if (ioctl(shard->vm_fd, KVM_SET_USER_MEMORY_REGION, &mem) < 0) {
 		die("KVM_SET_USER_MEMORY_REGION");
 	} else {
 		// pr_info("KVM_SET_USER_MEMORY_REGION");
 	}
 
-#ifdef DUNE_DEBUG
-	vm->debug_fd = open("strace.txt", O_TRUNC | O_WRONLY | O_CREAT, 0644);
-	if (vm->debug_fd == -1) {
-		perror("open failed");
-		exit(1);
+	vm->shards[shard->index] = shard;
+	__atomic_store_n(&vm->nr_shards, shard->index + 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&vm->shard_lock);
+	return shard;
+}
+
+// parent 不为 NULL 的时候 (fork 出来的 child) 复用继承下来的 /dev/kvm
+struct kvm_cpu *kvm_init_vm_with_one_cpu(const struct kvm_vm *parent)
+{
+	char dev_path[] = "/dev/kvm";
+	int ret;
+	struct kvm_vm *vm;
+
+	vm = calloc(1, sizeof(struct kvm_vm));
+
+	vm->sys_fd = -1;
+	vm->kvm_run_mmap_size = -1;
+	vm->nr_shards = 0;
+	if (pthread_mutex_init(&vm->shard_lock, NULL) != 0) {
+		die("pthread_mutex_init failed\n");
 	}
-#endif
 
+	if (parent) {
+		vm->sys_fd = parent->sys_fd;
+		vm->kvm_run_mmap_size = parent->kvm_run_mmap_size;
+		vm->max_vcpus = parent->max_vcpus;
+	} else {
+		ret = open(dev_path, O_RDWR);
+		if (ret < 0) {
+			die("unable to open %s", dev_path);
+		} else {
+			vm->sys_fd = ret;
+			// pr_info("open %s", dev_path);
+		}
+
+		ret = ioctl(vm->sys_fd, KVM_GET_API_VERSION, 0);
+		if (ret != KVM_API_VERSION) {
+			die("KVM_GET_API_VERSION");
+		} else {
+			// pr_info("KVM_GET_API_VERSION");
+		}
+
+		int mmap_size = ioctl(vm->sys_fd, KVM_GET_VCPU_MMAP_SIZE, 0);
+		if (mmap_size < 0)
+			die("KVM_GET_VCPU_MMAP_SIZE");
+		vm->kvm_run_mmap_size = mmap_size;
+		vm->max_vcpus = kvm_max_vcpus(vm->sys_fd);
+	}
+
+	syscall_cache_init(vm);
+	stats_init(vm);
+	trace_init(vm);
+	phase_init(vm);
+	prewarm_init(vm);
+	futex_init(vm);
+	affinity_init(vm, parent);
+
+	kvm_add_shard(vm);
 	return kvm_alloc_vcpu(vm);
 }
 
@@ -318,7 +375,7 @@ void expand_stack()
 int dune_enter()
 {
 	expand_stack();
-	struct kvm_cpu *cpu = kvm_init_vm_with_one_cpu();
+	struct kvm_cpu *cpu = kvm_init_vm_with_one_cpu(NULL);
 	if (cpu == NULL)
 		die("kvm_init_vm_with_one_cpu");
 
@@ -333,6 +390,8 @@ struct kvm_cpu *dup_vcpu(const struct kvm_cpu *parent_cpu, int sysno)
 		return NULL;
 
 	init_child_thread_info(child_cpu, parent_cpu, sysno);
+	fastpath_inherit(child_cpu, parent_cpu);
+	child_cpu->prewarmed = false;
 
 	return child_cpu;
 }
@@ -340,12 +399,13 @@ struct kvm_cpu *dup_vcpu(const struct kvm_cpu *parent_cpu, int sysno)
 struct kvm_cpu *dup_vm(const struct kvm_cpu *parent_cpu, int sysno)
 {
 	// printf("=======\n");
-	struct kvm_cpu *child_cpu = kvm_init_vm_with_one_cpu();
+	struct kvm_cpu *child_cpu = kvm_init_vm_with_one_cpu(parent_cpu->vm);
 	if (child_cpu == NULL) {
 		die("dup_vm");
 	}
 
 	init_child_thread_info(child_cpu, parent_cpu, sysno);
+	fastpath_inherit(child_cpu, parent_cpu);
 	return child_cpu;
 }
 
@@ -372,28 +432,50 @@ struct child_stack_para {
 	u64 para1;
 };
 
+// struct kvm_cpu 中 init_child_thread_info 和 fastpath_inherit 需要读取的部分,
+// 包括 syscall_parameter, fastpath 和 info
+#define KVM_CPU_SNAPSHOT_SIZE offsetof(struct kvm_cpu, sidecar_thread)
+// snapshot 放在 child 的 host stack 的顶部，多分配一个 page
+#define CLONE_HOST_STACK_PAGES 2
+
+// child 在自己的线程中分配和初始化 vcpu, snapshot 在 child 的 stack 上，parent
+// 之后的 syscall 不会影响它
+struct kvm_cpu *clone_child_entry(const struct kvm_cpu *snapshot, int sysno)
+{
+	struct kvm_cpu *child_cpu = dup_vcpu(snapshot, sysno);
+	if (child_cpu == NULL)
+		die("DUP_VCPU");
+	host_loop(child_cpu);
+	die("host_loop never return\n");
+}
+
 struct kvm_cpu *emulate_fork_same_vm(struct kvm_cpu *parent_cpu, int sysno)
 {
 	// without CLONE_VM
 	// 1. creating one vcpu is enough
 	// 2. child host need one stack for `host_loop`
+	//
+	// parent 只保存 child 需要的状态，vcpu 的分配和初始化都在 child 中进行，
+	// 这样 parent 的 clone 延迟接近 native
 	BUILD_ASSERT(sizeof(struct child_stack_para) == 24);
-	struct kvm_cpu *child_cpu = dup_vcpu(parent_cpu, sysno);
-	if (child_cpu == NULL)
-		die("DUP_VCPU");
+	BUILD_ASSERT(KVM_CPU_SNAPSHOT_SIZE <= PAGESIZE);
+	if (sysno != SYS_CLONE)
+		die("unexpected sysno\n");
 
-	if (sysno == SYS_CLONE) {
-		u64 child_host_stack = (u64)mmap_one_page() + PAGESIZE;
-		child_host_stack += -(sizeof(struct child_stack_para));
-		struct child_stack_para *child_args_on_stack_top =
-			(struct child_stack_para *)(child_host_stack);
-		child_args_on_stack_top->entry = (u64)host_loop;
-		child_args_on_stack_top->para0 = (u64)child_cpu;
+	u64 child_host_stack = (u64)mmap_pages(CLONE_HOST_STACK_PAGES) +
+			       PAGESIZE * CLONE_HOST_STACK_PAGES;
+	child_host_stack -= (KVM_CPU_SNAPSHOT_SIZE + 15) & ~15UL;
+	struct kvm_cpu *snapshot = (struct kvm_cpu *)child_host_stack;
+	memcpy(snapshot, parent_cpu, KVM_CPU_SNAPSHOT_SIZE);
 
-		do_simulate_clone(parent_cpu, child_host_stack);
-	} else {
-		die("unexpected sysno\n");
-	}
+	child_host_stack += -(sizeof(struct child_stack_para));
+	struct child_stack_para *child_args_on_stack_top =
+		(struct child_stack_para *)(child_host_stack);
+	child_args_on_stack_top->entry = (u64)clone_child_entry;
+	child_args_on_stack_top->para0 = (u64)snapshot;
+	child_args_on_stack_top->para1 = sysno;
+
+	do_simulate_clone(parent_cpu, child_host_stack);
 
 	// 通过返回 NULL 告知是 parent
 	return NULL;
@@ -435,10 +517,155 @@ struct kvm_cpu *emulate_fork(struct kvm_cpu *parent_cpu, int sysno)
 	}
 }
 
+#define SYSCALL_KIND_ENTRY(nr, kind) [(nr)-SYSCALL_BASE] = (kind),
+
+// 编译期根据 ARCH_SYSCALL_KINDS 生成，没有列出的 syscall 都是 SYSCALL_PASSTHROUGH
+static const u8 syscall_kind_table[SYSCALL_TABLE_SIZE] = {
+	ARCH_SYSCALL_KINDS(SYSCALL_KIND_ENTRY)
+};
+
+enum SYSCALL_KIND syscall_kind(u64 sysno)
+{
+	// sysno 小于 SYSCALL_BASE 的时候 idx 回绕成一个很大的数
+	u64 idx = sysno - SYSCALL_BASE;
+
+	if (idx >= SYSCALL_TABLE_SIZE)
+		return sysno >= DUNE_SYSCALL_BASE ? SYSCALL_DUNE :
+						    SYSCALL_PASSTHROUGH;
+	return syscall_kind_table[idx];
+}
+
+// 在一次 hypercall 中依次执行 guest 提交的一组 syscall, 所有的结果写回之后才
+// 重新进入 guest 。只接受不需要 host_loop 特殊处理的 syscall, 其余的返回 -EINVAL
+static long syscall_batch(struct kvm_cpu *vcpu, struct dune_sysreq *reqs,
+			  long n)
+{
+	if (reqs == NULL || n < 0)
+		return -EINVAL;
+
+	for (long i = 0; i < n; ++i) {
+		struct dune_sysreq *req = &reqs[i];
+		u64 args[6];
+		for (int j = 0; j < 6; ++j)
+			args[j] = req->args[j];
+
+		switch (syscall_kind(req->sysno)) {
+		case SYSCALL_PASSTHROUGH:
+		case SYSCALL_THREAD_BOUND:
+		case SYSCALL_CACHED:
+			req->ret = arch_raw_syscall(req->sysno, args);
+			break;
+		case SYSCALL_INVALIDATE:
+			req->ret = arch_raw_syscall(req->sysno, args);
+			syscall_cache_invalidate(vcpu->vm);
+			break;
+		case SYSCALL_FUTEX:
+			req->ret = futex_raw_syscall(args);
+			break;
+		default:
+			req->ret = -EINVAL;
+		}
+	}
+	return n;
+}
+
+int dune_syscall_batch(struct dune_sysreq *reqs, int n)
+{
+	long ret = syscall(DUNE_SYS_BATCH, reqs, n);
+	if (ret != -1)
+		return ret;
+
+	if (errno != ENOSYS)
+		return -errno;
+
+	// 不在 dune 中，逐个执行
+	for (int i = 0; i < n; ++i) {
+		long *a = reqs[i].args;
+		ret = syscall(reqs[i].sysno, a[0], a[1], a[2], a[3], a[4], a[5]);
+		reqs[i].ret = ret == -1 ? -errno : ret;
+	}
+	return n;
+}
+
+static long dune_syscall(struct kvm_cpu *vcpu, u64 sysno)
+{
+	switch (sysno) {
+	case DUNE_SYS_SYSRING_INIT:
+		return sysring_start(arch_get_syscall_arg(vcpu, 0));
+	case DUNE_SYS_SIDECAR:
+		return sidecar_start(vcpu, arch_get_syscall_arg(vcpu, 0));
+	case DUNE_SYS_CACHE_STATS:
+		return syscall_cache_stats(vcpu->vm, arch_get_syscall_arg(vcpu, 0));
+	case DUNE_SYS_BATCH:
+		return syscall_batch(vcpu,
+				     (struct dune_sysreq *)arch_get_syscall_arg(vcpu, 0),
+				     arch_get_syscall_arg(vcpu, 1));
+	case DUNE_SYS_STATS_SYSCALL:
+		return stats_query_syscall(vcpu->vm, arch_get_syscall_arg(vcpu, 0),
+					   arch_get_syscall_arg(vcpu, 1));
+	case DUNE_SYS_STATS_EXITS:
+		return stats_query_exits(vcpu->vm, arch_get_syscall_arg(vcpu, 0),
+					 arch_get_syscall_arg(vcpu, 1));
+	case DUNE_SYS_STATS_DUMP:
+		return stats_dump(vcpu->vm, arch_get_syscall_arg(vcpu, 0));
+	case DUNE_SYS_STATS_PHASE:
+		return phase_query(vcpu->vm, arch_get_syscall_arg(vcpu, 0));
+	case DUNE_SYS_FASTPATH:
+		return fastpath_program(vcpu, arch_get_syscall_arg(vcpu, 0),
+					arch_get_syscall_arg(vcpu, 1),
+					arch_get_syscall_arg(vcpu, 2));
+	case DUNE_SYS_VCPU_SLOTS:
+		return vcpu_slots_query(vcpu->vm, arch_get_syscall_arg(vcpu, 0));
+	case DUNE_SYS_IPI_REGISTER:
+		return ipi_register(vcpu, arch_get_syscall_arg(vcpu, 0));
+	case DUNE_SYS_IPI_SEND:
+		return ipi_send(vcpu->vm, arch_get_syscall_arg(vcpu, 0),
+				arch_get_syscall_arg(vcpu, 1));
+	case DUNE_SYS_AFFINITY_STATS:
+		return affinity_query(vcpu->vm, arch_get_syscall_arg(vcpu, 0));
+	case DUNE_SYS_VM_SHOOTDOWN:
+		return pgtable_shootdown(vcpu, arch_get_syscall_arg(vcpu, 0));
+	case DUNE_SYS_FAULT:
+		return fault_signal(vcpu, arch_get_syscall_arg(vcpu, 0),
+				    arch_get_syscall_arg(vcpu, 1));
+	case DUNE_SYS_FPU_ENABLE:
+		return arch_enable_fpu(vcpu, arch_get_syscall_arg(vcpu, 0));
+	default:
+		return -ENOSYS;
+	}
+}
+
+static inline void host_do_syscall(struct kvm_cpu *vcpu)
+{
+	phase_stamp(vcpu, PHASE_H_SYSCALL_BEGIN);
+	arch_do_syscall(vcpu, false);
+	phase_stamp(vcpu, PHASE_H_SYSCALL_END);
+}
+
 void host_loop(struct kvm_cpu *vcpu)
 {
+	// 上一个 syscall 开始在 host 中处理的时间，在下一次 KVM_RUN 之前统计
+	u64 begin = 0, last_sysno = 0;
+
+	fastpath_refresh(vcpu);
+	affinity_enter(vcpu);
+	// 新的线程刚刚取走一个 vcpu, 在它自己的线程中通知 prewarm 补充
+	prewarm_kick(vcpu->vm, vcpu);
 	while (true) {
+		if (begin) {
+			u64 ns = stats_now() - begin;
+			stats_syscall_end(vcpu, last_sysno, ns);
+			trace_syscall_end(vcpu, ns);
+			begin = 0;
+		}
+
+		affinity_check(vcpu);
+		phase_run_enter(vcpu);
+		__atomic_store_n(&vcpu->in_guest, true, __ATOMIC_SEQ_CST);
 		long err = ioctl(vcpu->vcpu_fd, KVM_RUN, 0);
+		__atomic_store_n(&vcpu->in_guest, false, __ATOMIC_SEQ_CST);
+		phase_run_exit(vcpu, vcpu->kvm_run->exit_reason ==
+					     KVM_EXIT_HYPERCALL);
 		u64 sysno = arch_get_sysno(vcpu);
 		struct kvm_regs regs;
 
@@ -446,39 +673,44 @@ void host_loop(struct kvm_cpu *vcpu)
 			die("KVM_RUN : err=%d\n", err);
 		}
 
+		stats_exit(vcpu, vcpu->kvm_run->exit_reason);
 		if (vcpu->kvm_run->exit_reason == KVM_EXIT_INTR) {
 			continue;
 		}
 
-		if (vcpu->kvm_run->exit_reason != KVM_EXIT_HYPERCALL) {
-			die("KVM_EXIT_IS_NOT_HYPERCALL vcpu=%d exit_reason=%d",
-			    vcpu->cpu_id, vcpu->kvm_run->exit_reason);
-		}
+		// 访问 host 中没有映射的地址, fault_host_exit 发出 SIGSEGV
+		if (vcpu->kvm_run->exit_reason != KVM_EXIT_HYPERCALL)
+			fault_host_exit(vcpu);
 
-		if (sysno == SYS_KEXEC_LOAD)
-			die("Unsupported syscall");
+		last_sysno = sysno;
+		begin = stats_syscall_begin(vcpu, sysno);
+		trace_syscall_begin(vcpu, sysno, begin);
 
-#ifdef DUNE_DEBUG
-		dprintf(vcpu->vm->debug_fd,
-			"vcpu=%d sysno=%llx\n%08llx %08llx %08llx %08llx\n%08llx %08llx %08llx %08llx\n\n",
-			vcpu->cpu_id, sysno, vcpu->syscall_parameter[0],
-			vcpu->syscall_parameter[1], vcpu->syscall_parameter[2],
-			vcpu->syscall_parameter[3], vcpu->syscall_parameter[4],
-			vcpu->syscall_parameter[5], vcpu->syscall_parameter[6],
-			vcpu->syscall_parameter[7]);
-#endif
-
-		// exit_group will destroy the vm, so don't bother to remove vcpu
-		if (sysno == SYS_EXIT) {
+		switch (syscall_kind(sysno)) {
+		case SYSCALL_PASSTHROUGH:
+		case SYSCALL_THREAD_BOUND:
+			break;
+		case SYSCALL_EXIT_GROUP:
+			stats_dump_on_exit(vcpu->vm);
+			break;
+		case SYSCALL_EXIT: {
+			// exit_group will destroy the vm, so don't bother to remove vcpu
+			// 线程不会回到循环的开头，在 vcpu 被释放之前统计。slot 释放之后
+			// vcpu 可能立刻被其他线程或者 prewarm 取走，不能再访问，所以先
+			// 取出参数，直接调用 exit
+			u64 ns = stats_now() - begin;
+			stats_syscall_end(vcpu, sysno, ns);
+			trace_syscall_end(vcpu, ns);
+			int code = arch_get_syscall_arg(vcpu, 0);
+			sidecar_stop(vcpu);
 			kvm_free_vcpu(vcpu);
+			syscall(SYS_EXIT, code);
+			die("exit returned");
 		}
-
-		if (sysno == SYS_SET_THREAD_AREA) {
+		case SYSCALL_SET_THREAD_AREA:
 			arch_set_thread_area(vcpu);
-		}
-
-		if (sysno == SYS_FORK || sysno == SYS_CLONE ||
-		    sysno == SYS_CLONE3) {
+			break;
+		case SYSCALL_FORK: {
 			kvm_get_parent_thread_info(vcpu);
 
 			struct kvm_cpu *child_cpu = emulate_fork(vcpu, sysno);
@@ -487,13 +719,36 @@ void host_loop(struct kvm_cpu *vcpu)
 			// 进行调整 status 和 pc 寄存器。
 			if (child_cpu) {
 				vcpu = child_cpu;
+				fastpath_refresh(vcpu);
+				affinity_enter(vcpu);
 			}
 			continue;
 		}
-
-		if (arch_handle_special_syscall(vcpu, sysno))
+		case SYSCALL_SPECIAL:
+			if (arch_handle_special_syscall(vcpu, sysno))
+				continue;
+			break;
+		case SYSCALL_DENIED:
+			die("Unsupported syscall");
+		case SYSCALL_DUNE:
+			arch_set_syscall_ret(vcpu, dune_syscall(vcpu, sysno));
+			continue;
+		case SYSCALL_CACHED:
+			syscall_cache_handle(vcpu, sysno);
 			continue;
+		case SYSCALL_INVALIDATE:
+			// 先执行 syscall 再失效，否则其他 vcpu 可能在两者之间填充旧的结果
+			host_do_syscall(vcpu);
+			syscall_cache_invalidate(vcpu->vm);
+			continue;
+		case SYSCALL_FUTEX: {
+			u64 *waiters = futex_wait_begin(vcpu);
+			host_do_syscall(vcpu);
+			futex_wait_end(vcpu, waiters);
+			continue;
+		}
+		}
 
-		arch_do_syscall(vcpu, false);
+		host_do_syscall(vcpu);
 	}
 }
@@ -6,3 +6,312 @@ int dune_enter();
 			return 1;                                              \
 		}                                                              \
 	} while (0)
+
+struct dune_sysreq {
+	long sysno;
+	long args[6];
+	long ret;
+};
+
+/**
+ * 在一次 vm exit 中依次执行 n 个互相独立的 syscall, 结果写入 reqs[i].ret 。
+ * exit, clone 之类需要 host_loop 特殊处理的 syscall 得到 -EINVAL 。
+ * 返回执行的个数，失败返回 -errno
+ */
+int dune_syscall_batch(struct dune_sysreq *reqs, int n);
+
+/**
+ * FlexSC 风格的异步 syscall : guest 把 syscall 放入共享内存中的 ring,
+ * host 中的 worker 线程执行之后把结果写回, 提交和完成都不会导致 vm exit 。
+ *
+ * worker 运行在其他 host 线程上，所以只能提交和调用者线程无关的 syscall,
+ * 例如 read / write / pread / fsync, 而 gettid / 信号 / clone 之类的不行 。
+ * fork 之后 child 中的 ring 失效，需要重新调用 dune_sysring_init
+ */
+int dune_sysring_init(int nr_workers);
+// 返回用于 dune_syscall_wait 的 ticket, ring 已满返回 -EAGAIN
+long dune_syscall_submit(const struct dune_sysreq *req);
+// 等待 ticket 对应的 syscall 完成，返回 syscall 的返回值 (失败时为 -errno)
+long dune_syscall_wait(long ticket);
+
+/**
+ * 为当前线程的 vcpu 创建一个 sidecar 线程，之后的 syscall 由 sidecar 轮询执行，
+ * 不再导致 vm exit 。sidecar 会一直占用一个 host cpu, 适合对延迟敏感的线程。
+ * host_cpu 是 sidecar 绑定的 cpu, -1 表示不绑定。
+ *
+ * 和调用线程相关的 syscall 仍然走 vm exit 。阻塞的 syscall 在 sidecar 中执行，
+ * 不会被发给调用线程的信号打断。
+ */
+int dune_sidecar_enable(int host_cpu);
+
+struct dune_cache_stats {
+	unsigned long long hits;
+	unsigned long long misses;
+	unsigned long long invalidations;
+};
+
+// host_loop 中 getpid / gettid / getuid / uname / prlimit64 等 syscall 的缓存命中情况
+int dune_syscall_cache_stats(struct dune_cache_stats *stats);
+
+/**
+ * 让当前线程的 sysno 直接在 guest 中返回 value, 不再导致 vm exit, 例如把没有
+ * 竞争的 sched_yield 设置为 0 。value 的约定和内核相同，失败返回 -errno 。
+ * getpid 和 gettid 默认就是这样处理的。设置会被 fork / clone 出来的 child 继承。
+ * 只支持只有返回值的 syscall : getpid, getppid, gettid, getuid, geteuid,
+ * getgid, getegid 和 sched_yield, 其他的返回 -EINVAL
+ */
+int dune_fastpath_set(long sysno, long value);
+int dune_fastpath_clear(long sysno);
+
+/**
+ * host_loop 的统计 : 每一个 syscall 的次数和 host 中处理时间的 log2 直方图,
+ * hist[i] 是处理时间在 [2^i, 2^(i+1)) ns 之间的次数。
+ * 设置环境变量 DUNE_STATS=1 (输出到 stderr) 或者 DUNE_STATS=<path>
+ * (输出到 <path>.<pid>) 之后，进程在 exit_group 的时候输出所有的统计。
+ */
+#define DUNE_STATS_BUCKETS 32
+struct dune_syscall_stat {
+	unsigned long long count;
+	unsigned long long total_ns;
+	unsigned long long hist[DUNE_STATS_BUCKETS];
+};
+
+int dune_stats_syscall(long sysno, struct dune_syscall_stat *stat);
+// counts[i] 是 exit_reason 为 i 的 KVM_RUN 次数，返回填充的个数
+int dune_stats_exits(unsigned long long *counts, int n);
+int dune_stats_dump(int fd);
+
+/**
+ * 一次 hypercall 往返中每一个阶段的时间，libdune 使用 -DDUNE_PHASE_TIMING
+ * 编译的时候才会统计，否则返回 -ENOSYS 。时间戳来自 stable counter,
+ * 其中 VECTOR, EXIT 和 ENTRY 需要 guest 的 syscall vector 写入时间戳,
+ * 目前只有 loongarch 支持。
+ */
+enum DUNE_PHASE {
+	DUNE_PHASE_VECTOR, // guest 的 syscall vector 保存参数
+	DUNE_PHASE_EXIT, // HYPERCALL 到 ioctl(KVM_RUN) 返回
+	DUNE_PHASE_DISPATCH, // host_loop 分发
+	DUNE_PHASE_SYSCALL, // host 中执行 syscall
+	DUNE_PHASE_RETURN, // syscall 完成到再次 ioctl(KVM_RUN)
+	DUNE_PHASE_ENTRY, // ioctl(KVM_RUN) 到 guest 从 HYPERCALL 返回
+	DUNE_PHASE_NR,
+};
+
+int dune_stats_phase(struct dune_syscall_stat stats[DUNE_PHASE_NR]);
+
+/**
+ * vcpu slot 分配器的统计 : claims 是分配的次数，contended 是多个线程同时分配
+ * 或者释放导致 CAS 重试的次数，created, busy 和 warm 是当前处于对应状态的
+ * slot 个数。一个 KVM 虚拟机中的 vcpu 不够的时候会创建新的虚拟机 (shard),
+ * 每一个 shard 最多 max_vcpus 个 vcpu 。
+ */
+struct dune_vcpu_slot_stats {
+	unsigned long long claims;
+	unsigned long long contended;
+	unsigned long long created;
+	unsigned long long busy;
+	unsigned long long warm;
+	unsigned long long shards;
+	unsigned long long max_vcpus;
+};
+
+int dune_vcpu_slot_stats(struct dune_vcpu_slot_stats *stats);
+
+/**
+ * vcpu 线程在 host cpu 上的放置策略，由环境变量 DUNE_AFFINITY 设置 : none (默认)
+ * 不限制，soft 限制在 home cpu 所在的 LLC 中，pin 绑定在 home cpu 上。home 是
+ * 进程的 cpuset 中 vcpu 最少的 cpu 。
+ *
+ * 线程迁移之后 KVM 需要重新加载 guest 的 TLB, refills 是 guest 中所有的 TLB
+ * refill, post_migration_refills 是每一次迁移之后大约 10ms 之内的部分，
+ * 窗口的总长度是 post_migration_ns
+ */
+struct dune_affinity_stats {
+	unsigned long long migrations;
+	unsigned long long refills;
+	unsigned long long post_migration_refills;
+	unsigned long long post_migration_ns;
+	unsigned long long windows;
+	unsigned long long policy; // 0 : none, 1 : soft, 2 : pin
+};
+
+int dune_affinity_stats(struct dune_affinity_stats *stats);
+
+/**
+ * vcpu 线程最近一次进入 guest 的时候所在的 host cpu, 不会导致 vm exit, 可以
+ * 用来选择 per-cpu 的分片。guest 运行的过程中线程仍然可能被 host 迁移，下一次
+ * exit 之后才会更新，所以结果只能作为提示，分片上的操作仍然需要原子指令。
+ * guest 中的 getcpu 和 vDSO 的 sched_getcpu 看到相同的值。
+ * 必须在 DUNE_ENTER 之后调用，不支持的架构上等同于 sched_getcpu
+ */
+int dune_getcpu(void);
+
+/**
+ * guest 页表 : dune_vm_reserve 保留 size 字节的虚拟地址空间 (按照 64G 对齐),
+ * 其中的地址由 guest 的页表翻译，初始状态下全部没有映射。dune_vm_map 把 va 映射
+ * 到进程中已经存在的内存 pa (可以多次映射同一块内存), prot 是 PROT_READ,
+ * PROT_WRITE 和 PROT_EXEC 的组合，va 和 pa 都按照 32M 对齐的部分使用大页,
+ * 加上 DUNE_VM_NOHUGE 的时候只使用 16K 的页，之后可以按照 16K 修改权限。
+ * 地址和长度都需要按照 16K 对齐。
+ *
+ * 修改在 guest 中完成，不会导致 vm exit, 但是只清除当前 vcpu 的 TLB 。其他 vcpu
+ * 在调用 dune_vm_shootdown 之前仍然可能使用旧的映射，dune_vm_shootdown 通过 IPI
+ * 清空所有 vcpu 的 TLB, 返回的时候已经完成。guest 中关中断运行的 vcpu (例如
+ * uthread 的 preempt_disable) 会推迟 shootdown 。
+ *
+ * 访问没有映射或者没有权限的地址交给 dune_fault_register 注册的 handler,
+ * 没有 handler 的时候进程收到 SIGSEGV, 然后结束。
+ * 必须在 DUNE_ENTER 之后调用，DUNE_TRANSLATION=dmw 的时候返回 -EINVAL,
+ * 目前只有 loongarch 支持，其他架构返回 -ENOSYS
+ */
+int dune_vm_reserve(unsigned long size, void **va);
+int dune_vm_map(void *va, void *pa, unsigned long len, int prot);
+int dune_vm_unmap(void *va, unsigned long len);
+int dune_vm_protect(void *va, unsigned long len, int prot);
+int dune_vm_shootdown(void);
+#define DUNE_VM_NOHUGE 0x1000
+
+/**
+ * guest 中的缺页处理 : dune_fault_register 注册整个进程的 handler, guest 页表
+ * (dune_vm_reserve 保留的地址) 中没有映射或者没有权限的访问在 guest 中直接调用
+ * handler, 不会 vm exit 。handler 返回 0 的时候从 fault->pc 继续执行，可以
+ * 修改 pc 和 regs (下标是寄存器编号，sp 和 tp 除外), 例如映射缺少的页之后
+ * 重新执行，或者跳转到空指针检查的慢速路径。返回非 0 或者没有 handler 的时候
+ * host 和内核一样发出 SIGSEGV (si_addr 是出错的地址)。
+ *
+ * 注意 SIGSEGV 的信号处理函数在 guest 之外的 host 线程中运行 : ucontext 是
+ * host 的现场，不是出错的指令，修改它不能改变 guest 的 pc 和寄存器,
+ * siglongjmp 回 guest 中保存的位置也不行，dune_vm_* 不能在其中调用。所以
+ * 需要恢复执行的处理 (隐式的空指针检查等) 只能放在 handler 中。信号处理函数
+ * 返回之后进程按照 SIGSEGV 的默认处理结束，不会重新执行出错的指令。
+ *
+ * handler 在关中断的状态下运行，和信号处理函数有相同的限制。默认使用出错的
+ * 线程的栈，处理栈溢出需要先用 dune_fault_altstack 为当前线程设置备用的栈。
+ * identity mapping 中 host 没有映射的地址由 KVM 报告，不经过 handler, 只能
+ * 得到上面的 SIGSEGV 。
+ * 目前只有 loongarch 支持，其他架构返回 -ENOSYS
+ */
+#define DUNE_FAULT_LOAD 1 // 读取没有映射的页
+#define DUNE_FAULT_STORE 2 // 写入没有映射的页
+#define DUNE_FAULT_FETCH 3 // 从没有映射的页取指
+#define DUNE_FAULT_MODIFY 4 // 写入只读的页
+#define DUNE_FAULT_NOREAD 5 // 读取不可读的页
+#define DUNE_FAULT_NOEXEC 6 // 执行不可执行的页
+#define DUNE_FAULT_PRIV 7 // 权限级别不够
+#define DUNE_FAULT_ADDR 8 // 非法的地址
+
+struct dune_fault {
+	unsigned long addr;
+	unsigned long pc;
+	int type; // DUNE_FAULT_*
+	unsigned long long *regs;
+};
+typedef int (*dune_fault_handler_t)(struct dune_fault *fault);
+
+int dune_fault_register(dune_fault_handler_t handler);
+// 必须在 DUNE_ENTER 之后调用，size 为 0 的时候取消
+int dune_fault_altstack(void *stack, unsigned long size);
+
+/**
+ * 写入跟踪 : region 是 dune_vm_reserve 保留的地址中用 16K 的页映射的一段
+ * (DUNE_VM_NOHUGE, 不能包含大页), 地址和长度按照 16K 对齐。dune_dirty_begin
+ * 之后第一次写入每一页会在 guest 中标记这一页，不会 vm exit 。
+ * dune_dirty_collect 把 begin 或者上一次 collect 之后被写过的页写入 bitmap
+ * (每一页一位，共 (size / 16K + 63) / 64 个 unsigned long long), 返回被写过的
+ * 页数，同时重新开始跟踪。扫描在 guest 中完成，有页被写过并且存在其他 vcpu
+ * (包括 prewarm 中空闲的 vcpu) 的时候需要一次 DUNE_SYS_VM_SHOOTDOWN 的
+ * hypercall, 和 dune_vm_shootdown 一样等待所有 vcpu 完成。collect 期间被写入
+ * 的页可能在下一次 collect 中再次报告，但是不会漏掉。dune_dirty_end 停止跟踪。
+ *
+ * 只跟踪 begin 的时候已经映射的页，之后 dune_vm_map 的页不跟踪。host 的
+ * syscall 直接写入的内存 (例如 read 的缓冲区) 不会被记录。
+ * 必须在 DUNE_ENTER 之后调用，不支持 guest 页表的时候返回 -ENOSYS
+ */
+struct dune_dirty_region {
+	void *addr;
+	unsigned long size;
+};
+
+int dune_dirty_begin(const struct dune_dirty_region *region);
+long dune_dirty_collect(const struct dune_dirty_region *region,
+			unsigned long long *bitmap);
+int dune_dirty_end(const struct dune_dirty_region *region);
+
+/**
+ * JIT 的代码区 : dune_jit_region_init 分配 size 字节 (按照 16K 对齐) 的内存，
+ * 用 dune_vm_map 映射到 region->addr, 初始权限是 PROT_READ | PROT_WRITE 。这块
+ * 内存在 guest 中只能通过 region->addr 访问，在 host 中不可执行。
+ * dune_jit_writable 和 dune_jit_executable 把 [addr, addr + len) 在
+ * PROT_READ | PROT_WRITE 和 PROT_READ | PROT_EXEC 之间切换，只修改 guest 的
+ * 页表和当前 vcpu 的 TLB, 不经过 host 的 mprotect 。
+ *
+ * 会访问 region 的线程需要先调用 dune_jit_attach, 切换权限的时候只有其他
+ * attach 过的 vcpu 需要 shootdown, 没有其他 vcpu 的时候不会 vm exit 。调用
+ * 切换的线程自动 attach 。dune_jit_executable 返回之前同步了当前 vcpu 的
+ * 指令流水线。每一个 region 占用 2 * size 向上对齐到 64G 的虚拟地址空间。
+ * 必须在 DUNE_ENTER 之后调用，不支持 guest 页表的时候返回 -ENOSYS
+ */
+#define DUNE_JIT_MAX_VCPUS 4096
+
+struct dune_jit_region {
+	void *addr;
+	unsigned long size;
+	// 私有 : attach 过的 vcpu
+	unsigned long long sharers[DUNE_JIT_MAX_VCPUS / 64];
+};
+
+int dune_jit_region_init(struct dune_jit_region *region, unsigned long size);
+int dune_jit_attach(struct dune_jit_region *region);
+int dune_jit_writable(struct dune_jit_region *region, void *addr,
+		      unsigned long len);
+int dune_jit_executable(struct dune_jit_region *region, void *addr,
+			unsigned long len);
+
+/**
+ * M:N 用户线程 : nr_workers 个 worker 线程 (各占用一个 vcpu) 运行任意多个
+ * uthread, 切换在 guest 中完成，不会导致 vm exit 。slice_us 不为 0 的时候打开
+ * guest 的 stable timer, 连续运行超过 slice_us 的 uthread 在时钟中断中被抢占,
+ * 为 0 的时候只在 dune_uthread_yield 和结束的时候切换。
+ *
+ * uthread 会在 worker 之间迁移，所以不能依赖 TLS (包括 errno) 和 gettid,
+ * 阻塞的 syscall 会占住整个 worker, 可以交给 dune_syscall_submit 。被抢占的时候
+ * 不能持有 libc 内部的锁，调用 malloc / stdio 之类的函数需要放在
+ * dune_uthread_preempt_disable 和 dune_uthread_preempt_enable 之间。
+ * 必须在 DUNE_ENTER 之后调用，目前只有 loongarch 支持，其他架构返回 -ENOSYS
+ */
+int dune_uthread_init(int nr_workers, unsigned long slice_us);
+// 在 uthread 或者普通的线程中创建 uthread
+int dune_uthread_spawn(void (*fn)(void *), void *arg);
+void dune_uthread_yield(void);
+void dune_uthread_exit(void);
+void dune_uthread_preempt_disable(void);
+void dune_uthread_preempt_enable(void);
+// 在普通的线程中等待所有的 uthread 结束，然后回收 worker
+int dune_uthread_wait(void);
+
+struct dune_uthread_stats {
+	unsigned long long switches;
+	unsigned long long preemptions;
+	unsigned long long ticks; // worker 收到的时钟中断
+};
+
+int dune_uthread_stats(struct dune_uthread_stats *stats);
+
+/**
+ * vcpu 之间的 IPI : dune_ipi_register 为当前线程注册 handler, 返回其他线程
+ * dune_ipi_send 使用的 cpu 编号。发送者把 vector (0 到 DUNE_IPI_VECTORS - 1)
+ * 交给 host 注入中断，接收者在 guest 中直接调用 handler, 不会导致 vm exit 。
+ * 同一个 vector 在处理之前多次发送只会调用一次 handler 。
+ *
+ * handler 在关中断的状态下打断当前的代码执行，和信号处理函数一样不能获取锁,
+ * 也不能调用 dune_uthread_yield, 适合设置标志或者放入无锁队列。接收者在 host
+ * 中执行 syscall 的时候 IPI 会推迟到 syscall 返回之后，所以适合在 guest 中
+ * 自旋等待的线程。线程退出之后 cpu 编号会被其他线程复用。
+ * 目前只有 loongarch 支持，其他架构返回 -ENOSYS
+ */
+#define DUNE_IPI_VECTORS 64
+typedef void (*dune_ipi_handler_t)(int vector);
+
+int dune_ipi_register(dune_ipi_handler_t handler);
+// 目标没有注册 handler 的时候返回 -ESRCH
+int dune_ipi_send(int cpu, int vector);
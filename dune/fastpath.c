@@ -0,0 +1,91 @@
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "interface.h"
+#include "dune.h"
+
+// guest 的 syscall vector 首先检查 fastpath_bitmap, 如果 sysno 对应的位被设置,
+// 直接把 fastpath_value 作为返回值，整个 syscall 不会导致 vm exit 。
+//
+// 表只会被 vcpu 自己的 host 线程修改，此时 guest 停在 HYPERCALL 上，所以无需同步。
+// getpid 和 gettid 在一个 vcpu 的生命周期中不会变化，每次 vcpu 开始在一个线程上
+// 运行的时候 (host_loop 的入口，fork 之后切换 vcpu) 重新填充; 其余的项由
+// dune_fastpath_set 设置，fork / clone 的时候被 child 继承。
+//
+// sched_getcpu / getcpu 不在默认的表中 : host 线程随时可能迁移，固定的值是错误的。
+
+static void fastpath_set(struct kvm_cpu *vcpu, u64 idx, long value)
+{
+	vcpu->fastpath_value[idx] = value;
+	vcpu->fastpath_bitmap[idx / 64] |= 1ULL << (idx % 64);
+}
+
+static void fastpath_clear(struct kvm_cpu *vcpu, u64 idx)
+{
+	vcpu->fastpath_bitmap[idx / 64] &= ~(1ULL << (idx % 64));
+}
+
+void fastpath_refresh(struct kvm_cpu *vcpu)
+{
+	BUILD_ASSERT(SYS_GETPID - SYSCALL_BASE < FASTPATH_NR);
+	BUILD_ASSERT(SYS_GETTID - SYSCALL_BASE < FASTPATH_NR);
+
+	fastpath_set(vcpu, SYS_GETPID - SYSCALL_BASE, getpid());
+	fastpath_set(vcpu, SYS_GETTID - SYSCALL_BASE, syscall(SYS_gettid));
+}
+
+void fastpath_inherit(struct kvm_cpu *child_cpu,
+		      const struct kvm_cpu *parent_cpu)
+{
+	memcpy(child_cpu->fastpath_bitmap, parent_cpu->fastpath_bitmap,
+	       sizeof(child_cpu->fastpath_bitmap));
+	memcpy(child_cpu->fastpath_value, parent_cpu->fastpath_value,
+	       sizeof(child_cpu->fastpath_value));
+}
+
+// 只有不通过用户的内存返回结果的 syscall 可以被替换。uname, prlimit64 之类的
+// syscall 把结果写入参数指向的 buffer, 直接返回 value 的时候 buffer 没有被写入
+static bool fastpath_allowed(u64 sysno)
+{
+	switch (sysno) {
+	case SYS_getpid:
+	case SYS_getppid:
+	case SYS_gettid:
+	case SYS_getuid:
+	case SYS_geteuid:
+	case SYS_getgid:
+	case SYS_getegid:
+	case SYS_sched_yield:
+		return true;
+	default:
+		return false;
+	}
+}
+
+long fastpath_program(struct kvm_cpu *vcpu, u64 sysno, long value,
+		      bool enable)
+{
+	u64 idx = sysno - SYSCALL_BASE;
+	if (idx >= FASTPATH_NR || !fastpath_allowed(sysno))
+		return -EINVAL;
+
+	if (enable)
+		fastpath_set(vcpu, idx, value);
+	else
+		fastpath_clear(vcpu, idx);
+	return 0;
+}
+
+int dune_fastpath_set(long sysno, long value)
+{
+	long ret = syscall(DUNE_SYS_FASTPATH, sysno, value, 1);
+	return ret == -1 ? -errno : ret;
+}
+
+int dune_fastpath_clear(long sysno)
+{
+	long ret = syscall(DUNE_SYS_FASTPATH, sysno, 0, 0);
+	return ret == -1 ? -errno : ret;
+}
@@ -0,0 +1,153 @@
+#include <errno.h>
+#include <signal.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "interface.h"
+#include "dune.h"
+
+// guest 中的缺页处理 : ebase 中 TLB 异常和 ADE 的 vector 把出错的位置保存在
+// struct kvm_cpu 的 fault_era 等成员中，然后 ertn 到 fault_entry 。fault_entry
+// 在关中断的状态下保存现场 (设置了 fault_stack 的时候先切换栈), 调用
+// fault_dispatch, 由应用注册的 handler 处理，不经过 host_loop 。
+//
+// 没有 handler 或者 handler 不处理的时候发出 DUNE_SYS_FAULT, host 和内核的
+// force_sig 一样把 SIGSEGV 发给 vcpu 线程自己。信号处理函数在 host_loop 中运行,
+// ucontext 是 host 的现场而不是出错的指令，其中的 dune_vm_* 也不能修改 guest
+// 页表，所以处理函数返回之后按照默认的方式结束进程，不重新执行。KVM 报告的
+// host 中没有映射的地址 (例如 identity mapping 中的空指针) 也是这样处理。
+
+static dune_fault_handler_t fault_handler;
+
+int dune_fault_register(dune_fault_handler_t handler)
+{
+#ifndef ARCH_HAS_FAULT
+	return -ENOSYS;
+#else
+	__atomic_store_n(&fault_handler, handler, __ATOMIC_RELEASE);
+	return 0;
+#endif
+}
+
+int dune_fault_altstack(void *stack, unsigned long size)
+{
+#ifndef ARCH_HAS_FAULT
+	return -ENOSYS;
+#else
+	struct kvm_cpu *vcpu =
+		(struct kvm_cpu *)((char *)arch_syscall_parameter() -
+				   offsetof(struct kvm_cpu, syscall_parameter));
+	if (size == 0) {
+		vcpu->fault_stack = 0;
+		vcpu->fault_stack_size = 0;
+		return 0;
+	}
+	if (stack == NULL || size < PAGESIZE)
+		return -EINVAL;
+
+	// 栈顶按照 16 字节对齐，先设置大小，vector 看到 fault_stack 的时候已经有效
+	u64 top = ((u64)stack + size) & ~15ULL;
+	vcpu->fault_stack_size = top - (u64)stack;
+	__atomic_store_n(&vcpu->fault_stack, top, __ATOMIC_RELEASE);
+	return 0;
+#endif
+}
+
+void fault_init_vcpu(struct kvm_cpu *vcpu)
+{
+#ifdef ARCH_HAS_FAULT
+	vcpu->fault_entry = (u64)fault_entry;
+#endif
+}
+
+// vcpu 被释放的时候调用，备用的栈属于原来的线程
+void fault_reset_vcpu(struct kvm_cpu *vcpu)
+{
+	vcpu->fault_stack = 0;
+	vcpu->fault_stack_size = 0;
+}
+
+static int fault_si_code(u64 type)
+{
+	switch (type) {
+	case DUNE_FAULT_MODIFY:
+	case DUNE_FAULT_NOREAD:
+	case DUNE_FAULT_NOEXEC:
+	case DUNE_FAULT_PRIV:
+		return SEGV_ACCERR;
+	default:
+		return SEGV_MAPERR;
+	}
+}
+
+static void fault_queue(siginfo_t *info)
+{
+	// si_code 大于 0 的信号只能发给自己，从 syscall 返回的时候处理
+	if (syscall(SYS_rt_tgsigqueueinfo, getpid(), syscall(SYS_gettid),
+		    SIGSEGV, info))
+		die("fault_signal : rt_tgsigqueueinfo");
+}
+
+// 不会返回 : 先交给应用的信号处理函数，返回之后恢复默认的处理再发一次
+long fault_signal(struct kvm_cpu *vcpu, u64 addr, u64 type)
+{
+	siginfo_t info = { 0 };
+	info.si_signo = SIGSEGV;
+	info.si_code = fault_si_code(type);
+	info.si_addr = (void *)addr;
+
+	// 和内核的 force_sig 一样，被忽略或者屏蔽的时候恢复默认的处理
+	struct sigaction sa;
+	sigset_t unblock;
+	sigemptyset(&unblock);
+	sigaddset(&unblock, SIGSEGV);
+	sigaction(SIGSEGV, NULL, &sa);
+	if (sa.sa_handler == SIG_IGN)
+		signal(SIGSEGV, SIG_DFL);
+	sigprocmask(SIG_UNBLOCK, &unblock, NULL);
+	fault_queue(&info);
+
+	signal(SIGSEGV, SIG_DFL);
+	sigprocmask(SIG_UNBLOCK, &unblock, NULL);
+	fault_queue(&info);
+	die("SIGSEGV at %llx, vcpu=%d can not resume", addr, vcpu->cpu_id);
+	return 0;
+}
+
+// host_loop 中不是 HYPERCALL 的 exit 。KVM 把 host 中没有映射的地址当作 MMIO
+void fault_host_exit(struct kvm_cpu *vcpu)
+{
+	struct kvm_run *run = vcpu->kvm_run;
+	if (run->exit_reason != KVM_EXIT_MMIO)
+		die("KVM_EXIT_IS_NOT_HYPERCALL vcpu=%d exit_reason=%d",
+		    vcpu->cpu_id, run->exit_reason);
+
+	u64 type = run->mmio.is_write ? DUNE_FAULT_STORE : DUNE_FAULT_LOAD;
+	fault_signal(vcpu, run->mmio.phys_addr, type);
+}
+
+// 在 guest 中由 fault_entry 调用，frame 是 fault_entry 保存的现场
+void fault_dispatch(u64 *syscall_parameter, u64 *frame)
+{
+#ifdef ARCH_HAS_FAULT
+	struct kvm_cpu *vcpu =
+		(struct kvm_cpu *)((char *)syscall_parameter -
+				   offsetof(struct kvm_cpu, syscall_parameter));
+	struct dune_fault fault = {
+		.addr = vcpu->fault_addr,
+		.pc = frame[ARCH_FAULT_FRAME_PC],
+		.type = vcpu->fault_code,
+		.regs = (unsigned long long *)frame,
+	};
+
+	dune_fault_handler_t handler =
+		__atomic_load_n(&fault_handler, __ATOMIC_ACQUIRE);
+	if (handler != NULL && handler(&fault) == 0) {
+		frame[ARCH_FAULT_FRAME_PC] = fault.pc;
+		return;
+	}
+	// 不会返回，见 fault_signal
+	syscall(DUNE_SYS_FAULT, fault.addr, fault.type);
+#endif
+}
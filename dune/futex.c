@@ -0,0 +1,99 @@
+#include <stdlib.h>
+#include <linux/futex.h>
+
+#include "interface.h"
+
+// 同一个进程中的线程之间的 private futex, 只处理带有 FUTEX_PRIVATE_FLAG 的
+// FUTEX_WAIT(_BITSET) 和 FUTEX_WAKE(_BITSET) :
+//
+// FUTEX_WAIT : guest 的 syscall vector 先检查 *uaddr, 不等于 val 的时候直接返回
+// -EAGAIN, 否则自旋 futex_spin 次之后才 HYPERCALL 。host_loop 根据等待的时间调整
+// futex_spin : 很快被唤醒说明锁的持有时间短，下一次多自旋一些，睡眠很长的时候
+// 减少，类似 glibc 的 PTHREAD_MUTEX_ADAPTIVE_NP 。
+//
+// FUTEX_WAKE : host 中正在等待的 FUTEX_WAIT 按照 uaddr 的 hash 在 futex_waiters
+// 中计数，设置 DUNE_FUTEX_ELIDE=1 之后 guest 的 vector 发现计数为 0 的时候直接
+// 返回 0 。waiter 先增加计数再由内核检查 *uaddr, waker 先修改 *uaddr 再读取计数,
+// 所以两者之中至少有一个看到对方。只有经过 host_loop, sidecar, batch 和 sysring
+// 的等待才会被计数，libdune 的 host 代码在 glibc 内部的锁 (例如 malloc) 上等待
+// 的时候不计数，对应的唤醒可能被省略，所以默认关闭。
+//
+// 计数和 vm 无关，fork 出来的 child 继承 parent 中的计数，只会让省略变少
+
+#define FUTEX_SPIN_MIN 16
+#define FUTEX_SPIN_MAX 2048
+// 等待时间在这个范围之内认为自旋有希望等到
+#define FUTEX_SPIN_WINDOW_NS 20000
+
+static u64 futex_waiters[FUTEX_HASH_SIZE];
+
+void futex_init(struct kvm_vm *vm)
+{
+	const char *env = getenv("DUNE_FUTEX_ELIDE");
+	vm->futex_elide = env != NULL && atoi(env) != 0;
+}
+
+// 在 vcpu 创建和被 kvm_alloc_vcpu 复用的时候调用
+void futex_init_vcpu(struct kvm_cpu *vcpu)
+{
+	vcpu->futex_waiters = vcpu->vm->futex_elide ? (u64)futex_waiters : 0;
+	vcpu->futex_spin = FUTEX_SPIN_MIN;
+}
+
+// 不是 private 的 FUTEX_WAIT 的时候返回 NULL
+static u64 *futex_waiter_add(u64 uaddr, u64 op)
+{
+	u64 cmd = op & FUTEX_CMD_MASK;
+	if (!(op & FUTEX_PRIVATE_FLAG) ||
+	    (cmd != FUTEX_WAIT && cmd != FUTEX_WAIT_BITSET))
+		return NULL;
+
+	u64 *waiters = &futex_waiters[(uaddr >> 2) & (FUTEX_HASH_SIZE - 1)];
+	// 必须在内核检查 *uaddr 之前对其他 vcpu 可见
+	__atomic_fetch_add(waiters, 1, __ATOMIC_SEQ_CST);
+	return waiters;
+}
+
+static void futex_waiter_remove(u64 *waiters)
+{
+	if (waiters)
+		__atomic_fetch_sub(waiters, 1, __ATOMIC_RELEASE);
+}
+
+// 在 vcpu 执行 futex 之前调用，返回值交给 futex_wait_end
+u64 *futex_wait_begin(struct kvm_cpu *vcpu)
+{
+	u64 *waiters = futex_waiter_add(arch_get_syscall_arg(vcpu, 0),
+					arch_get_syscall_arg(vcpu, 1));
+	if (waiters)
+		vcpu->futex_wait_begin = stats_now();
+	return waiters;
+}
+
+void futex_wait_end(struct kvm_cpu *vcpu, u64 *waiters)
+{
+	if (waiters == NULL)
+		return;
+	futex_waiter_remove(waiters);
+
+	u64 spin = vcpu->futex_spin;
+	if (stats_now() - vcpu->futex_wait_begin < FUTEX_SPIN_WINDOW_NS) {
+		spin = spin ? spin * 2 : FUTEX_SPIN_MIN;
+		if (spin > FUTEX_SPIN_MAX)
+			spin = FUTEX_SPIN_MAX;
+	} else {
+		spin /= 2;
+		if (spin < FUTEX_SPIN_MIN)
+			spin = 0;
+	}
+	vcpu->futex_spin = spin;
+}
+
+// 不在 vcpu 对应的线程中执行的 futex, 例如 batch 和 sysring 的 worker
+long futex_raw_syscall(const u64 args[6])
+{
+	u64 *waiters = futex_waiter_add(args[0], args[1]);
+	long ret = arch_raw_syscall(SYS_FUTEX, args);
+	futex_waiter_remove(waiters);
+	return ret;
+}
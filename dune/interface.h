@@ -4,6 +4,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/utsname.h>
 #include "config.h"
 
 #if ARCH == MIPS_ARCH
@@ -30,34 +32,262 @@ void die(const char *err, ...);
 		(void)sizeof(char[1 - 2 * !(cond)]);                           \
 	} while (0)
 
+// 结果只会被 host_loop 能够看到的 syscall 修改的 syscall, 见 syscall_cache.c
+// 每一个缓存项都记录填充时的 gen, 和 vm 当前的 gen 相同才有效
+enum VCPU_CACHE_ITEM {
+	CACHE_PID,
+	CACHE_TID,
+	CACHE_UID,
+	CACHE_EUID,
+	CACHE_GID,
+	CACHE_EGID,
+	NR_VCPU_CACHE_ITEMS,
+};
+
+struct vcpu_syscall_cache {
+	u64 gen[NR_VCPU_CACHE_ITEMS];
+	long val[NR_VCPU_CACHE_ITEMS];
+};
+
+struct vm_syscall_cache {
+	u64 gen; // 任何可能修改缓存结果的 syscall 完成之后加一
+	pthread_spinlock_t lock; // 保护 uname 和 rlimit
+
+	u64 uname_gen;
+	struct utsname uname;
+	u64 rlimit_gen[RLIM_NLIMITS];
+	struct rlimit rlimit[RLIM_NLIMITS];
+
+	u64 hits;
+	u64 misses;
+	u64 invalidations;
+};
+
+#define FASTPATH_NR 256
+
+// host_loop 的统计, 见 stats.c 。延迟按照 log2(ns) 分桶
+#define STATS_BUCKETS 32
+#define STATS_EXIT_REASONS 64
+
+struct syscall_stat {
+	u64 count;
+	u64 total_ns;
+	u64 hist[STATS_BUCKETS];
+};
+
+struct vcpu_stats {
+	struct syscall_stat syscalls[SYSCALL_TABLE_SIZE];
+	struct syscall_stat other; // 不在 syscall 表范围内的 syscall
+	u64 exits[STATS_EXIT_REASONS];
+};
+
+// DUNE_PHASE_TIMING : 一次 hypercall 往返中每一个阶段的时间, 见 phase.c
+// guest 的 syscall vector 写入的时间戳, 使用 guest 的 stable counter
+enum PHASE_GUEST_STAMP {
+	PHASE_G_VECTOR, // 进入 syscall vector 的慢速路径
+	PHASE_G_HYPERCALL, // 执行 HYPERCALL 之前
+	PHASE_G_RESUME, // HYPERCALL 返回之后
+	NR_PHASE_GUEST_STAMPS,
+};
+
+// host_loop 记录的时间戳，使用 host 的 stable counter
+enum PHASE_HOST_STAMP {
+	PHASE_H_RUN_ENTER, // ioctl(KVM_RUN) 之前
+	PHASE_H_RUN_EXIT, // ioctl(KVM_RUN) 返回之后
+	PHASE_H_SYSCALL_BEGIN, // arch_do_syscall 之前
+	PHASE_H_SYSCALL_END, // arch_do_syscall 之后
+	NR_PHASE_HOST_STAMPS,
+};
+
+// 和 dune.h 中的 enum DUNE_PHASE 保持一致
+enum PHASE {
+	PHASE_VECTOR, // G_VECTOR -> G_HYPERCALL
+	PHASE_EXIT, // G_HYPERCALL -> H_RUN_EXIT
+	PHASE_DISPATCH, // H_RUN_EXIT -> H_SYSCALL_BEGIN, 没有 syscall 时到 H_RUN_ENTER
+	PHASE_SYSCALL, // H_SYSCALL_BEGIN -> H_SYSCALL_END
+	PHASE_RETURN, // H_SYSCALL_END -> H_RUN_ENTER
+	PHASE_ENTRY, // H_RUN_ENTER -> G_RESUME
+	NR_PHASES,
+};
+
+struct vcpu_phase {
+	u64 host[NR_PHASE_HOST_STAMPS];
+	s64 guest_offset; // guest counter - host counter
+	bool exit_pending; // 刚刚从 HYPERCALL 退出，host 中的阶段还没有统计
+	bool entry_pending; // 等待下一次退出的时候统计 PHASE_ENTRY
+	struct syscall_stat phases[NR_PHASES];
+};
+
+struct trace_header;
+struct trace_record;
+
 struct kvm_cpu;
 struct vcpu_pool_ele {
-	bool valid;
 	struct kvm_cpu *vcpu;
 };
 
+// kvm_shard::vcpu_pool 中 slot 的状态，第 i 位对应 vcpu_pool[i], 只通过原子
+// 操作修改，见 vcpu_slots.c
+#define VCPU_SLOT_WORDS ((KVM_MAX_VCPUS + 63) / 64)
+struct vcpu_slots {
+	u64 busy[VCPU_SLOT_WORDS]; // 被线程使用或者正在被 prewarm 线程初始化
+	u64 created[VCPU_SLOT_WORDS]; // vcpu_pool[i].vcpu 已经创建，不会被清除
+	u64 warm[VCPU_SLOT_WORDS]; // 空闲并且 prewarmed
+	u64 claims;
+	u64 contended; // 抢占 busy 的时候 CAS 失败的次数
+};
+
+enum VCPU_SLOT_CLASS {
+	VCPU_SLOT_WARM, // 空闲并且 prewarmed
+	VCPU_SLOT_CREATED, // 空闲并且已经创建
+	VCPU_SLOT_COLD, // 空闲，已经创建但是没有 prewarmed
+	VCPU_SLOT_EMPTY, // 还没有创建
+};
+
+// DUNE_VCPU_POOL, 后台线程提前创建并初始化的空闲 vcpu, 见 prewarm.c
+struct vcpu_prewarm {
+	int target; // 保持的空闲 vcpu 数量, 0 表示关闭
+	int warm; // 空闲并且 prewarmed 的 vcpu 数量，原子操作修改
+	bool started;
+	const struct kvm_cpu *model; // 提供 ebase
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	u64 kicks; // 受 mutex 保护
+};
+
+// DUNE_AFFINITY, vcpu 线程在 host cpu 上的放置策略，见 affinity.c
+#define AFFINITY_MAX_CPUS 1024
+enum AFFINITY_POLICY {
+	AFFINITY_NONE, // 不限制，只统计迁移
+	AFFINITY_SOFT, // 限制在 home cpu 所在的 LLC 中
+	AFFINITY_PIN, // 绑定在 home cpu 上
+	AFFINITY_NR,
+};
+
+struct vm_affinity {
+	enum AFFINITY_POLICY policy;
+	pthread_mutex_t lock;
+	u64 allowed[AFFINITY_MAX_CPUS / 64]; // 进程的 cpuset, 受 lock 保护
+	short llc[AFFINITY_MAX_CPUS]; // 共享 LLC 的 cpu 中编号最小的一个
+	int load[AFFINITY_MAX_CPUS]; // home 为这个 cpu 的 vcpu 个数，受 lock 保护
+};
+
+struct vcpu_affinity {
+	bool placed; // 已经按照 policy 设置了线程的 affinity
+	bool synced; // host_cpu 已经和当前的线程同步
+	int home;
+	int cpunum; // 上一次写入 guest CPUNUM / TIMERID 的值，-1 表示没有写入
+	u64 migrations;
+	// 迁移之后 AFFINITY_WINDOW_NS 之内的 TLB refill, window_start 为 0 表示
+	// 不在窗口中
+	u64 window_start;
+	u64 window_refills;
+	u64 post_refills;
+	u64 post_ns;
+	u64 windows;
+};
+
+struct kvm_vm;
+// 一个 KVM 虚拟机。kvm_vm 中所有的 shard 都满了的时候创建新的 shard, 每一个
+// shard 映射相同的内存，所以线程可以放在任意一个 shard 中，见 kvm_add_shard
+struct kvm_shard {
+	int index;
+	int vm_fd;
+	struct kvm_vm *vm;
+	struct vcpu_pool_ele vcpu_pool[KVM_MAX_VCPUS];
+	struct vcpu_slots slots;
+};
+
+#define KVM_MAX_SHARDS 64
+
+// 一个 dune 进程，包含一个或者多个 shard
 struct kvm_vm {
 	int sys_fd;
-	int vm_fd;
 	int kvm_run_mmap_size;
-#ifdef DUNE_DEBUG
-	int debug_fd;
-#endif
+	int max_vcpus; // 每一个 shard 中 vcpu 的上限，来自 KVM_CAP_MAX_VCPUS
 
-	struct vcpu_pool_ele vcpu_pool[KVM_MAX_VCPUS];
-	pthread_spinlock_t lock;
+	struct kvm_shard *shards[KVM_MAX_SHARDS];
+	int nr_shards; // 只会增加，原子读取
+	pthread_mutex_t shard_lock; // 创建 shard 的时候持有
+
+	struct vm_syscall_cache cache;
+	int stats_fd; // DUNE_STATS, 在 exit_group 的时候输出统计, -1 表示不输出
+	char *trace_prefix; // DUNE_TRACE, NULL 表示不 trace
+	u32 trace_capacity;
+	u64 phase_scale; // counter 转换为 ns : (ticks * phase_scale) >> 32
+	struct vcpu_prewarm prewarm;
+	bool futex_elide; // DUNE_FUTEX_ELIDE, guest 省略没有等待者的 FUTEX_WAKE
+	struct vm_affinity affinity;
 };
 
 // reference : kvmtool/mips/include/kvm/kvm-cpu-arch.h
 struct kvm_cpu {
-	int cpu_id;
+	int cpu_id; // shard 中的编号
 	struct kvm_vm *vm;
+	struct kvm_shard *shard;
 	int vcpu_fd; /* For VCPU ioctls() */
 	struct kvm_run *kvm_run;
 	u64 syscall_parameter[8];
+	// guest 的 syscall vector 和 sidecar 线程通过它交接 syscall, 必须紧跟在
+	// syscall_parameter 之后，entry.S 中通过固定的偏移访问
+	u64 sidecar_mailbox;
+	// syscall 指令的地址，由 guest 的 syscall vector 保存，用于 trace
+	u64 syscall_era;
+	// DUNE_PHASE_TIMING 的时候 guest 的 syscall vector 写入的时间戳
+	u64 phase_stamp[NR_PHASE_GUEST_STAMPS];
+	// guest 的 syscall vector 直接使用 fastpath_value 作为返回值的 syscall,
+	// 下标是 sysno - SYSCALL_BASE, 见 fastpath.c
+	u64 fastpath_bitmap[FASTPATH_NR / 64];
+	long fastpath_value[FASTPATH_NR];
+	// ipi.c : 其他线程在 ipi_pending 中设置 vector 之后注入 ARCH_IPI_IRQ, guest 的
+	// 中断 vector 在 ipi_handler 不为 0 的时候把 ERA 换成 ipi_entry, 被打断的
+	// 地址保存在 ipi_era 。这些成员也通过固定的偏移访问
+	u64 ipi_pending;
+	u64 ipi_handler;
+	u64 ipi_entry;
+	u64 ipi_era;
+	u64 ipi_scratch;
+	// futex.c : guest 的 syscall vector 读取，futex_waiters 为 0 的时候不省略
+	// FUTEX_WAKE, futex_spin 是 FUTEX_WAIT 在 HYPERCALL 之前自旋的次数
+	u64 futex_waiters;
+	u64 futex_spin;
+	// guest 的 TLB refill vector 计数，见 affinity.c
+	u64 tlb_refills;
+	// 每一次 KVM_RUN 之前由 affinity_check 更新的 host cpu 和 NUMA node, guest
+	// 的 syscall vector 用它们直接完成 getcpu
+	u64 host_cpu;
+	u64 host_node;
+	// pgtable.c : 不为 0 的时候 IPI 的 vector 清空 guest 的 TLB
+	u64 tlb_flush;
+	// fault.c : TLB 异常和 ADE 的 vector 把 ERA 换成 fault_entry, 出错的位置
+	// 保存在 fault_era 等成员中。fault_stack 是 dune_fault_altstack 设置的栈顶
+	u64 fault_entry;
+	u64 fault_era;
+	u64 fault_prmd;
+	u64 fault_addr;
+	u64 fault_code;
+	u64 fault_scratch;
+	u64 fault_stack;
+	u64 fault_stack_size;
 
 	// architecture specified vm state
 	struct thread_info info;
+
+	pthread_t sidecar_thread;
+	struct vcpu_syscall_cache cache;
+	// vcpu 被 kvm_alloc_vcpu 复用的时候不会清零，所以 vm 的统计是累计的
+	struct vcpu_stats stats;
+	struct trace_header *trace;
+	struct trace_record *trace_pending; // 正在处理的 syscall 对应的 record
+	struct vcpu_phase phase;
+	// 由 prewarm 线程初始化之后还没有运行过，init_child_thread_info 可以跳过
+	// 和线程无关的初始化
+	bool prewarmed;
+	u64 futex_wait_begin; // host_loop 中的 FUTEX_WAIT 开始的时间
+	struct vcpu_affinity affinity;
+	// 正在 KVM_RUN 中，pgtable_shootdown 只需要等待这些 vcpu
+	bool in_guest;
 };
 
 #define PROT_RWX (PROT_READ | PROT_WRITE | PROT_EXEC)
@@ -85,6 +315,14 @@ static inline void ebase_share(struct kvm_cpu *child_cpu,
 }
 
 void vacate_current_stack(struct kvm_cpu *cpu);
+struct kvm_cpu *kvm_create_vcpu(struct kvm_shard *shard, int cpu_id);
+struct kvm_shard *kvm_add_shard(struct kvm_vm *vm);
+
+// 进程中唯一的 vcpu 编号，用于 trace 之类的输出
+static inline int vcpu_global_id(const struct kvm_cpu *vcpu)
+{
+	return vcpu->shard->index * KVM_MAX_VCPUS + vcpu->cpu_id;
+}
 void host_loop(struct kvm_cpu *vcpu);
 
 /** 
@@ -123,16 +361,78 @@ enum CLONE_TYPE{
   DIFF_VM_OLD_STACk, // do the fork, then create another vm
 };
 
+// host_loop 根据 syscall number 查表决定如何处理一个 hypercall
+enum SYSCALL_KIND {
+	SYSCALL_PASSTHROUGH = 0, // 直接交给 arch_do_syscall
+	SYSCALL_EXIT, // 释放 vcpu 之后再执行
+	SYSCALL_SET_THREAD_AREA, // 同步 tls 之后再执行
+	SYSCALL_FORK, // fork / clone / clone3 模拟
+	SYSCALL_SPECIAL, // arch_handle_special_syscall
+	SYSCALL_DENIED, // 不支持的 syscall
+	SYSCALL_DUNE, // libdune 自己定义的 syscall, 见 DUNE_SYSCALL_BASE
+	SYSCALL_THREAD_BOUND, // 和调用线程相关，只能在 vcpu 对应的线程中执行
+	SYSCALL_CACHED, // 结果可以缓存, 见 syscall_cache.c
+	SYSCALL_INVALIDATE, // 执行之后缓存失效
+	SYSCALL_EXIT_GROUP, // 进程退出之前输出统计
+	SYSCALL_FUTEX, // 统计 host 中等待的 private futex, 见 futex.c
+};
+
+// libdune 在 guest 中通过 syscall 指令向 host_loop 发出的请求。编号远大于任何
+// 真实的 syscall, 所以不在 dune 中执行的时候内核直接返回 ENOSYS
+#define DUNE_SYSCALL_BASE 0x100000
+enum DUNE_SYSCALL {
+	DUNE_SYS_SYSRING_INIT = DUNE_SYSCALL_BASE,
+	DUNE_SYS_SIDECAR,
+	DUNE_SYS_CACHE_STATS,
+	DUNE_SYS_FASTPATH,
+	DUNE_SYS_BATCH,
+	DUNE_SYS_STATS_SYSCALL,
+	DUNE_SYS_STATS_EXITS,
+	DUNE_SYS_STATS_DUMP,
+	DUNE_SYS_STATS_PHASE,
+	DUNE_SYS_FPU_ENABLE, // guest 第一次使用 FPU, 由异常 vector 发出
+	DUNE_SYS_VCPU_SLOTS,
+	DUNE_SYS_IPI_REGISTER,
+	DUNE_SYS_IPI_SEND,
+	DUNE_SYS_AFFINITY_STATS,
+	DUNE_SYS_VM_SHOOTDOWN,
+	DUNE_SYS_FAULT, // 没有被 guest 处理的异常，host 发出 SIGSEGV 之后结束进程
+};
+
+// sidecar_mailbox 的状态，guest 的 syscall vector 中有相同的定义
+enum SIDECAR_STATE {
+	SIDECAR_OFF = 0, // 没有 sidecar, 通过 HYPERCALL 交给 host_loop
+	SIDECAR_IDLE,
+	SIDECAR_REQUEST, // guest 已经保存好参数，等待 sidecar 执行
+	SIDECAR_DONE, // syscall_parameter 中是返回值
+	SIDECAR_BOUNCE, // sidecar 无法执行，guest 改用 HYPERCALL
+};
+
+enum SYSCALL_KIND syscall_kind(u64 sysno);
+
 void arch_dune_enter(struct kvm_cpu *cpu);
 void switch_stack(struct kvm_cpu *cpu, u64 host_stack);
 u64 arch_get_sysno(const struct kvm_cpu *cpu);
 enum CLONE_TYPE arch_get_clone_type(const struct kvm_cpu *parent_cpu, int sysno);
 bool arch_do_syscall(struct kvm_cpu *cpu, bool is_fork);
+// 直接在 host 中执行一个 syscall, 返回值和内核的约定相同，失败返回 -errno
+long arch_raw_syscall(u64 sysno, const u64 args[6]);
+u64 arch_get_syscall_arg(const struct kvm_cpu *cpu, int n);
+void arch_set_syscall_ret(struct kvm_cpu *cpu, long ret);
+long arch_get_syscall_ret(const struct kvm_cpu *cpu);
+// stable counter 的频率 (Hz), 和 arch_read_counter 配合使用
+u64 arch_counter_freq(void);
+// guest 读到的 counter 减去 host 读到的 counter
+s64 arch_guest_counter_offset(const struct kvm_cpu *cpu);
 void kvm_get_parent_thread_info(struct kvm_cpu *parent_cpu);
 // 设置 child 的 tls, stack, host_loop 的参数 vcpu
 void init_child_thread_info(struct kvm_cpu *child_cpu,
 			    const struct kvm_cpu *parent_cpu, int sysno);
 void arch_set_thread_area(struct kvm_cpu *vcpu);
+// 在 prewarm 线程中初始化一个空闲的 vcpu, model 是同一个 vm 中的 vcpu
+void arch_prewarm_vcpu(struct kvm_cpu *vcpu, const struct kvm_cpu *model);
+// 处理 DUNE_SYS_FPU_ENABLE, 返回 guest 需要在 EUEN 中打开的位
+long arch_enable_fpu(struct kvm_cpu *vcpu, u64 ecode);
 bool arch_handle_special_syscall(struct kvm_cpu *vcpu, u64 sysno);
 // 如果 fork 或者 clone 失败，创建的虚拟机和 vcpu 都需要销毁才对
 // 1. 如果是 fork / clone 模拟的时候失败, 因为 clone 是首先创建新的 vcpu 出来
@@ -143,6 +443,144 @@ bool arch_handle_special_syscall(struct kvm_cpu *vcpu, u64 sysno);
 // FIXME MIPS 架构的修改 : 调用者已经组装好参数
 void do_simulate_clone(struct kvm_cpu *parent_cpu, u64 child_host_stack);
 void escape(); // TODO
+
+// sysring.c
+int sysring_start(int nr_workers);
+
+// sidecar.c
+int sidecar_start(struct kvm_cpu *vcpu, int host_cpu);
+void sidecar_stop(struct kvm_cpu *vcpu);
+
+// syscall_cache.c
+void syscall_cache_init(struct kvm_vm *vm);
+void syscall_cache_reset_vcpu(struct kvm_cpu *vcpu);
+void syscall_cache_handle(struct kvm_cpu *vcpu, u64 sysno);
+void syscall_cache_invalidate(struct kvm_vm *vm);
+long syscall_cache_stats(struct kvm_vm *vm, u64 uaddr);
+
+// stats.c
+void stats_init(struct kvm_vm *vm);
+u64 stats_now();
+void stats_exit(struct kvm_cpu *vcpu, u32 reason);
+u64 stats_syscall_begin(struct kvm_cpu *vcpu, u64 sysno);
+void stats_syscall_end(struct kvm_cpu *vcpu, u64 sysno, u64 ns);
+void stats_record(struct syscall_stat *stat, u64 ns);
+void stats_merge(struct syscall_stat *sum, const struct syscall_stat *s);
+u64 stats_percentile(const struct syscall_stat *stat, int percent);
+long stats_query_syscall(struct kvm_vm *vm, u64 sysno, u64 uaddr);
+long stats_query_exits(struct kvm_vm *vm, u64 uaddr, u64 n);
+long stats_dump(struct kvm_vm *vm, int fd);
+void stats_dump_on_exit(struct kvm_vm *vm);
+
+// trace.c
+void trace_init(struct kvm_vm *vm);
+void trace_open(struct kvm_cpu *vcpu);
+void trace_syscall_begin(struct kvm_cpu *vcpu, u64 sysno, u64 ts);
+void trace_syscall_end(struct kvm_cpu *vcpu, u64 ns);
+
+// phase.c
+void phase_init(struct kvm_vm *vm);
+long phase_query(struct kvm_vm *vm, u64 uaddr);
+void phase_dump(struct kvm_vm *vm, int fd);
+#ifdef DUNE_PHASE_TIMING
+void phase_init_vcpu(struct kvm_cpu *vcpu);
+void phase_run_enter(struct kvm_cpu *vcpu);
+void phase_run_exit(struct kvm_cpu *vcpu, bool hypercall);
+static inline void phase_stamp(struct kvm_cpu *vcpu, enum PHASE_HOST_STAMP idx)
+{
+	vcpu->phase.host[idx] = arch_read_counter();
+}
+#else
+static inline void phase_init_vcpu(struct kvm_cpu *vcpu) {}
+static inline void phase_run_enter(struct kvm_cpu *vcpu) {}
+static inline void phase_run_exit(struct kvm_cpu *vcpu, bool hypercall) {}
+static inline void phase_stamp(struct kvm_cpu *vcpu, enum PHASE_HOST_STAMP idx)
+{
+}
+#endif
+
+// vcpu_slots.c
+void vcpu_slots_init(struct kvm_shard *shard);
+int vcpu_slot_claim(struct kvm_shard *shard, enum VCPU_SLOT_CLASS cls);
+void vcpu_slot_set_created(struct kvm_shard *shard, int slot);
+void vcpu_slot_release(struct kvm_shard *shard, int slot, bool warm);
+struct kvm_shard *kvm_least_loaded_shard(struct kvm_vm *vm);
+struct kvm_cpu *kvm_next_vcpu(struct kvm_vm *vm, int *iter);
+long vcpu_slots_query(struct kvm_vm *vm, u64 uaddr);
+void vcpu_slots_dump(struct kvm_vm *vm, int fd);
+
+// prewarm.c
+void prewarm_init(struct kvm_vm *vm);
+void prewarm_kick(struct kvm_vm *vm, struct kvm_cpu *model);
+
+// fastpath.c
+void fastpath_refresh(struct kvm_cpu *vcpu);
+void fastpath_inherit(struct kvm_cpu *child_cpu,
+		      const struct kvm_cpu *parent_cpu);
+long fastpath_program(struct kvm_cpu *vcpu, u64 sysno, long value,
+		      bool enable);
+
+// uthread.c : 每一个 worker 的 vcpu 上一个，KS4 (arch_uthread_cpu) 指向它。
+// 时钟中断的 vector 读写前面的成员，偏移和 loongarch/internal.h 中的 UTHREAD_*
+// 一致
+struct uthread;
+struct uthread_cpu {
+	u64 preempt_off; // 不为 0 的时候不能抢占，调度循环中总是为 1
+	u64 need_resched; // 禁止抢占的时候到达过时钟中断
+	u64 era; // 被抢占的地址，由 uthread_preempt_entry 取走
+	u64 resched_entry; // uthread_preempt_entry
+	u64 scratch;
+	u64 ticks;
+	u64 preemptions;
+	u64 switches;
+	int reason; // uthread 回到调度循环的原因
+	struct uthread *current;
+	u64 sched_sp; // 调度循环在 worker 自己的栈上
+} __attribute__((aligned(64)));
+
+// 构造 uthread_switch 恢复的栈帧，第一次切换过去的时候从 entry 开始执行
+u64 arch_uthread_init_stack(void *top, void (*entry)(void));
+void uthread_switch(u64 *save_sp, u64 sp);
+void uthread_preempt_entry(void);
+void uthread_preempted(void);
+
+// affinity.c
+void affinity_init(struct kvm_vm *vm, const struct kvm_vm *parent);
+void affinity_init_vcpu(struct kvm_cpu *vcpu);
+void affinity_enter(struct kvm_cpu *vcpu);
+void affinity_exit(struct kvm_cpu *vcpu);
+void affinity_check(struct kvm_cpu *vcpu);
+long affinity_query(struct kvm_vm *vm, u64 uaddr);
+void affinity_dump(struct kvm_vm *vm, int fd);
+// guest 中的 CPUNUM 设置为 vcpu 线程所在的 host cpu
+void arch_set_cpunum(struct kvm_cpu *cpu, int host_cpu);
+
+// pgtable.c
+long pgtable_shootdown(struct kvm_cpu *vcpu, u64 mask);
+
+// futex.c
+#define FUTEX_HASH_SIZE 1024
+void futex_init(struct kvm_vm *vm);
+void futex_init_vcpu(struct kvm_cpu *vcpu);
+u64 *futex_wait_begin(struct kvm_cpu *vcpu);
+void futex_wait_end(struct kvm_cpu *vcpu, u64 *waiters);
+long futex_raw_syscall(const u64 args[6]);
+
+// ipi.c
+long ipi_register(struct kvm_cpu *vcpu, u64 handler);
+long ipi_send(struct kvm_vm *vm, u64 cpu, u64 vector);
+void ipi_reset_vcpu(struct kvm_cpu *vcpu);
+void ipi_entry(void);
+void ipi_dispatch(u64 *syscall_parameter);
+
+// fault.c
+void fault_init_vcpu(struct kvm_cpu *vcpu);
+void fault_reset_vcpu(struct kvm_cpu *vcpu);
+long fault_signal(struct kvm_cpu *vcpu, u64 addr, u64 type);
+void fault_host_exit(struct kvm_cpu *vcpu);
+void fault_entry(void);
+void fault_dispatch(u64 *syscall_parameter, u64 *frame);
+
 /**
  * History:        #0
  * Commit:         e08b96371625aaa84cb03f51acc4c8e0be27403a
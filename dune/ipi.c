@@ -0,0 +1,127 @@
+#include <errno.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+#include "interface.h"
+#include "dune.h"
+
+// vcpu 之间的用户态 IPI : 发送者把 vector 设置到目标的 ipi_pending, 然后通过
+// KVM_INTERRUPT 注入 ARCH_IPI_IRQ 。目标 vcpu 在 guest 中收到中断之后由 ebase 中的
+// vector 跳转到 ipi_entry, 在关中断的状态下调用 ipi_dispatch, 不经过 host_loop 。
+//
+// 发送仍然是一次 hypercall, 但是目标线程不需要从 futex 中被内核唤醒。
+// ipi_pending 不为 0 的时候中断已经在路上，后来的发送者只设置 vector,
+// 不再注入。
+
+long ipi_register(struct kvm_cpu *vcpu, u64 handler)
+{
+#ifndef ARCH_HAS_IPI
+	return -ENOSYS;
+#else
+	if (handler == 0)
+		return -EINVAL;
+	vcpu->ipi_entry = (u64)ipi_entry;
+	// ipi_reset_vcpu 之后迟到的发送者可能留下了 pending 的位，这时 guest 停在
+	// HYPERCALL 上，vector 不会同时运行
+	__atomic_store_n(&vcpu->ipi_pending, 0, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&vcpu->ipi_handler, handler, __ATOMIC_RELEASE);
+	return vcpu_global_id(vcpu);
+#endif
+}
+
+// cpu 是 vcpu_global_id, 目标 vcpu 不存在或者没有注册 handler 的时候返回 NULL
+static struct kvm_cpu *ipi_target(struct kvm_vm *vm, u64 cpu)
+{
+	int nr_shards = __atomic_load_n(&vm->nr_shards, __ATOMIC_ACQUIRE);
+	if (cpu >= (u64)nr_shards * KVM_MAX_VCPUS)
+		return NULL;
+
+	struct kvm_shard *shard = vm->shards[cpu / KVM_MAX_VCPUS];
+	int slot = cpu % KVM_MAX_VCPUS;
+	if (!(__atomic_load_n(&shard->slots.created[slot / 64],
+			      __ATOMIC_ACQUIRE) &
+	      (1ULL << (slot % 64))))
+		return NULL;
+
+	struct kvm_cpu *target = shard->vcpu_pool[slot].vcpu;
+	if (!__atomic_load_n(&target->ipi_handler, __ATOMIC_ACQUIRE))
+		return NULL;
+	return target;
+}
+
+long ipi_send(struct kvm_vm *vm, u64 cpu, u64 vector)
+{
+#ifndef ARCH_HAS_IPI
+	return -ENOSYS;
+#else
+	if (vector >= DUNE_IPI_VECTORS)
+		return -EINVAL;
+
+	struct kvm_cpu *target = ipi_target(vm, cpu);
+	if (target == NULL)
+		return -ESRCH;
+
+	if (__atomic_fetch_or(&target->ipi_pending, 1ULL << vector,
+			      __ATOMIC_SEQ_CST) != 0)
+		return 0;
+
+	// KVM_INTERRUPT 是异步的 vcpu ioctl, 不需要等待目标线程退出 KVM_RUN
+	struct kvm_interrupt irq = { .irq = ARCH_IPI_IRQ };
+	if (ioctl(target->vcpu_fd, KVM_INTERRUPT, &irq) < 0) {
+		long err = -errno;
+		__atomic_fetch_and(&target->ipi_pending, ~(1ULL << vector),
+				   __ATOMIC_RELAXED);
+		return err;
+	}
+	return 0;
+#endif
+}
+
+// vcpu 被释放的时候调用，复用这个 vcpu 的线程需要重新注册。之前注入的中断
+// 在 ipi_handler 为 0 的时候被 vector 忽略，同时清除 ipi_pending
+void ipi_reset_vcpu(struct kvm_cpu *vcpu)
+{
+	__atomic_store_n(&vcpu->ipi_handler, 0, __ATOMIC_RELEASE);
+	__atomic_store_n(&vcpu->ipi_pending, 0, __ATOMIC_RELAXED);
+}
+
+// 在 guest 中由 ipi_entry 调用，syscall_parameter 是 KS5 中的地址
+void ipi_dispatch(u64 *syscall_parameter)
+{
+	struct kvm_cpu *vcpu =
+		(struct kvm_cpu *)((char *)syscall_parameter -
+				   offsetof(struct kvm_cpu, syscall_parameter));
+	dune_ipi_handler_t handler = (dune_ipi_handler_t)vcpu->ipi_handler;
+
+	u64 bits;
+	while ((bits = __atomic_exchange_n(&vcpu->ipi_pending, 0,
+					   __ATOMIC_ACQUIRE)) != 0) {
+		while (bits) {
+			int vector = __builtin_ctzll(bits);
+			bits &= bits - 1;
+			handler(vector);
+		}
+	}
+}
+
+int dune_ipi_register(dune_ipi_handler_t handler)
+{
+#ifndef ARCH_HAS_IPI
+	return -ENOSYS;
+#else
+	long cpu = syscall(DUNE_SYS_IPI_REGISTER, handler);
+	if (cpu == -1)
+		return -errno;
+	arch_ipi_enable();
+	return cpu;
+#endif
+}
+
+int dune_ipi_send(int cpu, int vector)
+{
+	if (cpu < 0 || vector < 0)
+		return -EINVAL;
+	long ret = syscall(DUNE_SYS_IPI_SEND, cpu, vector);
+	return ret == -1 ? -errno : ret;
+}
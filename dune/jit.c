@@ -0,0 +1,135 @@
+#include <errno.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "interface.h"
+#include "dune.h"
+
+// W^X 的 JIT 代码区 : 内存在 host 中只是 PROT_RW, guest 中的权限只由 guest 页表
+// 中的 NR/NX/D 位控制，切换权限就是 dune_vm_protect 修改 PTE 并且清除当前 vcpu
+// 的 TLB 。内存放在 dune_vm_reserve 保留的范围的后一半，guest 页表中没有映射,
+// 不会被 identity mapping 访问，region->addr 是 guest 中唯一的入口。其他 vcpu 只有 attach 过 region 的才可能有旧的 TLB, 用 vcpu 的位图
+// 调用 DUNE_SYS_VM_SHOOTDOWN, 没有其他 vcpu 的时候完全不会 vm exit 。
+//
+// 线程对应的 vcpu 通过 KS5 中的 syscall_parameter 找到，和 dune_getcpu 一样。
+
+#ifndef ARCH_HAS_GUEST_PT
+int dune_jit_region_init(struct dune_jit_region *region, unsigned long size)
+{
+	return -ENOSYS;
+}
+
+int dune_jit_attach(struct dune_jit_region *region)
+{
+	return -ENOSYS;
+}
+
+int dune_jit_writable(struct dune_jit_region *region, void *addr,
+		      unsigned long len)
+{
+	return -ENOSYS;
+}
+
+int dune_jit_executable(struct dune_jit_region *region, void *addr,
+			unsigned long len)
+{
+	return -ENOSYS;
+}
+#else
+
+#define JIT_PAGE (1UL << ARCH_PT_PAGE_SHIFT)
+#define JIT_MASK_WORDS (DUNE_JIT_MAX_VCPUS / 64)
+
+static int jit_self(void)
+{
+	struct kvm_cpu *vcpu =
+		(struct kvm_cpu *)((char *)arch_syscall_parameter() -
+				   offsetof(struct kvm_cpu, syscall_parameter));
+	return vcpu_global_id(vcpu);
+}
+
+int dune_jit_region_init(struct dune_jit_region *region, unsigned long size)
+{
+	BUILD_ASSERT(DUNE_JIT_MAX_VCPUS == KVM_MAX_SHARDS * KVM_MAX_VCPUS);
+	if (region == NULL || size == 0)
+		return -EINVAL;
+
+	size = (size + JIT_PAGE - 1) & ~(JIT_PAGE - 1);
+	void *addr;
+	int ret = dune_vm_reserve(size * 2, &addr);
+	if (ret)
+		return ret;
+
+	// 替换后一半的 PROT_NONE, guest 页表中仍然是 invalid_pt
+	char *backing = mmap((char *)addr + size, size, PROT_RW,
+			     MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+	if (backing == MAP_FAILED)
+		return -errno;
+	ret = dune_vm_map(addr, backing, size, PROT_RW | DUNE_VM_NOHUGE);
+	if (ret) {
+		mmap(backing, size, PROT_NONE,
+		     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED,
+		     -1, 0);
+		return ret;
+	}
+
+	memset(region, 0, sizeof(*region));
+	region->addr = addr;
+	region->size = size;
+	return dune_jit_attach(region);
+}
+
+int dune_jit_attach(struct dune_jit_region *region)
+{
+	int id = jit_self();
+	__atomic_fetch_or(&region->sharers[id / 64], 1ULL << (id % 64),
+			  __ATOMIC_SEQ_CST);
+	return 0;
+}
+
+static int jit_protect(struct dune_jit_region *region, void *addr,
+		       unsigned long len, int prot)
+{
+	u64 begin = (u64)region->addr, end = begin + region->size;
+	if ((u64)addr < begin || (u64)addr + len > end || len == 0)
+		return -EINVAL;
+
+	dune_jit_attach(region);
+	int ret = dune_vm_protect(addr, len, prot);
+	if (ret)
+		return ret;
+
+	// 当前 vcpu 已经在 dune_vm_protect 中清除了 TLB
+	int self = jit_self();
+	u64 mask[JIT_MASK_WORDS];
+	bool others = false;
+	for (int w = 0; w < JIT_MASK_WORDS; ++w) {
+		mask[w] = __atomic_load_n(&region->sharers[w],
+					  __ATOMIC_ACQUIRE);
+		if (w == self / 64)
+			mask[w] &= ~(1ULL << (self % 64));
+		others |= mask[w] != 0;
+	}
+	if (!others)
+		return 0;
+	long r = syscall(DUNE_SYS_VM_SHOOTDOWN, mask);
+	return r == -1 ? -errno : r;
+}
+
+int dune_jit_writable(struct dune_jit_region *region, void *addr,
+		      unsigned long len)
+{
+	return jit_protect(region, addr, len, PROT_READ | PROT_WRITE);
+}
+
+int dune_jit_executable(struct dune_jit_region *region, void *addr,
+			unsigned long len)
+{
+	int ret = jit_protect(region, addr, len, PROT_READ | PROT_EXEC);
+	if (ret == 0)
+		arch_icache_sync();
+	return ret;
+}
+#endif
@@ -1,5 +1,7 @@
 #include <string.h>
 #include <assert.h>
+#include <errno.h>
+#include <linux/futex.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <sys/ioctl.h>
@@ -7,6 +9,7 @@
 #include "arch.h"
 #include "internal.h"
 #include "../interface.h"
+#include "../dune.h"
 
 #define _GNU_SOURCE
 #ifndef __USE_GNU
@@ -114,32 +117,74 @@ static void kvm_enable_fpu(struct kvm_cpu *cpu)
 	}
 
 	// 从 kvm_vcpu_ioctl_enable_cap 可以看到不需要手动打开 lasx
+	cpu->info.fpu_cap = true;
 }
 
-static void kvm_access_fpu_regs(struct kvm_cpu *cpu,
-				const struct kvm_fpu *fpu_regs,
+static void kvm_access_fpu_regs(struct kvm_cpu *cpu, struct kvm_fpu *fpu_regs,
 				enum ACCESS_OP op)
 {
-    ioctl(cpu->vcpu_fd, op == SET ? KVM_SET_FPU : KVM_GET_FPU, &(cpu->info.fpu));
+	if (ioctl(cpu->vcpu_fd, op == SET ? KVM_SET_FPU : KVM_GET_FPU,
+		  fpu_regs) < 0)
+		die(op == SET ? "KVM_SET_FPU" : "KVM_GET_FPU");
 }
 
-static void kvm_get_fpu_regs(struct kvm_cpu *cpu,
-			     const struct kvm_fpu *fpu_regs)
+static void kvm_get_fpu_regs(struct kvm_cpu *cpu, struct kvm_fpu *fpu_regs)
 {
 	kvm_access_fpu_regs(cpu, fpu_regs, GET);
 }
 
-static void kvm_set_fpu_regs(struct kvm_cpu *cpu,
-			     const struct kvm_fpu *fpu_regs)
+static void kvm_set_fpu_regs(struct kvm_cpu *cpu, struct kvm_fpu *fpu_regs)
 {
 	kvm_access_fpu_regs(cpu, fpu_regs, SET);
 }
 
+// parent 没有使用过 FPU 的时候，它的 FPU 状态就是 parent_cpu->info.fpu, 直接
+// 复制过来，等到 child 第一次使用的时候再写入 kvm, 否则和原来一样立刻写入
 static void dup_fpu(struct kvm_cpu *child_cpu,
-		    const struct kvm_fpu *parent_fpu)
+		    const struct kvm_cpu *parent_cpu)
 {
-	kvm_enable_fpu(child_cpu);
-	kvm_set_fpu_regs(child_cpu, parent_fpu);
+	child_cpu->info.fpu = parent_cpu->info.fpu;
+	child_cpu->info.euen = parent_cpu->info.euen;
+	if (child_cpu->info.euen == 0) {
+		child_cpu->info.fpu_pending = true;
+		return;
+	}
+
+	// 复用的 vcpu 可能已经打开过 FPU
+	if (!child_cpu->info.fpu_cap)
+		kvm_enable_fpu(child_cpu);
+	kvm_set_fpu_regs(child_cpu, &child_cpu->info.fpu);
+	child_cpu->info.fpu_pending = false;
+}
+
+// guest 在 EUEN 关闭的时候使用 FPU, LSX 或者 LASX 触发 FPD, SXD 或者 ASXD,
+// fpu_entry_begin 通过 HYPERCALL 到达这里。LSX 和 LASX 的寄存器和 FPU 重叠，
+// 所以打开 LASX 的时候 FPU 和 LSX 也一起打开
+long arch_enable_fpu(struct kvm_cpu *vcpu, u64 ecode)
+{
+	u64 bits;
+	switch (ecode) {
+	case EXCCODE_FPDIS:
+		bits = CSR_EUEN_FPEN;
+		break;
+	case EXCCODE_LSXDIS:
+		bits = CSR_EUEN_FPEN | CSR_EUEN_LSXEN;
+		break;
+	case EXCCODE_LASXDIS:
+		bits = CSR_EUEN_FPEN | CSR_EUEN_LSXEN | CSR_EUEN_LASXEN;
+		break;
+	default:
+		die("unexpected ecode %lld for fpu enable", ecode);
+	}
+
+	if (!vcpu->info.fpu_cap)
+		kvm_enable_fpu(vcpu);
+	if (vcpu->info.fpu_pending) {
+		kvm_set_fpu_regs(vcpu, &vcpu->info.fpu);
+		vcpu->info.fpu_pending = false;
+	}
+	vcpu->info.euen |= bits;
+	return bits;
 }
 
 void kvm_get_parent_thread_info(struct kvm_cpu *parent_cpu)
@@ -148,20 +193,20 @@ void kvm_get_parent_thread_info(struct kvm_cpu *parent_cpu)
 	    0)
 		die("KVM_GET_REGS");
 
-	parent_cpu->info.era = kvm_get_csr_reg(parent_cpu, KVM_CSR_EPC);
+	// syscall vector 已经保存了 EPC, 无需 KVM_GET_ONE_REG
+	parent_cpu->info.era = parent_cpu->syscall_era;
 
-	kvm_get_fpu_regs(parent_cpu, &parent_cpu->info.fpu);
+	// 没有使用过 FPU 的时候 info.fpu 就是当前的状态
+	if (parent_cpu->info.euen)
+		kvm_get_fpu_regs(parent_cpu, &parent_cpu->info.fpu);
 }
 
 extern void get_fpu_regs(struct kvm_fpu *);
 
+// host 的 FPU 状态保存在 info.fpu 中，guest 第一次使用 FPU 的时候再写入
 static void init_fpu(struct kvm_cpu *cpu)
 {
-	kvm_enable_fpu(cpu);
-
-	struct kvm_fpu fpu_regs;
-
-	get_fpu_regs(&fpu_regs);
+	get_fpu_regs(&cpu->info.fpu);
 
 	BUILD_ASSERT(offsetof(struct kvm_fpu, fcsr) == VCPU_FCSR0);
 	BUILD_ASSERT(offsetof(struct kvm_fpu, vcsr) == VCPU_VCSR);
@@ -171,14 +216,126 @@ static void init_fpu(struct kvm_cpu *cpu)
 	BUILD_ASSERT(offsetof(struct kvm_fpu, fpr[31]) ==
 		     VCPU_FPR0 + 31 * VCPU_FPR_LEN);
 
-	kvm_set_fpu_regs(cpu, &fpu_regs);
+	cpu->info.euen = 0;
+	cpu->info.fpu_pending = true;
 }
 
 static void init_ebase(struct kvm_cpu *cpu)
 {
 	BUILD_ASSERT(512 == VEC_SIZE);
 	BUILD_ASSERT(INT_OFFSET * VEC_SIZE == PAGESIZE * 2);
-	BUILD_ASSERT(VEC_SIZE * 14 < PAGESIZE);
+	BUILD_ASSERT(VEC_SIZE * (EXCCODE_LASXDIS + 1) < PAGESIZE);
+	BUILD_ASSERT(FPU_ENABLE_SYSNO == DUNE_SYS_FPU_ENABLE);
+	BUILD_ASSERT(offsetof(struct kvm_cpu, sidecar_mailbox) -
+			     offsetof(struct kvm_cpu, syscall_parameter) ==
+		     SIDECAR_MAILBOX);
+	BUILD_ASSERT(SIDECAR_IDLE == MAILBOX_IDLE);
+	BUILD_ASSERT(SIDECAR_REQUEST == MAILBOX_REQUEST);
+	BUILD_ASSERT(SIDECAR_DONE == MAILBOX_DONE);
+	BUILD_ASSERT(offsetof(struct kvm_cpu, syscall_era) -
+			     offsetof(struct kvm_cpu, syscall_parameter) ==
+		     SYSCALL_ERA);
+	BUILD_ASSERT(offsetof(struct kvm_cpu, phase_stamp) -
+			     offsetof(struct kvm_cpu, syscall_parameter) ==
+		     PHASE_STAMP);
+	BUILD_ASSERT(PHASE_G_VECTOR == 0 && PHASE_G_HYPERCALL == 1 &&
+		     PHASE_G_RESUME == 2);
+	BUILD_ASSERT(offsetof(struct kvm_cpu, fastpath_bitmap) -
+			     offsetof(struct kvm_cpu, syscall_parameter) ==
+		     FASTPATH_BITMAP);
+	BUILD_ASSERT(offsetof(struct kvm_cpu, fastpath_value) -
+			     offsetof(struct kvm_cpu, syscall_parameter) ==
+		     FASTPATH_VALUE);
+	BUILD_ASSERT(FASTPATH_LIMIT == FASTPATH_NR && SYSCALL_BASE == 0);
+	BUILD_ASSERT(offsetof(struct uthread_cpu, preempt_off) ==
+		     UTHREAD_PREEMPT_OFF);
+	BUILD_ASSERT(offsetof(struct uthread_cpu, need_resched) ==
+		     UTHREAD_NEED_RESCHED);
+	BUILD_ASSERT(offsetof(struct uthread_cpu, era) == UTHREAD_ERA);
+	BUILD_ASSERT(offsetof(struct uthread_cpu, resched_entry) ==
+		     UTHREAD_RESCHED_ENTRY);
+	BUILD_ASSERT(offsetof(struct uthread_cpu, scratch) == UTHREAD_SCRATCH);
+	BUILD_ASSERT(offsetof(struct uthread_cpu, ticks) == UTHREAD_TICKS);
+	BUILD_ASSERT(VEC_SIZE * (INT_OFFSET + INT_TI + 1) <= ERREBASE_OFFSET);
+	BUILD_ASSERT(offsetof(struct kvm_cpu, ipi_pending) -
+			     offsetof(struct kvm_cpu, syscall_parameter) ==
+		     IPI_PENDING);
+	BUILD_ASSERT(offsetof(struct kvm_cpu, ipi_handler) -
+			     offsetof(struct kvm_cpu, syscall_parameter) ==
+		     IPI_HANDLER);
+	BUILD_ASSERT(offsetof(struct kvm_cpu, ipi_entry) -
+			     offsetof(struct kvm_cpu, syscall_parameter) ==
+		     IPI_ENTRY);
+	BUILD_ASSERT(offsetof(struct kvm_cpu, ipi_era) -
+			     offsetof(struct kvm_cpu, syscall_parameter) ==
+		     IPI_ERA);
+	BUILD_ASSERT(offsetof(struct kvm_cpu, ipi_scratch) -
+			     offsetof(struct kvm_cpu, syscall_parameter) ==
+		     IPI_SCRATCH);
+	BUILD_ASSERT(INT_SWI1 == ARCH_IPI_IRQ);
+	BUILD_ASSERT(offsetof(struct kvm_cpu, futex_waiters) -
+			     offsetof(struct kvm_cpu, syscall_parameter) ==
+		     FUTEX_WAITER_TABLE);
+	BUILD_ASSERT(offsetof(struct kvm_cpu, futex_spin) -
+			     offsetof(struct kvm_cpu, syscall_parameter) ==
+		     FUTEX_SPIN);
+	BUILD_ASSERT(offsetof(struct kvm_cpu, tlb_refills) -
+			     offsetof(struct kvm_cpu, syscall_parameter) ==
+		     TLB_REFILLS);
+	BUILD_ASSERT(offsetof(struct kvm_cpu, host_cpu) -
+			     offsetof(struct kvm_cpu, syscall_parameter) ==
+		     HOST_CPU);
+	BUILD_ASSERT(offsetof(struct kvm_cpu, host_node) -
+			     offsetof(struct kvm_cpu, syscall_parameter) ==
+		     HOST_NODE);
+	BUILD_ASSERT(FUTEX_SYSNO == SYS_FUTEX && GETCPU_SYSNO == __NR_getcpu);
+	BUILD_ASSERT(offsetof(struct kvm_cpu, tlb_flush) -
+			     offsetof(struct kvm_cpu, syscall_parameter) ==
+		     TLB_FLUSH);
+	BUILD_ASSERT(PT_PS == ARCH_PT_PAGE_SHIFT && PT_PS == INIT_VALUE_STLBPS);
+	BUILD_ASSERT(PTE_HUGE == ARCH_PTE_HUGE && PTE_W == ARCH_PTE_W &&
+		     PTE_D_DIRTY == (ARCH_PTE_D | ARCH_PTE_DIRTY));
+	BUILD_ASSERT(offsetof(struct kvm_cpu, fault_entry) -
+			     offsetof(struct kvm_cpu, syscall_parameter) ==
+		     FAULT_ENTRY);
+	BUILD_ASSERT(offsetof(struct kvm_cpu, fault_era) -
+			     offsetof(struct kvm_cpu, syscall_parameter) ==
+		     FAULT_ERA);
+	BUILD_ASSERT(offsetof(struct kvm_cpu, fault_prmd) -
+			     offsetof(struct kvm_cpu, syscall_parameter) ==
+		     FAULT_PRMD);
+	BUILD_ASSERT(offsetof(struct kvm_cpu, fault_addr) -
+			     offsetof(struct kvm_cpu, syscall_parameter) ==
+		     FAULT_ADDR);
+	BUILD_ASSERT(offsetof(struct kvm_cpu, fault_code) -
+			     offsetof(struct kvm_cpu, syscall_parameter) ==
+		     FAULT_CODE);
+	BUILD_ASSERT(offsetof(struct kvm_cpu, fault_scratch) -
+			     offsetof(struct kvm_cpu, syscall_parameter) ==
+		     FAULT_SCRATCH);
+	BUILD_ASSERT(offsetof(struct kvm_cpu, fault_stack) -
+			     offsetof(struct kvm_cpu, syscall_parameter) ==
+		     FAULT_STACK);
+	BUILD_ASSERT(offsetof(struct kvm_cpu, fault_stack_size) -
+			     offsetof(struct kvm_cpu, syscall_parameter) ==
+		     FAULT_STACK_SIZE);
+	BUILD_ASSERT(ARCH_FAULT_FRAME_PC * sizeof(u64) == CONTEXT_FRAME_ERA);
+	BUILD_ASSERT(DUNE_FAULT_LOAD == EXCCODE_PIL &&
+		     DUNE_FAULT_STORE == EXCCODE_PIS &&
+		     DUNE_FAULT_FETCH == EXCCODE_PIF &&
+		     DUNE_FAULT_MODIFY == EXCCODE_PME &&
+		     DUNE_FAULT_NOREAD == EXCCODE_PNR &&
+		     DUNE_FAULT_NOEXEC == EXCCODE_PNX &&
+		     DUNE_FAULT_PRIV == EXCCODE_PPI &&
+		     DUNE_FAULT_ADDR == EXCCODE_ADE);
+	BUILD_ASSERT(ARCH_PT_ENTRIES * sizeof(u64) == PAGESIZE);
+	BUILD_ASSERT((1 << FUTEX_HASH_BITS) == FUTEX_HASH_SIZE);
+	BUILD_ASSERT(DUNE_FUTEX_PRIVATE == FUTEX_PRIVATE_FLAG &&
+		     DUNE_FUTEX_WAIT_CMD == FUTEX_WAIT &&
+		     DUNE_FUTEX_WAKE_CMD == FUTEX_WAKE &&
+		     DUNE_FUTEX_WAIT_BITSET_CMD == FUTEX_WAIT_BITSET &&
+		     DUNE_FUTEX_WAKE_BITSET_CMD == FUTEX_WAKE_BITSET &&
+		     ERRNO_EAGAIN == EAGAIN);
 
 	cpu->info.ebase = mmap_pages(4);
 	for (int i = 0; i < PAGESIZE; ++i) {
@@ -193,11 +350,50 @@ static void init_ebase(struct kvm_cpu *cpu)
 	extern void tlb_refill_entry_end(void);
 	extern void syscall_entry_begin(void);
 	extern void syscall_entry_end(void);
-
+	extern void fpu_entry_begin(void);
+	extern void fpu_entry_end(void);
+	extern void uthread_timer_entry_begin(void);
+	extern void uthread_timer_entry_end(void);
+	extern void ipi_entry_begin(void);
+	extern void ipi_entry_end(void);
+	extern void pme_entry_begin(void);
+	extern void pme_entry_end(void);
+	extern void fault_entry_begin(void);
+	extern void fault_entry_end(void);
+
+	// TLB refill 的 vector 后面是 PIL 等异常的 vector
+	if (tlb_refill_entry_end - tlb_refill_entry_begin > VEC_SIZE)
+		die("tlb refill entry is larger than VEC_SIZE");
 	memcpy(cpu->info.ebase, tlb_refill_entry_begin,
 	       tlb_refill_entry_end - tlb_refill_entry_begin);
+	if (syscall_entry_end - syscall_entry_begin > VEC_SIZE)
+		die("syscall entry is larger than VEC_SIZE");
 	memcpy(cpu->info.ebase + VEC_SIZE * EXCCODE_SYS, syscall_entry_begin,
 	       syscall_entry_end - syscall_entry_begin);
+	// PME 的 vector 包含 fault_vector, 其他 TLB 异常和 ADE 只有 fault_vector
+	if (fault_entry_end - fault_entry_begin > VEC_SIZE)
+		die("fault entry is larger than VEC_SIZE");
+	for (int ecode = EXCCODE_PIL; ecode <= EXCCODE_ADE; ++ecode)
+		memcpy(cpu->info.ebase + VEC_SIZE * ecode, fault_entry_begin,
+		       fault_entry_end - fault_entry_begin);
+	if (pme_entry_end - pme_entry_begin > VEC_SIZE)
+		die("pme entry is larger than VEC_SIZE");
+	memcpy(cpu->info.ebase + VEC_SIZE * EXCCODE_PME, pme_entry_begin,
+	       pme_entry_end - pme_entry_begin);
+	if (fpu_entry_end - fpu_entry_begin > VEC_SIZE)
+		die("fpu entry is larger than VEC_SIZE");
+	for (int ecode = EXCCODE_FPDIS; ecode <= EXCCODE_LASXDIS; ++ecode)
+		memcpy(cpu->info.ebase + VEC_SIZE * ecode, fpu_entry_begin,
+		       fpu_entry_end - fpu_entry_begin);
+	if (uthread_timer_entry_end - uthread_timer_entry_begin > VEC_SIZE)
+		die("uthread timer entry is larger than VEC_SIZE");
+	memcpy(cpu->info.ebase + VEC_SIZE * (INT_OFFSET + INT_TI),
+	       uthread_timer_entry_begin,
+	       uthread_timer_entry_end - uthread_timer_entry_begin);
+	if (ipi_entry_end - ipi_entry_begin > VEC_SIZE)
+		die("ipi entry is larger than VEC_SIZE");
+	memcpy(cpu->info.ebase + VEC_SIZE * (INT_OFFSET + INT_SWI1),
+	       ipi_entry_begin, ipi_entry_end - ipi_entry_begin);
 	// memcpy(cpu->info.ebase + ERREBASE_OFFSET, err_entry_begin,
 	// err_entry_end - err_entry_begin);
 
@@ -216,22 +412,69 @@ struct csr_reg {
 		.reg = { .id = KVM_CSR_##X }, .name = #X, .v = INIT_VALUE_##X  \
 	}
 
-static void init_csr(struct kvm_cpu *cpu)
+static void set_csr_regs(const struct kvm_cpu *cpu, struct csr_reg *regs,
+			 int n)
 {
-	if (!cpu->info.ebase)
-		die("You forget to init ebase");
+	for (int i = 0; i < n; ++i) {
+		regs[i].reg.addr = (u64) & (regs[i].v);
+		if (ioctl(cpu->vcpu_fd, KVM_SET_ONE_REG, &(regs[i].reg)) < 0) {
+			die("KVM_SET_ONE_REG %s", regs[i].name);
+		} else {
+			// pr_info("KVM_SET_ONE_REG %s : %llx", regs[i].name,
+			// regs[i].v);
+		}
+	}
+}
+
+// init_csr 写入的 CSR 中只有 KSCRATCH5 和 vcpu 相关，其余的在一个进程
+// 中都相同 : ebase 被所有的 vcpu 共享，fork 出来的 child 中地址也不变。
+// 第一个 vcpu 初始化的时候 (kvm_launch, 此时只有一个线程) 构造模板，同时读取
+// reset 之后的值，把和 reset 不同的寄存器排在前面，新创建的 vcpu 只需要写入这一部分。
+// 模板保存在进程的内存中，fork 出来的 child 直接继承。
+#define CSR_TEMPLATE_MAX 32
+static struct csr_reg csr_template[CSR_TEMPLATE_MAX];
+static int csr_template_nr; // 模板中全部的寄存器，0 表示还没有构造
+static int csr_template_dirty_nr; // 前 dirty_nr 个和 reset 之后的值不同
+
+static bool csr_equals_reset(const struct kvm_cpu *cpu, u64 id, u64 v)
+{
+	u64 reset = 0;
+	struct kvm_one_reg reg = { .id = id, .addr = (u64)&reset };
+
+	// 无法读取的寄存器总是写入
+	if (ioctl(cpu->vcpu_fd, KVM_GET_ONE_REG, &reg) < 0)
+		return false;
+	return reset == v;
+}
+
+// DUNE_TRANSLATION=tlb|dmw 选择 guest 中用户地址的翻译方式 : tlb (默认) 在 TLB
+// refill vector 中填充 512M 的 identity mapping, 工作集超过 MTLB 之后不断地
+// refill; dmw 使用 DMWIN0 直接映射，不再经过 TLB 。两者的权限相同，都是 RWX 。
+// 在构造模板的时候读取，fork 出来的 child 继承 parent 的选择
+static bool translation_dmw(void)
+{
+	const char *env = getenv("DUNE_TRANSLATION");
+	if (env == NULL || strcmp(env, "tlb") == 0)
+		return false;
+	if (strcmp(env, "dmw") == 0)
+		return true;
+	pr_warn("DUNE_TRANSLATION : unknown mode %s", env);
+	return false;
+}
 
+static void build_csr_template(const struct kvm_cpu *cpu)
+{
+	u64 INIT_VALUE_DMWIN0 = translation_dmw() ? CSR_DMW0_INIT : 0;
 	u64 INIT_VALUE_DMWIN1 = CSR_DMW1_INIT;
-	u64 INIT_VALUE_KSCRATCH5 = (u64)cpu->syscall_parameter + CSR_DMW1_BASE;
+	// guest 页表的根目录，全部为 0 的时候所有的地址都是 identity mapping,
+	// 由 pgtable.c 在 guest 中填充。fork 出来的 child 中地址不变
+	u64 INIT_VALUE_PGDL = (u64)mmap_one_page();
 	u64 INIT_VALUE_KSCRATCH6 = TLBRELO0_STANDARD_BITS;
 	u64 INIT_VALUE_KSCRATCH7 = TLBRELO1_STANDARD_BITS;
 
 	u64 INIT_VALUE_TLBREBASE = (u64)cpu->info.ebase;
 	u64 INIT_VALUE_EBASE = (u64)cpu->info.ebase;
 
-	// TODO 并没有什么意义
-	u64 INIT_VALUE_CPUNUM = cpu->cpu_id;
-
 	struct csr_reg one_regs[] = {
 		CSR_INIT_REG(CRMD),
 		// CSR_INIT_REG(PRMD),
@@ -248,12 +491,12 @@ static void init_csr(struct kvm_cpu *cpu)
 		// CSR_INIT_REG(GTLBC),
 		// CSR_INIT_REG(TRGP),
 		// CSR_INIT_REG(ASID),
-		// CSR_INIT_REG(PGDL),
+		CSR_INIT_REG(PGDL),
 		// CSR_INIT_REG(PGDH),
 		// CSR_INIT_REG(PGD),
 		CSR_INIT_REG(PWCTL0), CSR_INIT_REG(PWCTL1),
 		CSR_INIT_REG(STLBPS), CSR_INIT_REG(RVACFG),
-		CSR_INIT_REG(CPUNUM),
+		// CSR_INIT_REG(CPUNUM), 由 affinity.c 设置为 host cpu
 		// CSR_INIT_REG(PRCFG1),
 		// CSR_INIT_REG(PRCFG2),
 		// CSR_INIT_REG(PRCFG3),
@@ -262,9 +505,9 @@ static void init_csr(struct kvm_cpu *cpu)
 		// CSR_INIT_REG(KSCRATCH2),
 		// CSR_INIT_REG(KSCRATCH3),
 		// CSR_INIT_REG(KSCRATCH4),
-		CSR_INIT_REG(KSCRATCH5), CSR_INIT_REG(KSCRATCH6),
-		CSR_INIT_REG(KSCRATCH7),
-		// CSR_INIT_REG(TIMERID), // kvm 会初始化
+		// CSR_INIT_REG(KSCRATCH5), 和 vcpu 相关，见 init_csr
+		CSR_INIT_REG(KSCRATCH6), CSR_INIT_REG(KSCRATCH7),
+		// CSR_INIT_REG(TIMERID), // kvm 会初始化, 之后由 affinity.c 设置为 host cpu
 		// 从 kvm_vz_queue_timer_int_cb 看，disable 掉 TIMERCFG::EN 的确可以不被注入
 		// 时钟中断
 		CSR_INIT_REG(TIMERCFG),
@@ -310,8 +553,7 @@ static void init_csr(struct kvm_cpu *cpu)
 		// CSR_INIT_REG(UCWIN2_HI),
 		// CSR_INIT_REG(UCWIN3_LO),
 		// CSR_INIT_REG(UCWIN3_HI),
-		// CSR_INIT_REG(DMWIN0),
-		CSR_INIT_REG(DMWIN1),
+		CSR_INIT_REG(DMWIN0), CSR_INIT_REG(DMWIN1),
 		// CSR_INIT_REG(DMWIN2),
 		// CSR_INIT_REG(DMWIN3),
 		// FIXME : 没有办法控制 perf 寄存器, 最后会不会导致 perf 其实默认是打开的
@@ -329,19 +571,56 @@ static void init_csr(struct kvm_cpu *cpu)
 		// CSR_INIT_REG(DESAVE),
 	};
 
-	for (int i = 0; i < sizeof(one_regs) / sizeof(struct csr_reg); ++i) {
-		one_regs[i].reg.addr = (u64) & (one_regs[i].v);
-	}
+	int n = sizeof(one_regs) / sizeof(struct csr_reg);
+	BUILD_ASSERT(sizeof(one_regs) / sizeof(struct csr_reg) <=
+		     CSR_TEMPLATE_MAX);
 
-	for (int i = 0; i < sizeof(one_regs) / sizeof(struct csr_reg); ++i) {
-		if (ioctl(cpu->vcpu_fd, KVM_SET_ONE_REG, &(one_regs[i].reg)) <
-		    0) {
-			die("KVM_SET_ONE_REG %s", one_regs[i].name);
-		} else {
-			// pr_info("KVM_SET_ONE_REG %s : %llx", one_regs[i].name,
-			// one_regs[i].v);
-		}
+	int dirty = 0, clean = n;
+	for (int i = 0; i < n; ++i) {
+		if (csr_equals_reset(cpu, one_regs[i].reg.id, one_regs[i].v))
+			csr_template[--clean] = one_regs[i];
+		else
+			csr_template[dirty++] = one_regs[i];
 	}
+	csr_template_dirty_nr = dirty;
+	csr_template_nr = n;
+}
+
+static void init_csr(struct kvm_cpu *cpu)
+{
+	if (!cpu->info.ebase)
+		die("You forget to init ebase");
+
+	if (csr_template_nr == 0)
+		build_csr_template(cpu);
+
+	struct csr_reg percpu_regs[] = {
+		{ .reg = { .id = KVM_CSR_KSCRATCH5 },
+		  .name = "KSCRATCH5",
+		  .v = (u64)cpu->syscall_parameter + CSR_DMW1_BASE },
+	};
+
+	// 复用的 vcpu 中寄存器可能已经被 guest 修改，需要写入整个模板
+	bool fresh = !cpu->info.configured;
+	struct csr_reg regs[CSR_TEMPLATE_MAX];
+	int n = fresh ? csr_template_dirty_nr : csr_template_nr;
+	memcpy(regs, csr_template, sizeof(struct csr_reg) * n);
+
+	set_csr_regs(cpu, regs, n);
+	set_csr_regs(cpu, percpu_regs, 1);
+	cpu->info.configured = true;
+}
+
+// init_csr 可能在 prewarm 线程中执行，CPUNUM 在 host_loop 中由 affinity.c 设置。
+// dune_getcpu 和 syscall vector 中的 getcpu 读取 kvm_cpu 的 host_cpu, vDSO 的
+// getcpu 读取 TIMERID
+void arch_set_cpunum(struct kvm_cpu *cpu, int host_cpu)
+{
+	struct csr_reg regs[] = {
+		{ .reg = { .id = KVM_CSR_CPUNUM }, .name = "CPUNUM", .v = host_cpu },
+		{ .reg = { .id = KVM_CSR_TIMERID }, .name = "TIMERID", .v = host_cpu },
+	};
+	set_csr_regs(cpu, regs, sizeof(regs) / sizeof(regs[0]));
 }
 
 static int __attribute__((noinline))
@@ -467,8 +746,84 @@ bool arch_do_syscall(struct kvm_cpu *cpu, bool is_fork)
 	cpu->syscall_parameter[0] = __a0;
 	return false;
 }
+
+long arch_raw_syscall(u64 sysno, const u64 args[6])
+{
+	register long int __a7 asm("$a7") = sysno;
+	register long int __a0 asm("$a0") = args[0];
+	register long int __a1 asm("$a1") = args[1];
+	register long int __a2 asm("$a2") = args[2];
+	register long int __a3 asm("$a3") = args[3];
+	register long int __a4 asm("$a4") = args[4];
+	register long int __a5 asm("$a5") = args[5];
+
+	__asm__ volatile("syscall	0\n\t"
+			 : "+r"(__a0)
+			 : "r"(__a7), "r"(__a1), "r"(__a2), "r"(__a3),
+			   "r"(__a4), "r"(__a5)
+			 : __SYSCALL_CLOBBERS);
+
+	return __a0;
+}
 #endif
 
+// 参数依次保存在 a0 - a5, 返回值保存在 a0
+u64 arch_get_syscall_arg(const struct kvm_cpu *cpu, int n)
+{
+	return cpu->syscall_parameter[n];
+}
+
+void arch_set_syscall_ret(struct kvm_cpu *cpu, long ret)
+{
+	cpu->syscall_parameter[0] = ret;
+}
+
+long arch_get_syscall_ret(const struct kvm_cpu *cpu)
+{
+	return cpu->syscall_parameter[0];
+}
+
+static inline u32 read_cpucfg(u32 reg)
+{
+	u32 val;
+	__asm__ volatile("cpucfg %0, %1" : "=r"(val) : "r"(reg));
+	return val;
+}
+
+u64 arch_counter_freq(void)
+{
+	// CPUCFG4 是 CC_FREQ, CPUCFG5 的低 16 位是 CC_MUL, 高 16 位是 CC_DIV
+	u64 freq = read_cpucfg(4);
+	u32 cfg5 = read_cpucfg(5);
+	u32 mul = cfg5 & 0xffff, div = cfg5 >> 16;
+
+	if (mul && div)
+		freq = freq * mul / div;
+	return freq;
+}
+
+// 和 uthread_switch 的栈帧一致，fs0-fs7 不需要恢复
+u64 arch_uthread_init_stack(void *top, void (*entry)(void))
+{
+	u64 *frame = (u64 *)((u64)top - UTHREAD_SWITCH_FRAME);
+	memset(frame, 0, UTHREAD_SWITCH_FRAME);
+	frame[0] = (u64)entry; // ra
+	return (u64)frame;
+}
+
+// guest 的 rdtime 返回 host 的 counter 加上 GCNTC
+s64 arch_guest_counter_offset(const struct kvm_cpu *cpu)
+{
+	u64 v = 0;
+	struct kvm_one_reg reg = { .id = KVM_CSR_GCNTC, .addr = (u64)&v };
+
+	if (ioctl(cpu->vcpu_fd, KVM_GET_ONE_REG, &reg) < 0) {
+		pr_warn("unable to get GCNTC, guest phases may be skewed");
+		return 0;
+	}
+	return v;
+}
+
 void init_child_thread_info(struct kvm_cpu *child_cpu,
 			    const struct kvm_cpu *parent_cpu, int sysno)
 {
@@ -500,8 +855,22 @@ void init_child_thread_info(struct kvm_cpu *child_cpu,
 	if (ioctl(child_cpu->vcpu_fd, KVM_SET_REGS, &child_regs) < 0)
 		die("KVM_SET_REGS");
 
-	dup_fpu(child_cpu, &parent_cpu->info.fpu);
-	init_csr(child_cpu);
+	dup_fpu(child_cpu, parent_cpu);
+	// prewarm 线程已经写入了 CSR 模板
+	if (!child_cpu->prewarmed)
+		init_csr(child_cpu);
+	// CSR 模板中的 EUEN 是 0
+	if (child_cpu->info.euen)
+		kvm_set_csr_reg(child_cpu, KVM_CSR_EUEN, child_cpu->info.euen);
+}
+
+// CSR 和线程无关，FPU 的状态在 dup_fpu 中写入，这里只打开 cap
+void arch_prewarm_vcpu(struct kvm_cpu *vcpu, const struct kvm_cpu *model)
+{
+	ebase_share(vcpu, model);
+	init_csr(vcpu);
+	if (!vcpu->info.fpu_cap)
+		kvm_enable_fpu(vcpu);
 }
 
 void arch_set_thread_area(struct kvm_cpu *vcpu)
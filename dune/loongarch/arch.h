@@ -7,11 +7,15 @@
 #include <linux/kvm.h>
 #endif
 
+#include <stdbool.h>
+#include <sys/mman.h>
+
 #define PAGESHIFT 14
 typedef unsigned char u8;
 typedef unsigned short u16;
 typedef unsigned int u32;
 typedef unsigned long long u64;
+typedef long long s64;
 
 #define NUM_FPU_REGS 32
 
@@ -21,9 +25,18 @@ struct thread_info {
 
   u64 era;
   void *ebase;
+  // vcpu 已经被 init_csr 初始化过，复用的时候 CSR 不再是 reset 之后的状态
+  bool configured;
+  // FPU 是懒惰打开的: fpu_cap 表示已经 KVM_ENABLE_CAP, fpu_pending 表示 fpu
+  // 中的状态还没有写入 kvm, euen 是 guest 已经打开的 EUEN 位，为 0 说明
+  // 这个线程还没有使用过 FPU, 寄存器的内容仍然是 fpu 中的值
+  bool fpu_cap;
+  bool fpu_pending;
+  u64 euen;
 };
 
-#define KVM_MAX_VCPUS 16
+// 一个 shard 中 vcpu_pool 的大小，实际的上限是 KVM_CAP_MAX_VCPUS 和它中较小的
+#define KVM_MAX_VCPUS 64
 #define PAGESIZE (1 << PAGESHIFT)
 
 /**
@@ -33,12 +46,300 @@ struct thread_info {
 #define __NR_exit 93
 #define __NR_kexec_load 104
 #define __NR_set_tid_address 96
+#define __NR_exit_group 94
 
 #define SYS_CLONE __NR_clone
 #define SYS_EXIT __NR_exit
 #define SYS_KEXEC_LOAD __NR_kexec_load
 #define SYS_SET_THREAD_AREA __NR_set_tid_address
+#define SYS_EXIT_GROUP __NR_exit_group
 
 #define SYS_CLONE3 0x3f3f3f3f
 #define SYS_FORK 0x3f3f3f3f
+
+// 结果依赖于调用线程的 syscall, 不能交给其他的 host 线程执行
+#define __NR_sigaltstack 132
+#define __NR_rt_sigsuspend 133
+#define __NR_rt_sigprocmask 135
+#define __NR_rt_sigtimedwait 137
+#define __NR_rt_sigreturn 139
+#define __NR_set_robust_list 99
+#define __NR_sched_setaffinity 122
+#define __NR_sched_getaffinity 123
+#define __NR_sched_yield 124
+#define __NR_getrusage 165
+#define __NR_prctl 167
+// getcpu 的指针为 NULL 或者在 sp 之上 2048 字节之内的时候由 syscall vector
+// 直接返回 (见 entry.S), 其他的指针交给 host, 非法的地址返回 -EFAULT
+#define __NR_getcpu 168
+#define __NR_unshare 97
+#define __NR_setns 268
+#define __NR_rseq 293
+
+// 结果可以被 host_loop 缓存的 syscall 和使缓存失效的 syscall
+// loongarch 只有 prlimit64, 没有 getrlimit 和 setrlimit
+#define SYS_UNAME 160
+#define SYS_GETPID 172
+#define SYS_GETUID 174
+#define SYS_GETEUID 175
+#define SYS_GETGID 176
+#define SYS_GETEGID 177
+#define SYS_GETTID 178
+#define SYS_PRLIMIT64 261
+
+// futex.c 统计 host 中等待的 private futex, syscall vector 中有快速路径
+#define SYS_FUTEX 98
+
+#define __NR_sethostname 161
+#define __NR_setdomainname 162
+#define __NR_setregid 143
+#define __NR_setgid 144
+#define __NR_setreuid 145
+#define __NR_setuid 146
+#define __NR_setresuid 147
+#define __NR_setresgid 149
+#define __NR_setfsuid 151
+#define __NR_setfsgid 152
+
+// asm-generic 的 syscall 从 0 开始编号，__NR_syscalls 目前不到 512
+#define SYSCALL_BASE 0
+#define SYSCALL_TABLE_SIZE 512
+
+// host_loop 需要特殊处理的 syscall, 没有列出的直接交给 arch_do_syscall
+// loongarch 没有 fork 和 clone3, 所以 SYS_FORK 和 SYS_CLONE3 不在表中
+#define ARCH_SYSCALL_KINDS(X)                                                  \
+	X(SYS_EXIT, SYSCALL_EXIT)                                              \
+	X(SYS_EXIT_GROUP, SYSCALL_EXIT_GROUP)                                  \
+	X(SYS_SET_THREAD_AREA, SYSCALL_SET_THREAD_AREA)                        \
+	X(SYS_CLONE, SYSCALL_FORK)                                             \
+	X(SYS_KEXEC_LOAD, SYSCALL_DENIED)                                      \
+	X(__NR_sigaltstack, SYSCALL_THREAD_BOUND)                              \
+	X(__NR_rt_sigsuspend, SYSCALL_THREAD_BOUND)                            \
+	X(__NR_rt_sigprocmask, SYSCALL_THREAD_BOUND)                           \
+	X(__NR_rt_sigtimedwait, SYSCALL_THREAD_BOUND)                          \
+	X(__NR_rt_sigreturn, SYSCALL_THREAD_BOUND)                             \
+	X(__NR_set_robust_list, SYSCALL_THREAD_BOUND)                          \
+	X(__NR_sched_setaffinity, SYSCALL_THREAD_BOUND)                        \
+	X(__NR_sched_getaffinity, SYSCALL_THREAD_BOUND)                        \
+	X(__NR_sched_yield, SYSCALL_THREAD_BOUND)                              \
+	X(__NR_getrusage, SYSCALL_THREAD_BOUND)                                \
+	X(__NR_prctl, SYSCALL_THREAD_BOUND)                                    \
+	X(__NR_getcpu, SYSCALL_THREAD_BOUND)                                   \
+	X(__NR_rseq, SYSCALL_THREAD_BOUND)                                     \
+	X(SYS_UNAME, SYSCALL_CACHED)                                           \
+	X(SYS_GETPID, SYSCALL_CACHED)                                          \
+	X(SYS_GETUID, SYSCALL_CACHED)                                          \
+	X(SYS_GETEUID, SYSCALL_CACHED)                                         \
+	X(SYS_GETGID, SYSCALL_CACHED)                                          \
+	X(SYS_GETEGID, SYSCALL_CACHED)                                         \
+	X(SYS_GETTID, SYSCALL_CACHED)                                          \
+	X(SYS_PRLIMIT64, SYSCALL_CACHED)                                       \
+	X(__NR_sethostname, SYSCALL_INVALIDATE)                                \
+	X(__NR_setdomainname, SYSCALL_INVALIDATE)                              \
+	X(__NR_setregid, SYSCALL_INVALIDATE)                                   \
+	X(__NR_setgid, SYSCALL_INVALIDATE)                                     \
+	X(__NR_setreuid, SYSCALL_INVALIDATE)                                   \
+	X(__NR_setuid, SYSCALL_INVALIDATE)                                     \
+	X(__NR_setresuid, SYSCALL_INVALIDATE)                                  \
+	X(__NR_setresgid, SYSCALL_INVALIDATE)                                  \
+	X(__NR_setfsuid, SYSCALL_INVALIDATE)                                   \
+	X(__NR_setfsgid, SYSCALL_INVALIDATE)                                   \
+	X(__NR_unshare, SYSCALL_INVALIDATE)                                    \
+	X(__NR_setns, SYSCALL_INVALIDATE)                                      \
+	X(SYS_FUTEX, SYSCALL_FUTEX)
+
+// syscall vector 支持通过 sidecar_mailbox 把 syscall 交给 sidecar 线程
+#define ARCH_HAS_SYSCALL_SIDECAR
+
+// syscall vector 在 DUNE_PHASE_TIMING 的时候写入 phase_stamp
+#define ARCH_HAS_PHASE_GUEST_STAMPS
+
+// uthread.c 的抢占 : guest 运行在 PLV0, 可以直接读写 CSR 和开关中断。KS4 指向
+// 当前 vcpu 上的 struct uthread_cpu, 时钟中断的 vector 也通过它找到 worker 。
+// uthread 会在 vcpu 之间迁移，所以每次都重新读取，不能缓存
+#define ARCH_HAS_UTHREAD
+
+static inline void *arch_uthread_cpu(void)
+{
+	void *c;
+	__asm__ volatile("csrrd %0, 0x34" : "=r"(c) : : "memory");
+	return c;
+}
+
+static inline void arch_set_uthread_cpu(void *c)
+{
+	__asm__ volatile("csrwr %0, 0x34" : "+r"(c) : : "memory");
+}
+
+// 关闭 CRMD.IE, 返回原来的 CRMD
+static inline u64 arch_irq_save(void)
+{
+	u64 crmd = 0;
+	__asm__ volatile("csrxchg %0, %1, 0x0"
+			 : "+r"(crmd)
+			 : "q"(0x4ULL)
+			 : "memory");
+	return crmd;
+}
+
+static inline void arch_irq_restore(u64 crmd)
+{
+	__asm__ volatile("csrxchg %0, %1, 0x0"
+			 : "+r"(crmd)
+			 : "q"(0x4ULL)
+			 : "memory");
+}
+
+// 打开周期为 ticks 的 stable timer 中断 (TCFG 的低两位是 Periodic 和 En)
+static inline void arch_uthread_timer_start(u64 ticks)
+{
+	u64 tcfg = (ticks & ~3ULL) | 3;
+	u64 lie = 1 << 11;
+	__asm__ volatile("csrwr %0, 0x41" : "+r"(tcfg) : : "memory");
+	__asm__ volatile("csrxchg %0, %1, 0x4" : "+r"(lie) : "q"(1ULL << 11)
+			 : "memory");
+	arch_irq_restore(0x4);
+}
+
+// 恢复到 init_csr 之后的状态，vcpu 被其他线程复用的时候不会收到时钟中断
+static inline void arch_uthread_timer_stop(void)
+{
+	u64 tcfg = 0, lie = 0, clr = 1;
+	u64 flags = arch_irq_save();
+	__asm__ volatile("csrxchg %0, %1, 0x4" : "+r"(lie) : "q"(1ULL << 11)
+			 : "memory");
+	__asm__ volatile("csrwr %0, 0x41" : "+r"(tcfg) : : "memory");
+	__asm__ volatile("csrwr %0, 0x44" : "+r"(clr) : : "memory");
+	arch_irq_restore(flags);
+}
+
+// ipi.c : 其他 vcpu 通过 KVM_INTERRUPT 注入 SWI1, guest 打开 ECFG.LIE 中的
+// SWI1 和 CRMD.IE 之后由 ebase 中的中断 vector 分发
+#define ARCH_HAS_IPI
+#define ARCH_IPI_IRQ 1
+
+static inline void arch_ipi_enable(void)
+{
+	u64 lie = 1 << ARCH_IPI_IRQ;
+	__asm__ volatile("csrxchg %0, %1, 0x4"
+			 : "+r"(lie)
+			 : "q"(1ULL << ARCH_IPI_IRQ)
+			 : "memory");
+	arch_irq_restore(0x4);
+}
+
+// KS5 是 DMW1 窗口中 vcpu 的 syscall_parameter 的地址，affinity.c 在每一次
+// KVM_RUN 之前更新 struct kvm_cpu 中的 host_cpu 。CPUNUM 也是 host cpu, 但是
+// 只有 9 位
+#define ARCH_HAS_HOST_CPU
+
+static inline u64 *arch_syscall_parameter(void)
+{
+	u64 *p;
+	__asm__ volatile("csrrd %0, 0x35" : "=r"(p));
+	return p;
+}
+
+// pgtable.c : guest 页表和内核一样是 16K 的页和三级页表 (INIT_VALUE_PWCTL0/1),
+// PT, Dir1 和 Dir3 分别翻译 bit 14-24, 25-35 和 36-46, Dir1 的目录项可以是 32M 的
+// 大页。根目录在 PGDL 中，Dir3 的目录项为 0 的地址仍然使用 512M 的 identity
+// mapping 。页表项就是 TLBRELO 的格式，大页的 G 位在 bit 12 (HGLOBAL)
+#define ARCH_HAS_GUEST_PT
+#define ARCH_PT_PAGE_SHIFT 14
+#define ARCH_PT_HUGE_SHIFT 25
+#define ARCH_PT_ROOT_SHIFT 36
+#define ARCH_PT_ENTRIES 2048
+
+#define ARCH_PTE_V (1ULL << 0)
+#define ARCH_PTE_D (1ULL << 1)
+#define ARCH_PTE_MAT_CC (1ULL << 4)
+#define ARCH_PTE_G (1ULL << 6)
+#define ARCH_PTE_HUGE (1ULL << 6)
+#define ARCH_PTE_HGLOBAL (1ULL << 12)
+#define ARCH_PTE_NR (1ULL << 61)
+#define ARCH_PTE_NX (1ULL << 62)
+#define ARCH_PTE_PERM (ARCH_PTE_D | ARCH_PTE_NR | ARCH_PTE_NX)
+// 软件使用的位，和内核一样硬件不会解释 : dune_dirty_begin 跟踪的页有
+// ARCH_PTE_TRACK, 其中可写的页用 ARCH_PTE_W 代替 D, 写入之后由 PME 的
+// vector 设置 D 和 ARCH_PTE_DIRTY
+#define ARCH_PTE_W (1ULL << 8)
+#define ARCH_PTE_DIRTY (1ULL << 9)
+#define ARCH_PTE_TRACK (1ULL << 10)
+
+static inline u64 *arch_pt_root(void)
+{
+	u64 *root;
+	__asm__ volatile("csrrd %0, 0x19" : "=r"(root));
+	return root;
+}
+
+// DUNE_TRANSLATION=dmw 的时候 DMWIN0 覆盖整个用户地址空间，页表不会被使用
+static inline bool arch_pt_bypassed(void)
+{
+	u64 dmw;
+	__asm__ volatile("csrrd %0, 0x180" : "=r"(dmw));
+	return dmw != 0;
+}
+
+// prot 是 PROT_READ, PROT_WRITE 和 PROT_EXEC 的组合
+static inline u64 arch_pte_perm(int prot)
+{
+	u64 perm = 0;
+	if (prot & PROT_WRITE)
+		perm |= ARCH_PTE_D;
+	if (!(prot & PROT_READ))
+		perm |= ARCH_PTE_NR;
+	if (!(prot & PROT_EXEC))
+		perm |= ARCH_PTE_NX;
+	return perm;
+}
+
+// perm 来自 arch_pte_perm
+static inline u64 arch_pte(u64 pa, u64 perm, bool huge)
+{
+	u64 bits = ARCH_PTE_V | ARCH_PTE_MAT_CC | perm;
+	return pa | bits | (huge ? ARCH_PTE_HUGE | ARCH_PTE_HGLOBAL : ARCH_PTE_G);
+}
+
+static inline u64 arch_pte_addr(u64 pte, bool huge)
+{
+	u64 low = huge ? ARCH_PT_HUGE_SHIFT : ARCH_PT_PAGE_SHIFT;
+	return pte & ((1ULL << 48) - 1) & ~((1ULL << low) - 1);
+}
+
+// Dir1 的目录项是大页还是指向 PT
+static inline bool arch_pte_huge(u64 pte)
+{
+	return pte & ARCH_PTE_HUGE;
+}
+
+// 只影响当前的 vcpu, 其他 vcpu 需要 shootdown
+static inline void arch_tlb_flush_page(u64 va)
+{
+	__asm__ volatile("invtlb 6, $zero, %0" : : "r"(va) : "memory");
+}
+
+static inline void arch_tlb_flush_all(void)
+{
+	__asm__ volatile("invtlb 0, $zero, $zero" : : : "memory");
+}
+
+// fault.c : TLB 异常 (PIL 到 PPI) 和 ADE 的 vector 把 ERA 换成 fault_entry,
+// fault_dispatch 收到的现场中下标是寄存器编号，ERA 在 ARCH_FAULT_FRAME_PC
+#define ARCH_HAS_FAULT
+#define ARCH_FAULT_FRAME_PC 35
+
+// 写入的指令对当前 vcpu 之后的取指可见
+static inline void arch_icache_sync(void)
+{
+	__asm__ volatile("ibar 0" : : : "memory");
+}
+
+// stable counter, guest 中读到的值加上了 GCNTC 的偏移
+static inline u64 arch_read_counter(void)
+{
+	u64 val;
+	__asm__ volatile("rdtime.d %0, $zero" : "=r"(val));
+	return val;
+}
 #endif /* end of include guard: ARCH_H_BPXBLEPN */
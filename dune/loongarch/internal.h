@@ -239,8 +239,16 @@
 #define LOONGARCH_CSR_TLBRELO1 0x8d /* TLB refill entrylo1 */
 #define LOONGARCH_CSR_TLBREHI 0x8e /* TLB refill entryhi */
 #define LOONGARCH_CSR_TLBRPRMD 0x8f /* TLB refill mode info */
+#define LOONGARCH_CSR_PGD 0x1b /* PGDL or PGDH selected by the bad vaddr */
+#define LOONGARCH_CSR_BADV 0x7 /* Bad virtual address */
 
 #define LOONGARCH_CSR_EPC		0x6	/* EPC */
+#define LOONGARCH_CSR_EUEN 0x2 /* Extended unit enable */
+#define LOONGARCH_CSR_ESTAT 0x5 /* Exception status */
+#define LOONGARCH_CSR_CRMD 0x0 /* Current mode info */
+#define LOONGARCH_CSR_PRMD 0x1 /* Prev-exception mode info */
+#define LOONGARCH_CSR_TCFG 0x41 /* Timer config */
+#define LOONGARCH_CSR_TINTCLR 0x44 /* Timer interrupt clear */
 
 #define DMW_PABITS 48
 #define CSR_DMW1_PLV0 _CONST64_(1 << 0)
@@ -248,6 +256,9 @@
 #define CSR_DMW1_VSEG _CONST64_(0x9000)
 #define CSR_DMW1_BASE (CSR_DMW1_VSEG << DMW_PABITS)
 #define CSR_DMW1_INIT (CSR_DMW1_BASE | CSR_DMW1_MAT | CSR_DMW1_PLV0)
+// DUNE_TRANSLATION=dmw : VSEG 为 0 的 DMWIN0 覆盖整个用户地址空间，PLV0 的访问
+// 直接使用 VA[47:0] 作为物理地址，和 TLB refill 建立的 identity mapping 相同
+#define CSR_DMW0_INIT (CSR_DMW1_MAT | CSR_DMW1_PLV0)
 #define LOONGARCH_CSR_EPC		0x6	/* EPC */
 
 /* Kscratch registers */
@@ -329,7 +340,59 @@
 	(1 << (INIT_VALUE_ECFG >> CSR_ECFG_VS_SHIFT)) * INSTRUCTION_SIZE
 #define ERREBASE_OFFSET (PAGESIZE * 3)
 
+#define EXCCODE_PIL 1 /* Page invalid for load */
+#define EXCCODE_PIS 2 /* Page invalid for store */
+#define EXCCODE_PIF 3 /* Page invalid for fetch */
+#define EXCCODE_PME 4 /* Page modification */
+#define EXCCODE_PNR 5 /* Page non-readable */
+#define EXCCODE_PNX 6 /* Page non-executable */
+#define EXCCODE_PPI 7 /* Page privilege illegal */
+#define EXCCODE_ADE 8 /* Address error */
 #define EXCCODE_SYS 11 /* System call */
+#define EXCCODE_FPDIS 15 /* FPU Disabled */
+#define EXCCODE_LSXDIS 16 /* LSX Disabled */
+#define EXCCODE_LASXDIS 17 /* LASX Disabled */
+#define INT_SWI1 1 /* Software interrupt 1, 用于 ipi.c */
+#define INT_TI 11 /* Timer */
+
+// 中断的 vector 之间不会嵌套，都使用 INT_TMP_KS 保存 t0 。TLB 异常的 vector 和
+// fault_entry 也使用它，它们只会嵌套在 syscall 的 vector 中
+#define INT_TMP_KS LOONGARCH_CSR_KS3
+// PME 的 vector 在 INT_TMP_KS, PME_T1_KS 和 PME_T2_KS 中保存 t0, t1 和 t2 。
+// PME 不会发生在中断和 FPU 的 vector 中，它们只访问 DMW 中的 syscall_parameter
+#define PME_T1_KS LOONGARCH_CSR_KS8
+#define PME_T2_KS LOONGARCH_CSR_KS1
+#define CSR_CRMD_IE 0x4
+#define CSR_PRMD_PIE 0x4
+#define CSR_ECFG_LIE_SWI1 (1 << INT_SWI1)
+#define CSR_ECFG_LIE_TI (1 << INT_TI)
+#define CSR_ESTAT_SWI1 (1 << INT_SWI1)
+
+// uthread.c 的抢占 : stable timer 中断的 vector 通过 UTHREAD_KS 找到当前 vcpu 上的
+// struct uthread_cpu, 可以抢占的时候把 ERA 改为 resched_entry, 否则只设置
+// need_resched
+#define UTHREAD_KS LOONGARCH_CSR_KS4
+#define CSR_TINTCLR_TI 0x1
+// struct uthread_cpu 中的偏移
+#define UTHREAD_PREEMPT_OFF 0
+#define UTHREAD_NEED_RESCHED 8
+#define UTHREAD_ERA 16
+#define UTHREAD_RESCHED_ENTRY 24
+#define UTHREAD_SCRATCH 32
+#define UTHREAD_TICKS 40
+// uthread_preempt_entry 和 ipi_entry 在栈上保存的现场 : 通用寄存器按照编号存放,
+// 之后是 EUEN, fcsr0, fcc 和 ERA, 最后是 32 个向量寄存器 (按照 EUEN 使用 xvst,
+// vst 或者 fst.d)
+#define CONTEXT_FRAME_FPMODE 256
+#define CONTEXT_FRAME_FCSR 264
+#define CONTEXT_FRAME_FCC 272
+#define CONTEXT_FRAME_ERA 280
+#define CONTEXT_FRAME_VREGS 288
+#define CONTEXT_FRAME_SIZE (CONTEXT_FRAME_VREGS + 32 * 32)
+// uthread_switch 保存 ra, fp, s0-s8, FPU 是否打开和 fs0-fs7
+#define UTHREAD_SWITCH_FPEN 88
+#define UTHREAD_SWITCH_FS 96
+#define UTHREAD_SWITCH_FRAME 160
 
 #define CSR_TLBRELO_RPLV_SHIFT 63
 #define CSR_TLBRELO_RPLV (_ULCAST_(0x1) << CSR_TLBRELO_RPLV_SHIFT)
@@ -361,13 +424,19 @@
 	(CSR_TLBRELO_V | CSR_TLBRELO_WE | CSR_TLBRELO_CCA | CSR_TLBRELO_GLOBAL)
 #define TLBRELO1_STANDARD_BITS (TLBRELO0_STANDARD_BITS | (1 << TLB_PS))
 
-// ring 0, disable interrupt, mapping
+// ring 0, enable interrupt, mapping
+// 只有 ECFG 中打开的 SWI1 可以进入，pgtable.c 的 shootdown 需要所有的 vcpu 都可以
+// 收到 IPI, 没有注册 ipi handler 的时候 vector 只清除中断
 #define CRMD_PG 4
-#define INIT_VALUE_CRMD (1 << CRMD_PG)
-#define INIT_VALUE_EUEN 0x7
+#define INIT_VALUE_CRMD ((1 << CRMD_PG) | CSR_CRMD_IE)
+// FPU, LSX 和 LASX 在第一次使用的时候才打开，见 fpu_entry_begin
+#define INIT_VALUE_EUEN 0x0
+#define CSR_EUEN_FPEN 0x1
+#define CSR_EUEN_LSXEN 0x2
+#define CSR_EUEN_LASXEN 0x4
 #define INIT_VALUE_MISC 0x0
-// VS 指令间距是 2 ** 7, 屏蔽 IPI ，时钟，性能计数器 和 硬中断
-#define INIT_VALUE_ECFG 0x70000
+// VS 指令间距是 2 ** 7, 打开 SWI1, 屏蔽 IPI ，时钟，性能计数器 和 硬中断
+#define INIT_VALUE_ECFG (0x70000 | CSR_ECFG_LIE_SWI1)
 // 无需配置缩减虚拟地址
 #define INIT_VALUE_RVACFG 0x0
 // 读取的 LLBCTL 总是 0, 猜测是因为多数情况下，LLBit 都不会被其他人清零，所以总是 0
@@ -379,6 +448,8 @@
 
 // kvm_vz_vcpu_setup 将 timerid 初始化为 `vcpu->vcpu_id`
 // 而 ioctl(vcpu->vm->vm_fd, KVM_CREATE_VCPU, vcpu->cpu_id);
+// vDSO 的 getcpu 通过 rdtime.d 读取 timerid, 所以 arch_set_cpunum 把它和 CPUNUM
+// 一起改为 host cpu
 #define INIT_VALUE_TIMERCFG 0x0
 
 // CPUCFG 知道一共存在 4 个，从内核的定义来看，也是如此的
@@ -413,6 +484,79 @@
 #define END(function)					\
 		.size	function, .-function
 
+// struct kvm_cpu 中 sidecar_mailbox 相对 syscall_parameter 的偏移和状态,
+// 需要和 interface.h 中的 enum SIDECAR_STATE 保持一致
+#define SIDECAR_MAILBOX 64
+#define MAILBOX_IDLE 1
+#define MAILBOX_REQUEST 2
+#define MAILBOX_DONE 3
+
+// struct kvm_cpu 中 syscall_era, phase_stamp, fastpath_bitmap 和
+// fastpath_value 相对 syscall_parameter 的偏移，需要和 interface.h 保持一致
+#define SYSCALL_ERA 72
+#define PHASE_STAMP 80
+#define FASTPATH_BITMAP 104
+#define FASTPATH_VALUE 136
+#define FASTPATH_LIMIT 256
+
+// struct kvm_cpu 中 ipi.c 使用的成员相对 syscall_parameter 的偏移，超过了
+// ld.d / st.d 的立即数范围，需要使用 ldptr.d / stptr.d
+#define IPI_PENDING 2184
+#define IPI_HANDLER 2192
+#define IPI_ENTRY 2200
+#define IPI_ERA 2208
+#define IPI_SCRATCH 2216
+
+// futex.c 的快速路径 : struct kvm_cpu 中 futex_waiters 和 futex_spin 的偏移,
+// futex_waiters 是 FUTEX_HASH_SIZE 个按照 (uaddr >> 2) 的低位索引的计数
+#define FUTEX_WAITER_TABLE 2224
+#define FUTEX_SPIN 2232
+#define FUTEX_HASH_BITS 10
+// <linux/futex.h> 中的常量给 entry.S 使用的副本，加上 DUNE_ 前缀避免和它冲突
+#define DUNE_FUTEX_WAIT_CMD 0
+#define DUNE_FUTEX_WAKE_CMD 1
+#define DUNE_FUTEX_WAIT_BITSET_CMD 9
+#define DUNE_FUTEX_WAKE_BITSET_CMD 10
+#define DUNE_FUTEX_PRIVATE 128
+#define DUNE_FUTEX_CMD_MASK 0x7f
+#define ERRNO_EAGAIN 11
+// entry.S 看不到 arch.h 中的 syscall 编号，需要和 arch.h 保持一致
+#define FUTEX_SYSNO 98
+
+// affinity.c : struct kvm_cpu 中 tlb_refills, host_cpu 和 host_node 的偏移
+#define TLB_REFILLS 2240
+#define HOST_CPU 2248
+#define HOST_NODE 2256
+
+// pgtable.c : struct kvm_cpu 中 tlb_flush 的偏移，不为 0 的时候 IPI 的 vector
+// 清空 guest 的 TLB 。guest 页表使用 16K 的页 (INIT_VALUE_STLBPS),
+// TLB refill 在 Dir3 的目录项不为 0 的时候由 lddir / ldpte 遍历页表
+#define TLB_FLUSH 2264
+#define PT_PS 14
+
+// pgtable.c 的 dirty 跟踪 : 被跟踪的页没有 D, 可写的页有 PTE_W, 写入触发 PME,
+// vector 设置 D 和 PTE_DIRTY 之后重新执行。和 arch.h 中的 ARCH_PTE_* 保持一致
+#define PTE_HUGE 0x40
+#define PTE_W 0x100
+#define PTE_D_DIRTY 0x202
+
+// fault.c : struct kvm_cpu 中 fault_entry 等成员的偏移。TLB 异常和 ADE 的 vector
+// 保存 ERA, PRMD, BADV 和 ecode, 然后把 ERA 换成 fault_entry
+#define FAULT_ENTRY 2272
+#define FAULT_ERA 2280
+#define FAULT_PRMD 2288
+#define FAULT_ADDR 2296
+#define FAULT_CODE 2304
+#define FAULT_SCRATCH 2312
+#define FAULT_STACK 2320
+#define FAULT_STACK_SIZE 2328
+
+// entry.S 看不到 arch.h 中的 syscall 编号，需要和 arch.h 保持一致
+#define GETCPU_SYSNO 168
+
+// DUNE_SYS_FPU_ENABLE, 需要和 interface.h 保持一致
+#define FPU_ENABLE_SYSNO 0x100009
+
 #define VCPU_FCSR0 0
 #define VCPU_VCSR 4
 #define VCPU_FCC 8
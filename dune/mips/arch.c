@@ -117,6 +117,20 @@ static void ebase_init_general(struct kvm_cpu *cpu)
 {
 	extern void ebase_general_entry_begin(void);
 	extern void ebase_general_entry_end(void);
+	BUILD_ASSERT(offsetof(struct kvm_cpu, syscall_era) -
+			     offsetof(struct kvm_cpu, syscall_parameter) ==
+		     SYSCALL_ERA);
+	BUILD_ASSERT(offsetof(struct kvm_cpu, phase_stamp) -
+			     offsetof(struct kvm_cpu, syscall_parameter) ==
+		     PHASE_STAMP);
+	BUILD_ASSERT(offsetof(struct kvm_cpu, fastpath_bitmap) -
+			     offsetof(struct kvm_cpu, syscall_parameter) ==
+		     FASTPATH_BITMAP);
+	BUILD_ASSERT(offsetof(struct kvm_cpu, fastpath_value) -
+			     offsetof(struct kvm_cpu, syscall_parameter) ==
+		     FASTPATH_VALUE);
+	BUILD_ASSERT(FASTPATH_LIMIT == FASTPATH_NR &&
+		     FASTPATH_SYSNO_BASE == SYSCALL_BASE);
 	memcpy(cpu->info.ebase + EBASE_GE_OFFSET, ebase_general_entry_begin,
 	       ebase_general_entry_end - ebase_general_entry_begin);
 }
@@ -435,6 +449,61 @@ bool do_syscall(struct kvm_cpu *cpu, bool is_fork)
 	return false;
 }
 
+long arch_raw_syscall(u64 sysno, const u64 args[6])
+{
+	register long r4 __asm__("$4") = args[0];
+	register long r5 __asm__("$5") = args[1];
+	register long r6 __asm__("$6") = args[2];
+	register long r7 __asm__("$7") = args[3];
+	register long r8 __asm__("$8") = args[4];
+	register long r9 __asm__("$9") = args[5];
+	register long r2 __asm__("$2");
+
+	__asm__ __volatile__("daddu $2,$0,%2 ; syscall"
+			     : "=&r"(r2), "+r"(r7)
+			     : "ir"(sysno), "0"(r2), "r"(r4), "r"(r5),
+			       "r"(r6), "r"(r8), "r"(r9)
+			     : SYSCALL_CLOBBERLIST);
+
+	// $7 非零表示失败，此时 $2 中是正数的 errno
+	return r7 ? -r2 : r2;
+}
+
+// syscall_parameter[0] 是 syscall number, 参数从 syscall_parameter[1] 开始
+u64 arch_get_syscall_arg(const struct kvm_cpu *cpu, int n)
+{
+	return cpu->syscall_parameter[n + 1];
+}
+
+void arch_set_syscall_ret(struct kvm_cpu *cpu, long ret)
+{
+	if (ret < 0) {
+		cpu->syscall_parameter[0] = -ret;
+		cpu->syscall_parameter[4] = 1;
+	} else {
+		cpu->syscall_parameter[0] = ret;
+		cpu->syscall_parameter[4] = 0;
+	}
+}
+
+long arch_get_syscall_ret(const struct kvm_cpu *cpu)
+{
+	long ret = cpu->syscall_parameter[0];
+	return cpu->syscall_parameter[4] ? -ret : ret;
+}
+
+// arch_read_counter 使用 CLOCK_MONOTONIC
+u64 arch_counter_freq(void)
+{
+	return 1000000000ULL;
+}
+
+// 没有 ARCH_HAS_PHASE_GUEST_STAMPS, guest 的时间戳不会被使用
+s64 arch_guest_counter_offset(const struct kvm_cpu *cpu)
+{
+	return 0;
+}
+
 void child_entry(struct kvm_cpu *cpu)
 {
 	host_loop(cpu);
@@ -453,8 +522,8 @@ void kvm_get_parent_thread_info(struct kvm_cpu *parent_cpu)
 	    0)
 		die("KVM_GET_REGS");
 
-	parent_cpu->info.epc =
-		kvm_get_cp0_reg(parent_cpu, KVM_REG_MIPS_CP0_EPC);
+	// syscall vector 已经保存了 EPC, 无需 KVM_GET_ONE_REG
+	parent_cpu->info.epc = parent_cpu->syscall_era;
 
 	kvm_get_fpu_regs(parent_cpu, &parent_cpu->info.fpu);
 }
@@ -511,6 +580,23 @@ void arch_set_thread_area(struct kvm_cpu *vcpu)
 	kvm_set_cp0_reg(vcpu, KVM_REG_MIPS_CP0_USERLOCAL, get_tp());
 }
 
+// init_cp0 中的 USERLOCAL 来自调用线程，所以 prewarm 只提前创建 vcpu
+void arch_prewarm_vcpu(struct kvm_cpu *vcpu, const struct kvm_cpu *model)
+{
+	ebase_share(vcpu, model);
+}
+
+// mips 的 guest 不读取 CPUNUM, 只统计迁移
+void arch_set_cpunum(struct kvm_cpu *cpu, int host_cpu)
+{
+}
+
+// mips 的 FPU 状态在 fork 的时候直接复制，guest 不会发出 DUNE_SYS_FPU_ENABLE
+long arch_enable_fpu(struct kvm_cpu *vcpu, u64 ecode)
+{
+	return -ENOSYS;
+}
+
 bool arch_handle_special_syscall(struct kvm_cpu *vcpu, u64 sysno)
 {
 	if (sysno == SYS_PIPE) {
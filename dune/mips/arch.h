@@ -6,6 +6,7 @@
 #else
 #include <linux/kvm.h>
 #endif
+#include <time.h>
 
 // reference from arch/mips/include/asm/processor.h
 #define FPU_REG_WIDTH 256
@@ -16,6 +17,7 @@ typedef unsigned char u8;
 typedef unsigned short u16;
 typedef unsigned int u32;
 typedef unsigned long long u64;
+typedef long long s64;
 
 union fpureg {
 	u32 val32[FPU_REG_WIDTH / 32];
@@ -35,7 +37,8 @@ struct thread_info {
 	u64 epc;
 	void *ebase;
 };
-#define KVM_MAX_VCPUS 16
+// 一个 shard 中 vcpu_pool 的大小，实际的上限是 KVM_CAP_MAX_VCPUS 和它中较小的
+#define KVM_MAX_VCPUS 64
 #define PAGESIZE (1 << PAGESHIFT)
 
 /**
@@ -45,8 +48,111 @@ struct thread_info {
 #define SYS_CLONE 5055
 #define SYS_FORK 5056
 #define SYS_EXIT 5058
+#define SYS_EXIT_GROUP 5205
 #define SYS_KEXEC_LOAD 5270
 #define SYS_CLONE3 5435
 #define SYS_SET_THREAD_AREA 5242
 
+// 结果依赖于调用线程的 syscall, 不能交给其他的 host 线程执行
+#define SYS_RT_SIGPROCMASK 5014
+#define SYS_SCHED_YIELD 5023
+#define SYS_GETRUSAGE 5096
+#define SYS_RT_SIGTIMEDWAIT 5126
+#define SYS_RT_SIGSUSPEND 5128
+#define SYS_SIGALTSTACK 5129
+#define SYS_PRCTL 5153
+#define SYS_SCHED_SETAFFINITY 5195
+#define SYS_SCHED_GETAFFINITY 5196
+#define SYS_RT_SIGRETURN 5211
+#define SYS_UNSHARE 5262
+#define SYS_SET_ROBUST_LIST 5268
+#define SYS_GETCPU 5271
+#define SYS_SETNS 5303
+#define SYS_RSEQ 5327
+
+// 结果可以被 host_loop 缓存的 syscall 和使缓存失效的 syscall
+#define SYS_GETPID 5038
+#define SYS_UNAME 5061
+#define SYS_GETRLIMIT 5095
+#define SYS_GETUID 5100
+#define SYS_GETGID 5102
+#define SYS_GETEUID 5105
+#define SYS_GETEGID 5106
+#define SYS_GETTID 5178
+#define SYS_PRLIMIT64 5297
+
+// futex.c 统计 host 中等待的 private futex
+#define SYS_FUTEX 5194
+
+#define SYS_SETUID 5103
+#define SYS_SETGID 5104
+#define SYS_SETREUID 5111
+#define SYS_SETREGID 5112
+#define SYS_SETRESUID 5115
+#define SYS_SETRESGID 5117
+#define SYS_SETFSUID 5120
+#define SYS_SETFSGID 5121
+#define SYS_SETRLIMIT 5155
+#define SYS_SETHOSTNAME 5165
+#define SYS_SETDOMAINNAME 5166
+
+// n64 的 syscall 从 5000 开始编号
+#define SYSCALL_BASE 5000
+#define SYSCALL_TABLE_SIZE 512
+
+#define ARCH_SYSCALL_KINDS(X)                                                  \
+	X(SYS_PIPE, SYSCALL_SPECIAL)                                           \
+	X(SYS_EXIT, SYSCALL_EXIT)                                              \
+	X(SYS_EXIT_GROUP, SYSCALL_EXIT_GROUP)                                  \
+	X(SYS_SET_THREAD_AREA, SYSCALL_SET_THREAD_AREA)                        \
+	X(SYS_CLONE, SYSCALL_FORK)                                             \
+	X(SYS_FORK, SYSCALL_FORK)                                              \
+	X(SYS_CLONE3, SYSCALL_FORK)                                            \
+	X(SYS_KEXEC_LOAD, SYSCALL_DENIED)                                      \
+	X(SYS_RT_SIGPROCMASK, SYSCALL_THREAD_BOUND)                            \
+	X(SYS_SCHED_YIELD, SYSCALL_THREAD_BOUND)                               \
+	X(SYS_GETRUSAGE, SYSCALL_THREAD_BOUND)                                 \
+	X(SYS_RT_SIGTIMEDWAIT, SYSCALL_THREAD_BOUND)                           \
+	X(SYS_RT_SIGSUSPEND, SYSCALL_THREAD_BOUND)                             \
+	X(SYS_SIGALTSTACK, SYSCALL_THREAD_BOUND)                               \
+	X(SYS_PRCTL, SYSCALL_THREAD_BOUND)                                     \
+	X(SYS_SCHED_SETAFFINITY, SYSCALL_THREAD_BOUND)                         \
+	X(SYS_SCHED_GETAFFINITY, SYSCALL_THREAD_BOUND)                         \
+	X(SYS_RT_SIGRETURN, SYSCALL_THREAD_BOUND)                              \
+	X(SYS_SET_ROBUST_LIST, SYSCALL_THREAD_BOUND)                           \
+	X(SYS_GETCPU, SYSCALL_THREAD_BOUND)                                    \
+	X(SYS_RSEQ, SYSCALL_THREAD_BOUND)                                      \
+	X(SYS_GETPID, SYSCALL_CACHED)                                          \
+	X(SYS_UNAME, SYSCALL_CACHED)                                           \
+	X(SYS_GETRLIMIT, SYSCALL_CACHED)                                       \
+	X(SYS_GETUID, SYSCALL_CACHED)                                          \
+	X(SYS_GETGID, SYSCALL_CACHED)                                          \
+	X(SYS_GETEUID, SYSCALL_CACHED)                                         \
+	X(SYS_GETEGID, SYSCALL_CACHED)                                         \
+	X(SYS_GETTID, SYSCALL_CACHED)                                          \
+	X(SYS_PRLIMIT64, SYSCALL_CACHED)                                       \
+	X(SYS_SETUID, SYSCALL_INVALIDATE)                                      \
+	X(SYS_SETGID, SYSCALL_INVALIDATE)                                      \
+	X(SYS_SETREUID, SYSCALL_INVALIDATE)                                    \
+	X(SYS_SETREGID, SYSCALL_INVALIDATE)                                    \
+	X(SYS_SETRESUID, SYSCALL_INVALIDATE)                                   \
+	X(SYS_SETRESGID, SYSCALL_INVALIDATE)                                   \
+	X(SYS_SETFSUID, SYSCALL_INVALIDATE)                                    \
+	X(SYS_SETFSGID, SYSCALL_INVALIDATE)                                    \
+	X(SYS_SETRLIMIT, SYSCALL_INVALIDATE)                                   \
+	X(SYS_SETHOSTNAME, SYSCALL_INVALIDATE)                                 \
+	X(SYS_SETDOMAINNAME, SYSCALL_INVALIDATE)                               \
+	X(SYS_UNSHARE, SYSCALL_INVALIDATE)                                     \
+	X(SYS_SETNS, SYSCALL_INVALIDATE)                                       \
+	X(SYS_FUTEX, SYSCALL_FUTEX)
+
+// guest 中的 count 寄存器和 host 之间的关系不确定，syscall vector 不写入
+// phase_stamp, 只统计 host 中的阶段。host 使用 CLOCK_MONOTONIC, 单位为 ns
+static inline u64 arch_read_counter(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
 #endif /* end of include guard: ARCH_H_IXTSIDHV */
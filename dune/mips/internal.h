@@ -131,6 +131,15 @@
 #define UNIMP_ERROR .word (0x42000028 | (0xf << 11))
 #define HYPERCALL .word 0x42000028
 
+// struct kvm_cpu 中 syscall_era, phase_stamp, fastpath_bitmap 和
+// fastpath_value 相对 syscall_parameter 的偏移，需要和 interface.h 保持一致
+#define SYSCALL_ERA 72
+#define PHASE_STAMP 80
+#define FASTPATH_BITMAP 104
+#define FASTPATH_VALUE 136
+#define FASTPATH_LIMIT 256
+#define FASTPATH_SYSNO_BASE 5000
+
 /* Some CP0 registers */
 #define C0_INDEX	0, 0
 #define C0_ENTRYLO0	$2, 0
@@ -0,0 +1,533 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+#include "interface.h"
+#include "dune.h"
+
+// 应用自己管理的 guest 页表。dune_vm_reserve 在 host 中保留一段 PROT_NONE 的地址,
+// 然后在根目录中填入 Dir1, guest 的 TLB refill vector 发现 Dir3 的目录项不为 0
+// 的时候使用硬件的页表遍历，否则仍然是 512M 的 identity mapping 。页表在 guest
+// 的内存中，修改不需要 hypercall, 只有 shootdown 需要 host 注入 IPI 。
+//
+// Dir1 的目录项有三种 : 指向 PT (包括所有的项都为 0 的 invalid_pt), 大页，和
+// 没有映射的大页 (只有 ARCH_PTE_HUGE) 。TLB 中同一个地址不能同时存在大页和 16K
+// 的页，所以目录项在大页和 PT 之间变化之前先 shootdown, 去掉其他 vcpu 访问没有
+// 映射的地址留下的无效项。已经映射的大页需要先 unmap 才能映射为 16K 的页,
+// protect 和 unmap 也不会拆分大页。
+//
+// pgtable_shootdown 给所有的 vcpu 设置 tlb_flush 并且注入 ARCH_IPI_IRQ, 然后等待
+// 正在 guest 中运行的 vcpu 清除 tlb_flush 。不在 guest 中的 vcpu 在下一次进入
+// guest 的时候先处理中断，不需要等待; 在 syscall vector 中等待 sidecar 的
+// vcpu 关闭了中断，返回之前不会访问用户的内存，也不需要等待。
+// mask 不为 0 的时候是按照 vcpu_global_id 索引的位图，只处理其中的 vcpu 。
+
+static inline bool shootdown_target(const u64 *mask, struct kvm_cpu *vcpu)
+{
+	int id = vcpu_global_id(vcpu);
+	return mask == NULL || (mask[id / 64] & (1ULL << (id % 64)));
+}
+
+long pgtable_shootdown(struct kvm_cpu *self, u64 mask)
+{
+#ifndef ARCH_HAS_GUEST_PT
+	return -ENOSYS;
+#else
+	struct kvm_interrupt irq = { .irq = ARCH_IPI_IRQ };
+	const u64 *targets = (const u64 *)mask;
+	struct kvm_cpu *vcpu;
+	int iter = 0;
+	while ((vcpu = kvm_next_vcpu(self->vm, &iter)) != NULL) {
+		if (!shootdown_target(targets, vcpu))
+			continue;
+		__atomic_store_n(&vcpu->tlb_flush, 1, __ATOMIC_SEQ_CST);
+		if (ioctl(vcpu->vcpu_fd, KVM_INTERRUPT, &irq) < 0)
+			die("pgtable_shootdown : KVM_INTERRUPT");
+	}
+
+	iter = 0;
+	while ((vcpu = kvm_next_vcpu(self->vm, &iter)) != NULL) {
+		if (vcpu == self || !shootdown_target(targets, vcpu))
+			continue;
+		while (__atomic_load_n(&vcpu->tlb_flush, __ATOMIC_ACQUIRE) &&
+		       __atomic_load_n(&vcpu->in_guest, __ATOMIC_ACQUIRE) &&
+		       __atomic_load_n(&vcpu->sidecar_mailbox,
+				       __ATOMIC_RELAXED) != SIDECAR_REQUEST)
+			;
+	}
+	return 0;
+#endif
+}
+
+int dune_vm_shootdown(void)
+{
+	long ret = syscall(DUNE_SYS_VM_SHOOTDOWN, 0);
+	return ret == -1 ? -errno : ret;
+}
+
+#ifndef ARCH_HAS_GUEST_PT
+int dune_vm_reserve(unsigned long size, void **va)
+{
+	return -ENOSYS;
+}
+
+int dune_vm_map(void *va, void *pa, unsigned long len, int prot)
+{
+	return -ENOSYS;
+}
+
+int dune_vm_unmap(void *va, unsigned long len)
+{
+	return -ENOSYS;
+}
+
+int dune_vm_protect(void *va, unsigned long len, int prot)
+{
+	return -ENOSYS;
+}
+
+int dune_dirty_begin(const struct dune_dirty_region *region)
+{
+	return -ENOSYS;
+}
+
+long dune_dirty_collect(const struct dune_dirty_region *region,
+			unsigned long long *bitmap)
+{
+	return -ENOSYS;
+}
+
+int dune_dirty_end(const struct dune_dirty_region *region)
+{
+	return -ENOSYS;
+}
+#else
+
+#define PT_PAGE (1ULL << ARCH_PT_PAGE_SHIFT)
+#define PT_HUGE (1ULL << ARCH_PT_HUGE_SHIFT)
+#define PT_ROOT (1ULL << ARCH_PT_ROOT_SHIFT)
+#define PT_INDEX(va, shift) (((va) >> (shift)) & (ARCH_PT_ENTRIES - 1))
+// 超过这个页数的时候清空整个 TLB
+#define PT_FLUSH_PAGES 64
+// 没有映射的大页
+#define PT_HUGE_NONE ARCH_PTE_HUGE
+
+// 所有的项都为 0, 没有 PT 的 Dir1 目录项都指向它
+static u64 invalid_pt[ARCH_PT_ENTRIES] __attribute__((aligned(PAGESIZE)));
+static pthread_mutex_t pt_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static u64 *pt_alloc(u64 fill)
+{
+	u64 *table = aligned_alloc(PAGESIZE, PAGESIZE);
+	if (table == NULL)
+		return NULL;
+	for (int i = 0; i < ARCH_PT_ENTRIES; ++i)
+		table[i] = fill;
+	return table;
+}
+
+// va 所在的 Dir1 目录项，不在 dune_vm_reserve 保留的范围中的时候返回 NULL
+static u64 *pt_dir(u64 va)
+{
+	u64 dir = __atomic_load_n(&arch_pt_root()[PT_INDEX(va, ARCH_PT_ROOT_SHIFT)],
+				  __ATOMIC_ACQUIRE);
+	if (dir == 0)
+		return NULL;
+	return &((u64 *)dir)[PT_INDEX(va, ARCH_PT_HUGE_SHIFT)];
+}
+
+// dir 是指向 PT 的 Dir1 目录项
+static inline u64 *pt_pte(u64 dir, u64 va)
+{
+	return &((u64 *)dir)[PT_INDEX(va, ARCH_PT_PAGE_SHIFT)];
+}
+
+static inline bool pt_is_table(u64 entry)
+{
+	return entry != (u64)invalid_pt && !arch_pte_huge(entry);
+}
+
+static inline u64 pt_chunk_end(u64 va, u64 end)
+{
+	u64 next = (va & ~(PT_HUGE - 1)) + PT_HUGE;
+	return next < end ? next : end;
+}
+
+static inline bool pt_whole_huge(u64 va, u64 chunk_end)
+{
+	return !(va & (PT_HUGE - 1)) && chunk_end - va == PT_HUGE;
+}
+
+static void pt_set(u64 *entry, u64 val)
+{
+	__atomic_store_n(entry, val, __ATOMIC_RELEASE);
+}
+
+static void pt_flush_local(u64 va, u64 len)
+{
+	// 页表的修改先于 invtlb 之后的 refill
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (len / PT_PAGE > PT_FLUSH_PAGES) {
+		arch_tlb_flush_all();
+		return;
+	}
+	for (u64 a = va; a < va + len; a += PT_PAGE)
+		arch_tlb_flush_page(a);
+}
+
+// 检查 [va, end) 都在保留的范围中，unmap 和 protect 还要求覆盖整个大页
+static int pt_check(u64 va, u64 end, bool whole_huge)
+{
+	for (u64 v = va; v < end; v = pt_chunk_end(v, end)) {
+		u64 *dir = pt_dir(v);
+		if (dir == NULL)
+			return -EINVAL;
+		if (whole_huge && arch_pte_huge(*dir) &&
+		    !pt_whole_huge(v, pt_chunk_end(v, end)))
+			return -EINVAL;
+	}
+	return 0;
+}
+
+int dune_vm_reserve(unsigned long size, void **va)
+{
+	if (size == 0 || va == NULL || arch_pt_bypassed())
+		return -EINVAL;
+
+	// 多保留一个 PT_ROOT 用来对齐
+	size = (size + PT_ROOT - 1) & ~(PT_ROOT - 1);
+	char *raw = mmap(NULL, size + PT_ROOT, PROT_NONE,
+			 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (raw == MAP_FAILED)
+		return -errno;
+	u64 start = ((u64)raw + PT_ROOT - 1) & ~(PT_ROOT - 1);
+	u64 end = start + size;
+	if (start != (u64)raw)
+		munmap(raw, start - (u64)raw);
+	if (end != (u64)raw + size + PT_ROOT)
+		munmap((void *)end, (u64)raw + size + PT_ROOT - end);
+
+	int ret = 0;
+	pthread_mutex_lock(&pt_lock);
+	u64 *root = arch_pt_root();
+	for (u64 v = start; v < end; v += PT_ROOT) {
+		u64 *dir = pt_alloc((u64)invalid_pt);
+		if (dir == NULL) {
+			ret = -ENOMEM;
+			break;
+		}
+		pt_set(&root[PT_INDEX(v, ARCH_PT_ROOT_SHIFT)], (u64)dir);
+	}
+	pthread_mutex_unlock(&pt_lock);
+
+	// 这段地址之前可能被其他的映射使用过，vcpu 中还有 identity mapping 的 TLB
+	if (ret == 0)
+		ret = dune_vm_shootdown();
+	if (ret == 0)
+		*va = (void *)start;
+	return ret;
+}
+
+// 已经有 PT 或者 DUNE_VM_NOHUGE 的时候使用 16K 的页
+static inline bool pt_use_huge(u64 va, u64 chunk_end, u64 pa, u64 entry,
+			       bool nohuge)
+{
+	return !nohuge && pt_whole_huge(va, chunk_end) &&
+	       !(pa & (PT_HUGE - 1)) && !pt_is_table(entry);
+}
+
+static int pt_map(u64 va, u64 pa, u64 end, u64 perm, bool nohuge)
+{
+	// 第一遍检查，并且确定是否有目录项需要在大页和 PT 之间变化
+	bool shootdown = false;
+	for (u64 v = va; v < end; v = pt_chunk_end(v, end)) {
+		u64 *dir = pt_dir(v);
+		if (dir == NULL)
+			return -EINVAL;
+		bool huge = pt_use_huge(v, pt_chunk_end(v, end), pa + v - va,
+					*dir, nohuge);
+		if (!huge && arch_pte_huge(*dir) && *dir != PT_HUGE_NONE)
+			return -EBUSY;
+		if (huge != arch_pte_huge(*dir))
+			shootdown = true;
+	}
+	if (shootdown) {
+		int ret = dune_vm_shootdown();
+		if (ret)
+			return ret;
+	}
+
+	for (u64 v = va; v < end; v = pt_chunk_end(v, end)) {
+		u64 *dir = pt_dir(v);
+		u64 chunk_end = pt_chunk_end(v, end);
+		u64 p = pa + v - va;
+		if (pt_use_huge(v, chunk_end, p, *dir, nohuge)) {
+			pt_set(dir, arch_pte(p, perm, true));
+			continue;
+		}
+
+		if (!pt_is_table(*dir)) {
+			u64 *table = pt_alloc(0);
+			if (table == NULL)
+				return -ENOMEM;
+			pt_set(dir, (u64)table);
+		}
+		u64 *table = (u64 *)*dir;
+		for (u64 a = v; a < chunk_end; a += PT_PAGE, p += PT_PAGE)
+			pt_set(&table[PT_INDEX(a, ARCH_PT_PAGE_SHIFT)],
+			       arch_pte(p, perm, false));
+	}
+	return 0;
+}
+
+int dune_vm_map(void *va, void *pa, unsigned long len, int prot)
+{
+	u64 v = (u64)va, p = (u64)pa;
+	if ((v | p | len) & (PT_PAGE - 1) || len == 0)
+		return -EINVAL;
+
+	pthread_mutex_lock(&pt_lock);
+	int ret = pt_map(v, p, v + len, arch_pte_perm(prot),
+			 prot & DUNE_VM_NOHUGE);
+	pthread_mutex_unlock(&pt_lock);
+	pt_flush_local(v, len);
+	return ret;
+}
+
+int dune_vm_unmap(void *va, unsigned long len)
+{
+	u64 v = (u64)va, end = v + len;
+	if ((v | len) & (PT_PAGE - 1) || len == 0)
+		return -EINVAL;
+
+	pthread_mutex_lock(&pt_lock);
+	int ret = pt_check(v, end, true);
+	for (; ret == 0 && v < end; v = pt_chunk_end(v, end)) {
+		u64 *dir = pt_dir(v);
+		if (arch_pte_huge(*dir)) {
+			pt_set(dir, PT_HUGE_NONE);
+			continue;
+		}
+		if (!pt_is_table(*dir))
+			continue;
+		u64 *table = (u64 *)*dir;
+		for (u64 a = v; a < pt_chunk_end(v, end); a += PT_PAGE)
+			pt_set(&table[PT_INDEX(a, ARCH_PT_PAGE_SHIFT)], 0);
+	}
+	pthread_mutex_unlock(&pt_lock);
+	pt_flush_local((u64)va, len);
+	return ret;
+}
+
+// dune_dirty_begin 跟踪的页用 ARCH_PTE_W 代替 D
+static inline u64 pt_reprotect(u64 entry, u64 perm)
+{
+	if (!(entry & ARCH_PTE_V))
+		return entry;
+	if (entry & ARCH_PTE_TRACK) {
+		// 可写并且已经被写过的页保留 D
+		u64 w = perm & ARCH_PTE_D ? ARCH_PTE_W : 0;
+		u64 d = w ? entry & ARCH_PTE_D : 0;
+		return (entry & ~(ARCH_PTE_PERM | ARCH_PTE_W)) |
+		       (perm & ~ARCH_PTE_D) | w | d;
+	}
+	return (entry & ~ARCH_PTE_PERM) | perm;
+}
+
+// PME 的 vector 可能同时在设置被跟踪的页的 D 和 ARCH_PTE_DIRTY
+static void pt_update(u64 *pte, u64 perm)
+{
+	u64 old = __atomic_load_n(pte, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(pte, &old, pt_reprotect(old, perm),
+					    false, __ATOMIC_RELEASE,
+					    __ATOMIC_RELAXED))
+		;
+}
+
+int dune_vm_protect(void *va, unsigned long len, int prot)
+{
+	u64 v = (u64)va, end = v + len, perm = arch_pte_perm(prot);
+	if ((v | len) & (PT_PAGE - 1) || len == 0)
+		return -EINVAL;
+
+	pthread_mutex_lock(&pt_lock);
+	int ret = pt_check(v, end, true);
+	for (; ret == 0 && v < end; v = pt_chunk_end(v, end)) {
+		u64 *dir = pt_dir(v);
+		if (arch_pte_huge(*dir)) {
+			pt_set(dir, pt_reprotect(*dir, perm));
+			continue;
+		}
+		if (!pt_is_table(*dir))
+			continue;
+		u64 *table = (u64 *)*dir;
+		for (u64 a = v; a < pt_chunk_end(v, end); a += PT_PAGE)
+			pt_update(pt_pte((u64)table, a), perm);
+	}
+	pthread_mutex_unlock(&pt_lock);
+	pt_flush_local((u64)va, len);
+	return ret;
+}
+
+// dirty 跟踪 : dune_dirty_begin 给区域中已经映射的 16K 的页加上 ARCH_PTE_TRACK,
+// 可写的页用 ARCH_PTE_W 代替 D 。之后第一次写入触发 PME, ebase 中的 vector 设置
+// D 和 ARCH_PTE_DIRTY, 不经过 host 。dune_dirty_collect 在 guest 中扫描 PTE,
+// 清除 D 之后其他 vcpu 的 TLB 中可能还有可写的项，存在其他 vcpu 的时候需要
+// DUNE_SYS_VM_SHOOTDOWN 的 hypercall 。
+
+static inline u64 pt_track(u64 pte)
+{
+	if (pte & ARCH_PTE_TRACK)
+		return pte & ~(ARCH_PTE_D | ARCH_PTE_DIRTY);
+	if (pte & ARCH_PTE_D)
+		return (pte & ~ARCH_PTE_D) | ARCH_PTE_W | ARCH_PTE_TRACK;
+	return pte | ARCH_PTE_TRACK;
+}
+
+static inline u64 pt_untrack(u64 pte)
+{
+	if (!(pte & ARCH_PTE_TRACK))
+		return pte;
+	u64 d = pte & ARCH_PTE_W ? ARCH_PTE_D : 0;
+	return (pte & ~(ARCH_PTE_TRACK | ARCH_PTE_W | ARCH_PTE_DIRTY)) | d;
+}
+
+// 返回 PTE 是否被修改
+static bool pt_exchange(u64 *pte, u64 (*fn)(u64))
+{
+	u64 old = __atomic_load_n(pte, __ATOMIC_RELAXED);
+	if (!(old & ARCH_PTE_V))
+		return false;
+	while (!__atomic_compare_exchange_n(pte, &old, fn(old), false,
+					    __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+		;
+	return fn(old) != old;
+}
+
+// 区域中不能有已经映射的大页，没有映射的页跳过
+static int pt_dirty_check(const struct dune_dirty_region *region)
+{
+	u64 v = (u64)region->addr, end = v + region->size;
+	if ((v | region->size) & (PT_PAGE - 1) || region->size == 0)
+		return -EINVAL;
+	int ret = pt_check(v, end, false);
+	for (; ret == 0 && v < end; v = pt_chunk_end(v, end)) {
+		u64 dir = *pt_dir(v);
+		if (arch_pte_huge(dir) && dir != PT_HUGE_NONE)
+			return -EINVAL;
+	}
+	return ret;
+}
+
+// 返回被修改的 PTE 的数量
+static long pt_dirty_walk(const struct dune_dirty_region *region,
+			  u64 (*fn)(u64))
+{
+	long changed = 0;
+	u64 v = (u64)region->addr, end = v + region->size;
+	for (; v < end; v = pt_chunk_end(v, end)) {
+		u64 dir = *pt_dir(v);
+		if (!pt_is_table(dir))
+			continue;
+		for (u64 a = v; a < pt_chunk_end(v, end); a += PT_PAGE)
+			changed += pt_exchange(pt_pte(dir, a), fn);
+	}
+	return changed;
+}
+
+// 当前的 vcpu 之外还有其他已经创建的 vcpu (包括 prewarm 中空闲的) 的时候发出
+// shootdown 的 hypercall, 不知道它们是否访问过这个区域
+static int pt_dirty_flush(const struct dune_dirty_region *region)
+{
+	pt_flush_local((u64)region->addr, region->size);
+	struct kvm_cpu *self =
+		(struct kvm_cpu *)((char *)arch_syscall_parameter() -
+				   offsetof(struct kvm_cpu, syscall_parameter));
+	struct kvm_cpu *vcpu;
+	int iter = 0;
+	while ((vcpu = kvm_next_vcpu(self->vm, &iter)) != NULL)
+		if (vcpu != self)
+			return dune_vm_shootdown();
+	return 0;
+}
+
+int dune_dirty_begin(const struct dune_dirty_region *region)
+{
+	pthread_mutex_lock(&pt_lock);
+	int ret = pt_dirty_check(region);
+	if (ret == 0)
+		pt_dirty_walk(region, pt_track);
+	pthread_mutex_unlock(&pt_lock);
+	return ret ? ret : pt_dirty_flush(region);
+}
+
+int dune_dirty_end(const struct dune_dirty_region *region)
+{
+	pthread_mutex_lock(&pt_lock);
+	int ret = pt_dirty_check(region);
+	if (ret == 0)
+		pt_dirty_walk(region, pt_untrack);
+	pthread_mutex_unlock(&pt_lock);
+	// 没有 D 的 TLB 项只会导致多余的 PME, vector 看到没有 ARCH_PTE_W 会退出到
+	// host, 所以仍然需要清除
+	return ret ? ret : pt_dirty_flush(region);
+}
+
+// 第一步清除 D, shootdown 之后其他 vcpu 的写入都会经过 PME, 第二步再读取并清除
+// ARCH_PTE_DIRTY 。第二步之前再次被写入的页 (D 又被设置) 保留 ARCH_PTE_DIRTY,
+// 下一次 collect 仍然报告，否则之后不经过 PME 的写入会被漏掉
+static u64 pt_dirty_disarm(u64 pte)
+{
+	return pte & ARCH_PTE_TRACK ? pte & ~ARCH_PTE_D : pte;
+}
+
+static u64 pt_dirty_take(u64 pte)
+{
+	return pte & ARCH_PTE_D ? pte : pte & ~ARCH_PTE_DIRTY;
+}
+
+long dune_dirty_collect(const struct dune_dirty_region *region,
+			unsigned long long *bitmap)
+{
+	u64 pages = region->size / PT_PAGE;
+	long armed = 0, dirty = 0;
+	pthread_mutex_lock(&pt_lock);
+	int ret = pt_dirty_check(region);
+	if (ret == 0)
+		armed = pt_dirty_walk(region, pt_dirty_disarm);
+	pthread_mutex_unlock(&pt_lock);
+
+	// 没有页被写过的时候不会有可写的 TLB 项
+	if (armed)
+		ret = pt_dirty_flush(region);
+	if (ret)
+		return ret;
+
+	memset(bitmap, 0, (pages + 63) / 64 * sizeof(*bitmap));
+	pthread_mutex_lock(&pt_lock);
+	ret = pt_dirty_check(region);
+	u64 v = (u64)region->addr, end = v + region->size;
+	for (; ret == 0 && v < end; v = pt_chunk_end(v, end)) {
+		u64 dir = *pt_dir(v);
+		if (!pt_is_table(dir))
+			continue;
+		for (u64 a = v; a < pt_chunk_end(v, end); a += PT_PAGE) {
+			u64 *pte = pt_pte(dir, a);
+			if (!(__atomic_load_n(pte, __ATOMIC_RELAXED) &
+			      ARCH_PTE_DIRTY))
+				continue;
+			pt_exchange(pte, pt_dirty_take);
+			u64 page = (a - (u64)region->addr) / PT_PAGE;
+			bitmap[page / 64] |= 1ULL << (page % 64);
+			dirty++;
+		}
+	}
+	pthread_mutex_unlock(&pt_lock);
+	return ret ? ret : dirty;
+}
+#endif
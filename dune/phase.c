@@ -0,0 +1,181 @@
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "interface.h"
+#include "dune.h"
+
+// 使用 -DDUNE_PHASE_TIMING 编译的时候，统计一次 hypercall 往返中每一个阶段的
+// 时间。guest 的 syscall vector 在 phase_stamp 中写入 G_VECTOR, G_HYPERCALL 和
+// G_RESUME, host_loop 记录 H_RUN_ENTER, H_RUN_EXIT 和 arch_do_syscall 前后的
+// 时间，两边都使用 stable counter, guest 的值减去 GCNTC 之后就可以和 host 比较。
+//
+// G_RESUME 在 guest 返回之后才写入，所以 PHASE_ENTRY 在下一次退出的时候统计。
+// 中间发生 KVM_EXIT_INTR 等情况导致时间戳不连续的样本直接丢弃。
+//
+// 和 stats.c 一样，vcpu 只修改自己的统计，查询的时候合并。
+
+#ifdef DUNE_PHASE_TIMING
+static const char *const phase_names[NR_PHASES] = {
+	[PHASE_VECTOR] = "vector",     [PHASE_EXIT] = "exit",
+	[PHASE_DISPATCH] = "dispatch", [PHASE_SYSCALL] = "syscall",
+	[PHASE_RETURN] = "return",     [PHASE_ENTRY] = "entry",
+};
+
+static void merge_phases(struct kvm_vm *vm, struct syscall_stat sum[NR_PHASES])
+{
+	struct kvm_cpu *vcpu;
+	int iter = 0;
+
+	memset(sum, 0, sizeof(struct syscall_stat) * NR_PHASES);
+	while ((vcpu = kvm_next_vcpu(vm, &iter)) != NULL) {
+		for (int j = 0; j < NR_PHASES; ++j)
+			stats_merge(&sum[j], &vcpu->phase.phases[j]);
+	}
+}
+#endif
+
+void phase_init(struct kvm_vm *vm)
+{
+	BUILD_ASSERT((int)DUNE_PHASE_NR == (int)NR_PHASES);
+	BUILD_ASSERT((int)DUNE_PHASE_ENTRY == (int)PHASE_ENTRY);
+
+	vm->phase_scale = 0;
+#ifdef DUNE_PHASE_TIMING
+	u64 freq = arch_counter_freq();
+	if (freq == 0)
+		die("unable to get the stable counter frequency");
+	vm->phase_scale = (1000000000ULL << 32) / freq;
+#endif
+}
+
+long phase_query(struct kvm_vm *vm, u64 uaddr)
+{
+#ifdef DUNE_PHASE_TIMING
+	struct dune_syscall_stat *out = (struct dune_syscall_stat *)uaddr;
+	if (out == NULL)
+		return -EFAULT;
+
+	struct syscall_stat sum[NR_PHASES];
+	merge_phases(vm, sum);
+	memcpy(out, sum, sizeof(sum));
+	return 0;
+#else
+	return -ENOSYS;
+#endif
+}
+
+void phase_dump(struct kvm_vm *vm, int fd)
+{
+#ifdef DUNE_PHASE_TIMING
+	struct syscall_stat sum[NR_PHASES];
+	merge_phases(vm, sum);
+
+	dprintf(fd, "%-8s %12s %14s %10s %10s %10s\n", "phase", "count",
+		"total_ns", "mean_ns", "p50_ns<", "p99_ns<");
+	for (int i = 0; i < NR_PHASES; ++i) {
+		if (sum[i].count == 0)
+			continue;
+		dprintf(fd, "%-8s %12llu %14llu %10llu %10llu %10llu\n",
+			phase_names[i], sum[i].count, sum[i].total_ns,
+			sum[i].total_ns / sum[i].count,
+			stats_percentile(&sum[i], 50),
+			stats_percentile(&sum[i], 99));
+	}
+#endif
+}
+
+#ifdef DUNE_PHASE_TIMING
+// 新建和复用 vcpu 的时候都需要调用，丢弃上一个线程遗留的时间戳
+void phase_init_vcpu(struct kvm_cpu *vcpu)
+{
+	memset(vcpu->phase_stamp, 0, sizeof(vcpu->phase_stamp));
+	vcpu->phase.guest_offset = arch_guest_counter_offset(vcpu);
+	vcpu->phase.exit_pending = false;
+	vcpu->phase.entry_pending = false;
+}
+
+// begin 在 end 之后说明两个时间戳不属于同一次往返，丢弃
+static void phase_record(struct kvm_cpu *vcpu, enum PHASE phase, u64 begin,
+			 u64 end)
+{
+	if (end < begin)
+		return;
+	u64 ns = ((unsigned __int128)(end - begin) * vcpu->vm->phase_scale) >>
+		 32;
+	struct syscall_stat *stat = &vcpu->phase.phases[phase];
+	stat->count++;
+	stats_record(stat, ns);
+}
+
+// 转换为 host 的 counter
+static inline u64 guest_stamp(const struct kvm_cpu *vcpu,
+			      enum PHASE_GUEST_STAMP idx)
+{
+	return vcpu->phase_stamp[idx] - vcpu->phase.guest_offset;
+}
+
+void phase_run_enter(struct kvm_cpu *vcpu)
+{
+	struct vcpu_phase *p = &vcpu->phase;
+	u64 now = arch_read_counter();
+
+	p->host[PHASE_H_RUN_ENTER] = now;
+	if (!p->exit_pending)
+		return;
+
+	if (p->host[PHASE_H_SYSCALL_BEGIN]) {
+		phase_record(vcpu, PHASE_DISPATCH, p->host[PHASE_H_RUN_EXIT],
+			     p->host[PHASE_H_SYSCALL_BEGIN]);
+		phase_record(vcpu, PHASE_SYSCALL, p->host[PHASE_H_SYSCALL_BEGIN],
+			     p->host[PHASE_H_SYSCALL_END]);
+		phase_record(vcpu, PHASE_RETURN, p->host[PHASE_H_SYSCALL_END],
+			     now);
+	} else {
+		phase_record(vcpu, PHASE_DISPATCH, p->host[PHASE_H_RUN_EXIT],
+			     now);
+	}
+	p->exit_pending = false;
+	p->entry_pending = true;
+}
+
+void phase_run_exit(struct kvm_cpu *vcpu, bool hypercall)
+{
+	struct vcpu_phase *p = &vcpu->phase;
+	u64 now = arch_read_counter();
+
+#ifdef ARCH_HAS_PHASE_GUEST_STAMPS
+	// guest 还没有执行到 G_RESUME 的时候，时间戳是上一次的，早于 H_RUN_ENTER
+	if (p->entry_pending) {
+		u64 resume = guest_stamp(vcpu, PHASE_G_RESUME);
+		if (resume <= now)
+			phase_record(vcpu, PHASE_ENTRY,
+				     p->host[PHASE_H_RUN_ENTER], resume);
+	}
+	// 用过之后清零，不是从 syscall vector 发出的 HYPERCALL 不会被统计
+	if (hypercall && vcpu->phase_stamp[PHASE_G_HYPERCALL]) {
+		phase_record(vcpu, PHASE_VECTOR,
+			     guest_stamp(vcpu, PHASE_G_VECTOR),
+			     guest_stamp(vcpu, PHASE_G_HYPERCALL));
+		phase_record(vcpu, PHASE_EXIT,
+			     guest_stamp(vcpu, PHASE_G_HYPERCALL), now);
+		vcpu->phase_stamp[PHASE_G_HYPERCALL] = 0;
+	}
+#endif
+	p->entry_pending = false;
+	if (!hypercall)
+		return;
+
+	p->host[PHASE_H_RUN_EXIT] = now;
+	p->host[PHASE_H_SYSCALL_BEGIN] = 0;
+	p->host[PHASE_H_SYSCALL_END] = 0;
+	p->exit_pending = true;
+}
+#endif
+
+int dune_stats_phase(struct dune_syscall_stat stats[DUNE_PHASE_NR])
+{
+	long ret = syscall(DUNE_SYS_STATS_PHASE, stats);
+	return ret == -1 ? -errno : ret;
+}
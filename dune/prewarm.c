@@ -0,0 +1,127 @@
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "interface.h"
+#include "dune.h"
+
+// DUNE_VCPU_POOL=N 的时候，后台的 prewarm 线程保持 N 个空闲并且已经初始化好的
+// vcpu (KVM_CREATE_VCPU, mmap kvm_run, ebase, CSR, FPU), 这样 clone 的时候
+// init_child_thread_info 只需要 KVM_SET_REGS 。被释放的 vcpu 同样由 prewarm
+// 线程重新初始化。
+//
+// 正在初始化的 vcpu 的 slot 由 prewarm 线程拥有，kvm_alloc_vcpu 不会选中，
+// 初始化完成之后设置 prewarmed, 然后才释放。
+//
+// prewarm 线程在第一次进入 host_loop 的时候启动，此时 arch 的初始化 (例如
+// loongarch 的 CSR 模板) 已经完成。fork 出来的 vm 有自己的 prewarm 线程。
+
+#define PREWARM_DEFAULT_TARGET 0
+
+void prewarm_init(struct kvm_vm *vm)
+{
+	struct vcpu_prewarm *p = &vm->prewarm;
+
+	p->target = PREWARM_DEFAULT_TARGET;
+	p->warm = 0;
+	p->started = false;
+	p->model = NULL;
+	p->kicks = 0;
+
+	const char *env = getenv("DUNE_VCPU_POOL");
+	if (env != NULL) {
+		int target = atoi(env);
+		// 至少留下一个给当前的线程
+		if (target < 0)
+			target = 0;
+		if (target > vm->max_vcpus - 1)
+			target = vm->max_vcpus - 1;
+		p->target = target;
+	}
+
+	if (pthread_mutex_init(&p->mutex, NULL) ||
+	    pthread_cond_init(&p->cond, NULL))
+		die("prewarm_init");
+}
+
+// 选择一个需要初始化的 slot, 优先重新初始化已经创建的 vcpu, 没有的时候返回 -1 。
+// prewarm 线程不创建新的 shard, 只使用已有 shard 中的空位
+static int prewarm_reserve(struct kvm_vm *vm, struct kvm_shard **shard)
+{
+	if (__atomic_load_n(&vm->prewarm.warm, __ATOMIC_RELAXED) >=
+	    vm->prewarm.target)
+		return -1;
+
+	int nr_shards = __atomic_load_n(&vm->nr_shards, __ATOMIC_ACQUIRE);
+	for (int i = 0; i < nr_shards; ++i) {
+		int slot = vcpu_slot_claim(vm->shards[i], VCPU_SLOT_COLD);
+		if (slot != -1) {
+			*shard = vm->shards[i];
+			return slot;
+		}
+	}
+
+	*shard = kvm_least_loaded_shard(vm);
+	if (*shard == NULL)
+		return -1;
+	return vcpu_slot_claim(*shard, VCPU_SLOT_EMPTY);
+}
+
+static void prewarm_publish(struct kvm_cpu *vcpu)
+{
+	vcpu->prewarmed = true;
+	vcpu_slot_release(vcpu->shard, vcpu->cpu_id, true);
+}
+
+static void *prewarm_loop(void *arg)
+{
+	struct kvm_vm *vm = arg;
+	struct vcpu_prewarm *p = &vm->prewarm;
+
+	for (;;) {
+		pthread_mutex_lock(&p->mutex);
+		u64 seen = p->kicks;
+		pthread_mutex_unlock(&p->mutex);
+
+		struct kvm_shard *shard;
+		int slot;
+		while ((slot = prewarm_reserve(vm, &shard)) != -1) {
+			struct kvm_cpu *vcpu = shard->vcpu_pool[slot].vcpu;
+			if (vcpu == NULL)
+				vcpu = kvm_create_vcpu(shard, slot);
+			if (vcpu == NULL)
+				die("prewarm : unable to create vcpu");
+			arch_prewarm_vcpu(vcpu, p->model);
+			prewarm_publish(vcpu);
+		}
+
+		pthread_mutex_lock(&p->mutex);
+		while (p->kicks == seen)
+			pthread_cond_wait(&p->cond, &p->mutex);
+		pthread_mutex_unlock(&p->mutex);
+	}
+	return NULL;
+}
+
+// vcpu 被取走或者释放的时候调用，第一次由取走 vcpu 的线程调用的时候启动 prewarm
+// 线程，model 是它的 vcpu 。释放的时候 vcpu 已经不属于调用者，model 为 NULL
+void prewarm_kick(struct kvm_vm *vm, struct kvm_cpu *model)
+{
+	struct vcpu_prewarm *p = &vm->prewarm;
+	if (p->target == 0)
+		return;
+
+	pthread_mutex_lock(&p->mutex);
+	if (!p->started && model != NULL) {
+		p->started = true;
+		p->model = model;
+		int err = pthread_create(&p->thread, NULL, prewarm_loop, vm);
+		if (err) {
+			pr_warn("DUNE_VCPU_POOL : unable to create thread (%d)",
+				err);
+			p->target = 0;
+		}
+	}
+	p->kicks++;
+	pthread_cond_signal(&p->cond);
+	pthread_mutex_unlock(&p->mutex);
+}
@@ -0,0 +1,106 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <sched.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "interface.h"
+#include "dune.h"
+
+// sidecar 是一个和 vcpu 绑定的 host 线程，在 sidecar_mailbox 上自旋等待 guest
+// 的 syscall 。guest 在 syscall vector 中保存参数之后写入 SIDECAR_REQUEST,
+// 然后同样自旋，直到 sidecar 写入 SIDECAR_DONE 或者 SIDECAR_BOUNCE 。
+// 整个过程中 vcpu 不会退出 KVM_RUN, 代价是 sidecar 独占一个 host cpu 。
+//
+// sidecar 和 vcpu 不是同一个 host 线程，所以只执行 SYSCALL_PASSTHROUGH,
+// 其余的 syscall 返回 SIDECAR_BOUNCE, guest 重新通过 HYPERCALL 交给 host_loop 。
+
+static inline void cpu_relax()
+{
+	__asm__ __volatile__("" ::: "memory");
+}
+
+#ifdef ARCH_HAS_SYSCALL_SIDECAR
+static void *sidecar_loop(void *arg)
+{
+	struct kvm_cpu *vcpu = arg;
+	u64 *mailbox = &vcpu->sidecar_mailbox;
+
+	for (;;) {
+		u64 state = __atomic_load_n(mailbox, __ATOMIC_ACQUIRE);
+		if (state == SIDECAR_OFF)
+			break;
+
+		if (state != SIDECAR_REQUEST) {
+			cpu_relax();
+			continue;
+		}
+
+		enum SYSCALL_KIND kind = syscall_kind(arch_get_sysno(vcpu));
+		if (kind != SYSCALL_PASSTHROUGH && kind != SYSCALL_FUTEX) {
+			__atomic_store_n(mailbox, SIDECAR_BOUNCE,
+					 __ATOMIC_RELEASE);
+			continue;
+		}
+
+		u64 *waiters = NULL;
+		if (kind == SYSCALL_FUTEX)
+			waiters = futex_wait_begin(vcpu);
+		arch_do_syscall(vcpu, false);
+		futex_wait_end(vcpu, waiters);
+		__atomic_store_n(mailbox, SIDECAR_DONE, __ATOMIC_RELEASE);
+	}
+	return NULL;
+}
+#endif
+
+// 在 vcpu 对应的 host 线程中执行，此时 guest 停在 HYPERCALL 上
+int sidecar_start(struct kvm_cpu *vcpu, int host_cpu)
+{
+#ifndef ARCH_HAS_SYSCALL_SIDECAR
+	return -ENOSYS;
+#else
+	if (vcpu->sidecar_mailbox != SIDECAR_OFF)
+		return -EBUSY;
+
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	if (host_cpu >= 0) {
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(host_cpu, &set);
+		if (pthread_attr_setaffinity_np(&attr, sizeof(set), &set)) {
+			pthread_attr_destroy(&attr);
+			return -EINVAL;
+		}
+	}
+
+	// sidecar 创建之后立刻开始读取 mailbox, 所以需要提前设置
+	vcpu->sidecar_mailbox = SIDECAR_IDLE;
+	int err = pthread_create(&vcpu->sidecar_thread, &attr, sidecar_loop,
+				 vcpu);
+	pthread_attr_destroy(&attr);
+	if (err) {
+		vcpu->sidecar_mailbox = SIDECAR_OFF;
+		return -err;
+	}
+	return 0;
+#endif
+}
+
+// vcpu 被释放之前调用，vcpu 会被其他线程复用，所以需要等待 sidecar 退出
+void sidecar_stop(struct kvm_cpu *vcpu)
+{
+	if (vcpu->sidecar_mailbox == SIDECAR_OFF)
+		return;
+
+	__atomic_store_n(&vcpu->sidecar_mailbox, SIDECAR_OFF, __ATOMIC_RELEASE);
+	if (pthread_join(vcpu->sidecar_thread, NULL))
+		die("sidecar join");
+}
+
+int dune_sidecar_enable(int host_cpu)
+{
+	long ret = syscall(DUNE_SYS_SIDECAR, host_cpu);
+	return ret == -1 ? -errno : ret;
+}
@@ -0,0 +1,234 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "interface.h"
+#include "dune.h"
+
+// host_loop 中的统计 : 每一个 vcpu 记录 syscall 的次数，host 中处理 syscall
+// 的时间 (从 KVM_RUN 返回到下一次 KVM_RUN) 的 log2 直方图和 KVM_RUN 的退出原因。
+// vcpu 只修改自己的统计，查询的时候遍历所有的 vcpu 合并，所以不需要任何同步,
+// 合并的结果可能和正在运行的 vcpu 有细微的出入。
+//
+// 在 guest 中直接返回的 syscall (fastpath) 和 sidecar 执行的 syscall 不经过
+// host_loop, 所以不在统计中。
+
+static const char *exit_reason_name(int reason)
+{
+	switch (reason) {
+	case KVM_EXIT_HYPERCALL:
+		return "hypercall";
+	case KVM_EXIT_INTR:
+		return "intr";
+	case KVM_EXIT_MMIO:
+		return "mmio";
+	case KVM_EXIT_INTERNAL_ERROR:
+		return "internal_error";
+	default:
+		return "other";
+	}
+}
+
+void stats_init(struct kvm_vm *vm)
+{
+	vm->stats_fd = -1;
+
+	const char *path = getenv("DUNE_STATS");
+	if (path == NULL || *path == '\0')
+		return;
+
+	if (strcmp(path, "1") == 0 || strcmp(path, "stderr") == 0) {
+		vm->stats_fd = STDERR_FILENO;
+		return;
+	}
+
+	// fork 出来的每一个进程都有自己的 vm, 使用 pid 区分各自的输出
+	char name[256];
+	snprintf(name, sizeof(name), "%s.%d", path, getpid());
+	vm->stats_fd = open(name, O_TRUNC | O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+	if (vm->stats_fd == -1)
+		pr_warn("DUNE_STATS : unable to open %s", name);
+}
+
+u64 stats_now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void stats_exit(struct kvm_cpu *vcpu, u32 reason)
+{
+	if (reason >= STATS_EXIT_REASONS)
+		reason = STATS_EXIT_REASONS - 1;
+	vcpu->stats.exits[reason]++;
+}
+
+static struct syscall_stat *syscall_stat(struct vcpu_stats *stats, u64 sysno)
+{
+	u64 idx = sysno - SYSCALL_BASE;
+	if (idx >= SYSCALL_TABLE_SIZE)
+		return &stats->other;
+	return &stats->syscalls[idx];
+}
+
+u64 stats_syscall_begin(struct kvm_cpu *vcpu, u64 sysno)
+{
+	syscall_stat(&vcpu->stats, sysno)->count++;
+	return stats_now();
+}
+
+void stats_record(struct syscall_stat *stat, u64 ns)
+{
+	int bucket = ns ? 63 - __builtin_clzll(ns) : 0;
+
+	if (bucket >= STATS_BUCKETS)
+		bucket = STATS_BUCKETS - 1;
+	stat->total_ns += ns;
+	stat->hist[bucket]++;
+}
+
+void stats_syscall_end(struct kvm_cpu *vcpu, u64 sysno, u64 ns)
+{
+	stats_record(syscall_stat(&vcpu->stats, sysno), ns);
+}
+
+void stats_merge(struct syscall_stat *sum, const struct syscall_stat *s)
+{
+	sum->count += s->count;
+	sum->total_ns += s->total_ns;
+	for (int i = 0; i < STATS_BUCKETS; ++i)
+		sum->hist[i] += s->hist[i];
+}
+
+// vcpu 只会增加，不会释放，所以遍历的时候不需要持有锁
+static void merge_syscall(struct kvm_vm *vm, u64 sysno,
+			  struct syscall_stat *sum)
+{
+	struct kvm_cpu *vcpu;
+	int iter = 0;
+
+	memset(sum, 0, sizeof(*sum));
+	while ((vcpu = kvm_next_vcpu(vm, &iter)) != NULL)
+		stats_merge(sum, syscall_stat(&vcpu->stats, sysno));
+}
+
+static void merge_exits(struct kvm_vm *vm, u64 exits[STATS_EXIT_REASONS])
+{
+	struct kvm_cpu *vcpu;
+	int iter = 0;
+
+	memset(exits, 0, sizeof(u64) * STATS_EXIT_REASONS);
+	while ((vcpu = kvm_next_vcpu(vm, &iter)) != NULL) {
+		for (int j = 0; j < STATS_EXIT_REASONS; ++j)
+			exits[j] += vcpu->stats.exits[j];
+	}
+}
+
+long stats_query_syscall(struct kvm_vm *vm, u64 sysno, u64 uaddr)
+{
+	BUILD_ASSERT(sizeof(struct dune_syscall_stat) ==
+		     sizeof(struct syscall_stat));
+	BUILD_ASSERT(DUNE_STATS_BUCKETS == STATS_BUCKETS);
+
+	struct dune_syscall_stat *out = (struct dune_syscall_stat *)uaddr;
+	if (out == NULL)
+		return -EFAULT;
+
+	struct syscall_stat sum;
+	merge_syscall(vm, sysno, &sum);
+	memcpy(out, &sum, sizeof(sum));
+	return 0;
+}
+
+long stats_query_exits(struct kvm_vm *vm, u64 uaddr, u64 n)
+{
+	unsigned long long *out = (unsigned long long *)uaddr;
+	if (out == NULL)
+		return -EFAULT;
+
+	u64 exits[STATS_EXIT_REASONS];
+	merge_exits(vm, exits);
+	if (n > STATS_EXIT_REASONS)
+		n = STATS_EXIT_REASONS;
+	for (u64 i = 0; i < n; ++i)
+		out[i] = exits[i];
+	return n;
+}
+
+// 根据直方图估计分位数，返回所在桶的上界
+u64 stats_percentile(const struct syscall_stat *stat, int percent)
+{
+	u64 target = (stat->count * percent + 99) / 100, seen = 0;
+	for (int i = 0; i < STATS_BUCKETS; ++i) {
+		seen += stat->hist[i];
+		if (seen >= target && seen)
+			return 2ULL << i;
+	}
+	return 0;
+}
+
+long stats_dump(struct kvm_vm *vm, int fd)
+{
+	u64 exits[STATS_EXIT_REASONS];
+	merge_exits(vm, exits);
+
+	dprintf(fd, "dune stats pid=%d\n", getpid());
+	dprintf(fd, "%-16s %12s\n", "exit_reason", "count");
+	for (int i = 0; i < STATS_EXIT_REASONS; ++i) {
+		if (exits[i])
+			dprintf(fd, "%-12s %3d %12llu\n", exit_reason_name(i),
+				i, exits[i]);
+	}
+
+	dprintf(fd, "%-8s %12s %14s %10s %10s %10s\n", "sysno", "count",
+		"total_ns", "mean_ns", "p50_ns<", "p99_ns<");
+	for (u64 i = 0; i <= SYSCALL_TABLE_SIZE; ++i) {
+		struct syscall_stat sum;
+		// i == SYSCALL_TABLE_SIZE 的时候合并的是 other
+		u64 sysno = i + SYSCALL_BASE;
+		merge_syscall(vm, sysno, &sum);
+		if (sum.count == 0)
+			continue;
+
+		if (i == SYSCALL_TABLE_SIZE)
+			dprintf(fd, "%-8s ", "other");
+		else
+			dprintf(fd, "%-8llu ", sysno);
+		dprintf(fd, "%12llu %14llu %10llu %10llu %10llu\n", sum.count,
+			sum.total_ns, sum.total_ns / sum.count,
+			stats_percentile(&sum, 50), stats_percentile(&sum, 99));
+	}
+	phase_dump(vm, fd);
+	vcpu_slots_dump(vm, fd);
+	affinity_dump(vm, fd);
+	return 0;
+}
+
+void stats_dump_on_exit(struct kvm_vm *vm)
+{
+	if (vm->stats_fd == -1)
+		return;
+	stats_dump(vm, vm->stats_fd);
+}
+
+int dune_stats_syscall(long sysno, struct dune_syscall_stat *stat)
+{
+	long ret = syscall(DUNE_SYS_STATS_SYSCALL, sysno, stat);
+	return ret == -1 ? -errno : ret;
+}
+
+int dune_stats_exits(unsigned long long *counts, int n)
+{
+	long ret = syscall(DUNE_SYS_STATS_EXITS, counts, n);
+	return ret == -1 ? -errno : ret;
+}
+
+int dune_stats_dump(int fd)
+{
+	long ret = syscall(DUNE_SYS_STATS_DUMP, fd);
+	return ret == -1 ? -errno : ret;
+}
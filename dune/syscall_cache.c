@@ -0,0 +1,241 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/uio.h>
+
+#include "interface.h"
+#include "dune.h"
+
+// host_loop 对 SYSCALL_CACHED 直接返回上一次的结果，省去 host 中的 syscall 。
+// 能够修改这些结果的 syscall 都标记为 SYSCALL_INVALIDATE, 执行完成之后
+// vm 的 gen 加一，所有的缓存项同时失效。填充的时候使用 syscall 之前读取的 gen,
+// 所以和 invalidate 并发的填充不会留下过时的结果。
+//
+// - pid / tid / uid / gid 是线程的属性，缓存在 vcpu 中。glibc 的 setuid 会让
+//   每一个线程都执行一次 setuid, 其中调用者的那一次经过 host_loop, 所以整个
+//   vm 的缓存失效就足够了。
+// - uname 和 rlimit 是进程的属性，缓存在 vm 中。其他进程通过 sethostname
+//   或者 prlimit 修改的时候 host_loop 无法感知，这是唯一的例外。带有 CLONE_VM
+//   但是没有 CLONE_THREAD 的 child 和 parent 共享 vm, 也共享这部分缓存。
+// - getppid 不缓存 : parent 退出之后被 reparent, 结果会在没有任何 syscall 的
+//   情况下改变。sched_getaffinity 同理，cpuset cgroup 可以随时修改它。
+//
+// uname 和 rlimit 的结果写入 guest 提供的地址，命中的时候通过 copy_to_guest
+// 写入，非法的地址和真正的 syscall 一样返回 -EFAULT, 而不是 host 中的 SIGSEGV 。
+//
+// fork 之后 child 使用新的 vm 和 vcpu, clone 得到的 vcpu 在 kvm_alloc_vcpu
+// 中重置，所以 fork / clone 无需额外处理。
+
+static int vcpu_cache_item(u64 sysno)
+{
+	switch (sysno) {
+	case SYS_GETPID:
+		return CACHE_PID;
+	case SYS_GETTID:
+		return CACHE_TID;
+	case SYS_GETUID:
+		return CACHE_UID;
+	case SYS_GETEUID:
+		return CACHE_EUID;
+	case SYS_GETGID:
+		return CACHE_GID;
+	case SYS_GETEGID:
+		return CACHE_EGID;
+	default:
+		return -1;
+	}
+}
+
+void syscall_cache_init(struct kvm_vm *vm)
+{
+	memset(&vm->cache, 0, sizeof(vm->cache));
+	// 缓存项的 gen 初始为 0, 所以 vm 的 gen 从 1 开始
+	vm->cache.gen = 1;
+	if (pthread_spin_init(&vm->cache.lock, PTHREAD_PROCESS_PRIVATE) != 0)
+		die("pthread_spin_init failed\n");
+}
+
+void syscall_cache_reset_vcpu(struct kvm_cpu *vcpu)
+{
+	memset(&vcpu->cache, 0, sizeof(vcpu->cache));
+}
+
+void syscall_cache_invalidate(struct kvm_vm *vm)
+{
+	__atomic_add_fetch(&vm->cache.gen, 1, __ATOMIC_RELEASE);
+	__atomic_add_fetch(&vm->cache.invalidations, 1, __ATOMIC_RELAXED);
+}
+
+static long raw_syscall(struct kvm_cpu *vcpu, u64 sysno)
+{
+	u64 args[6];
+	for (int i = 0; i < 6; ++i)
+		args[i] = arch_get_syscall_arg(vcpu, i);
+	return arch_raw_syscall(sysno, args);
+}
+
+// guest 和 host 的地址相同，process_vm_writev 检查地址，不会触发 SIGSEGV
+static long copy_to_guest(void *dst, const void *src, size_t len)
+{
+	struct iovec local = { (void *)src, len };
+	struct iovec remote = { dst, len };
+	if (process_vm_writev(getpid(), &local, 1, &remote, 1, 0) != len)
+		return -EFAULT;
+	return 0;
+}
+
+static bool cache_lookup_uname(struct vm_syscall_cache *c, u64 gen,
+			       struct utsname *buf)
+{
+	bool hit = false;
+
+	pthread_spin_lock(&c->lock);
+	if (c->uname_gen == gen) {
+		*buf = c->uname;
+		hit = true;
+	}
+	pthread_spin_unlock(&c->lock);
+	return hit;
+}
+
+static void cache_fill_uname(struct vm_syscall_cache *c, u64 gen,
+			     const struct utsname *buf)
+{
+	pthread_spin_lock(&c->lock);
+	memcpy(&c->uname, buf, sizeof(c->uname));
+	c->uname_gen = gen;
+	pthread_spin_unlock(&c->lock);
+}
+
+static bool cache_lookup_rlimit(struct vm_syscall_cache *c, u64 gen,
+				int resource, struct rlimit *old)
+{
+	bool hit = false;
+
+	pthread_spin_lock(&c->lock);
+	if (c->rlimit_gen[resource] == gen) {
+		*old = c->rlimit[resource];
+		hit = true;
+	}
+	pthread_spin_unlock(&c->lock);
+	return hit;
+}
+
+static void cache_fill_rlimit(struct vm_syscall_cache *c, u64 gen,
+			      int resource, const struct rlimit *old)
+{
+	pthread_spin_lock(&c->lock);
+	c->rlimit[resource] = *old;
+	c->rlimit_gen[resource] = gen;
+	pthread_spin_unlock(&c->lock);
+}
+
+// prlimit64(pid, resource, new, old) 和 getrlimit(resource, old) 的公共部分，
+// 只有查询自己并且不修改的时候才可以使用缓存
+static long cached_rlimit(struct kvm_cpu *vcpu, u64 sysno, u64 gen, u64 pid,
+			  u64 resource, u64 new, struct rlimit *old)
+{
+	struct vm_syscall_cache *c = &vcpu->vm->cache;
+
+	if (pid != 0 || new != 0 || resource >= RLIM_NLIMITS) {
+		long ret = raw_syscall(vcpu, sysno);
+		if (new != 0 && ret == 0)
+			syscall_cache_invalidate(vcpu->vm);
+		return ret;
+	}
+
+	struct rlimit tmp;
+	if (cache_lookup_rlimit(c, gen, resource, &tmp)) {
+		__atomic_add_fetch(&c->hits, 1, __ATOMIC_RELAXED);
+	} else {
+		__atomic_add_fetch(&c->misses, 1, __ATOMIC_RELAXED);
+		u64 args[6] = { 0, resource, 0, (u64)&tmp };
+		long ret = arch_raw_syscall(SYS_PRLIMIT64, args);
+		if (ret)
+			return ret;
+		cache_fill_rlimit(c, gen, resource, &tmp);
+	}
+	return old ? copy_to_guest(old, &tmp, sizeof(tmp)) : 0;
+}
+
+// 在 host_loop 中处理 SYSCALL_CACHED, 结果通过 arch_set_syscall_ret 返回给 guest
+void syscall_cache_handle(struct kvm_cpu *vcpu, u64 sysno)
+{
+	struct vm_syscall_cache *c = &vcpu->vm->cache;
+	u64 gen = __atomic_load_n(&c->gen, __ATOMIC_ACQUIRE);
+	int item = vcpu_cache_item(sysno);
+	long ret;
+
+	if (item >= 0) {
+		if (vcpu->cache.gen[item] == gen) {
+			__atomic_add_fetch(&c->hits, 1, __ATOMIC_RELAXED);
+			ret = vcpu->cache.val[item];
+		} else {
+			__atomic_add_fetch(&c->misses, 1, __ATOMIC_RELAXED);
+			ret = raw_syscall(vcpu, sysno);
+			vcpu->cache.val[item] = ret;
+			vcpu->cache.gen[item] = gen;
+		}
+		arch_set_syscall_ret(vcpu, ret);
+		return;
+	}
+
+	switch (sysno) {
+	case SYS_UNAME: {
+		struct utsname buf;
+		if (cache_lookup_uname(c, gen, &buf)) {
+			__atomic_add_fetch(&c->hits, 1, __ATOMIC_RELAXED);
+			ret = 0;
+		} else {
+			__atomic_add_fetch(&c->misses, 1, __ATOMIC_RELAXED);
+			u64 args[6] = { (u64)&buf };
+			ret = arch_raw_syscall(sysno, args);
+			if (ret == 0)
+				cache_fill_uname(c, gen, &buf);
+		}
+		void *uaddr = (void *)arch_get_syscall_arg(vcpu, 0);
+		if (ret == 0)
+			ret = copy_to_guest(uaddr, &buf, sizeof(buf));
+		break;
+	}
+	case SYS_PRLIMIT64:
+		ret = cached_rlimit(vcpu, sysno, gen,
+				    arch_get_syscall_arg(vcpu, 0),
+				    arch_get_syscall_arg(vcpu, 1),
+				    arch_get_syscall_arg(vcpu, 2),
+				    (struct rlimit *)arch_get_syscall_arg(vcpu, 3));
+		break;
+#ifdef SYS_GETRLIMIT
+	case SYS_GETRLIMIT:
+		ret = cached_rlimit(vcpu, sysno, gen, 0,
+				    arch_get_syscall_arg(vcpu, 0), 0,
+				    (struct rlimit *)arch_get_syscall_arg(vcpu, 1));
+		break;
+#endif
+	default:
+		die("unexpected cached syscall %lld", sysno);
+	}
+
+	arch_set_syscall_ret(vcpu, ret);
+}
+
+long syscall_cache_stats(struct kvm_vm *vm, u64 uaddr)
+{
+	struct dune_cache_stats *stats = (struct dune_cache_stats *)uaddr;
+	if (stats == NULL)
+		return -EFAULT;
+
+	stats->hits = __atomic_load_n(&vm->cache.hits, __ATOMIC_RELAXED);
+	stats->misses = __atomic_load_n(&vm->cache.misses, __ATOMIC_RELAXED);
+	stats->invalidations =
+		__atomic_load_n(&vm->cache.invalidations, __ATOMIC_RELAXED);
+	return 0;
+}
+
+int dune_syscall_cache_stats(struct dune_cache_stats *stats)
+{
+	long ret = syscall(DUNE_SYS_CACHE_STATS, stats);
+	return ret == -1 ? -errno : ret;
+}
@@ -0,0 +1,244 @@
+#include <errno.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+#include "interface.h"
+#include "dune.h"
+
+#define _GNU_SOURCE
+#ifndef __USE_GNU
+#define __USE_GNU
+#endif
+#include <pthread.h>
+
+// reference : FlexSC: Flexible System Call Scheduling with Exception-Less System Calls
+//
+// ring 是一个有界的 MPMC 队列 (Vyukov), 每一个 entry 通过 seq 表示状态 :
+// seq == pos            : 空闲，可以被 guest 提交
+// seq == pos + 1        : 已提交，等待 worker 执行
+// seq == pos + SIZE     : 调用者取走结果，进入下一轮
+//
+// guest 和 host 共享整个地址空间，所以 ring 就是普通的进程内存 ，
+// 提交和完成都只是内存操作，只有在 worker 全部睡眠的时候才需要一次 futex wake
+#define SYSRING_SIZE 256
+#define SYSRING_MAX_WORKERS 16
+#define SYSRING_SPIN 10000
+
+struct sysring_entry {
+	u64 seq;
+	int done;
+	struct dune_sysreq req;
+} __attribute__((aligned(64)));
+
+struct sysring {
+	u64 head __attribute__((aligned(64))); // worker 消费
+	u64 tail __attribute__((aligned(64))); // guest 提交
+	int sleepers __attribute__((aligned(64)));
+	int wake_seq;
+	struct sysring_entry entries[SYSRING_SIZE];
+};
+
+static struct sysring *ring;
+static pthread_once_t atfork_once = PTHREAD_ONCE_INIT;
+
+static inline void cpu_relax()
+{
+	__asm__ __volatile__("" ::: "memory");
+}
+
+static void futex(int *uaddr, int op, int val)
+{
+	syscall(SYS_futex, uaddr, op, val, NULL, NULL, 0);
+}
+
+static struct sysring_entry *sysring_pop(struct sysring *r)
+{
+	u64 pos = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+	for (;;) {
+		struct sysring_entry *e = &r->entries[pos % SYSRING_SIZE];
+		u64 seq = __atomic_load_n(&e->seq, __ATOMIC_ACQUIRE);
+		long diff = (long)(seq - (pos + 1));
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&r->head, &pos, pos + 1,
+							true, __ATOMIC_RELAXED,
+							__ATOMIC_RELAXED))
+				return e;
+		} else if (diff < 0) {
+			return NULL;
+		} else {
+			pos = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+		}
+	}
+}
+
+static void sysring_execute(struct sysring_entry *e)
+{
+	struct dune_sysreq *req = &e->req;
+	u64 args[6];
+	for (int i = 0; i < 6; ++i)
+		args[i] = req->args[i];
+
+	// worker 不是提交者的线程，只有和线程无关的 syscall 才可以代为执行
+	switch (syscall_kind(req->sysno)) {
+	case SYSCALL_PASSTHROUGH:
+		req->ret = arch_raw_syscall(req->sysno, args);
+		break;
+	case SYSCALL_FUTEX:
+		req->ret = futex_raw_syscall(args);
+		break;
+	default:
+		req->ret = -EINVAL;
+	}
+
+	__atomic_store_n(&e->done, 1, __ATOMIC_RELEASE);
+}
+
+static void *sysring_worker(void *arg)
+{
+	struct sysring *r = arg;
+	int idle = 0;
+
+	for (;;) {
+		struct sysring_entry *e = sysring_pop(r);
+		if (e) {
+			sysring_execute(e);
+			idle = 0;
+			continue;
+		}
+
+		if (++idle < SYSRING_SPIN) {
+			cpu_relax();
+			continue;
+		}
+
+		// 先声明自己要睡眠，然后再检查一次 ring, 避免和 submit 之间丢失唤醒
+		int seq = __atomic_load_n(&r->wake_seq, __ATOMIC_ACQUIRE);
+		__atomic_add_fetch(&r->sleepers, 1, __ATOMIC_SEQ_CST);
+		// worker 是 host 线程，需要在 futex.c 中计数, 否则 guest 中的
+		// FUTEX_WAKE 可能被省略
+		u64 args[6] = { (u64)&r->wake_seq, FUTEX_WAIT_PRIVATE, seq };
+		if (__atomic_load_n(&r->tail, __ATOMIC_SEQ_CST) ==
+		    __atomic_load_n(&r->head, __ATOMIC_SEQ_CST))
+			futex_raw_syscall(args);
+		__atomic_sub_fetch(&r->sleepers, 1, __ATOMIC_SEQ_CST);
+		idle = 0;
+	}
+	return NULL;
+}
+
+// 在 host 中执行 : 分配 ring 并且创建 worker 线程
+int sysring_start(int nr_workers)
+{
+	if (ring)
+		return -EBUSY;
+
+	if (nr_workers <= 0 || nr_workers > SYSRING_MAX_WORKERS)
+		return -EINVAL;
+
+	int pages = (sizeof(struct sysring) + PAGESIZE - 1) / PAGESIZE;
+	struct sysring *r = mmap(NULL, PAGESIZE * pages, PROT_RW,
+				 MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1,
+				 0);
+	if (r == MAP_FAILED)
+		return -ENOMEM;
+
+	for (u64 i = 0; i < SYSRING_SIZE; ++i)
+		r->entries[i].seq = i;
+
+	for (int i = 0; i < nr_workers; ++i) {
+		pthread_t tid;
+		int err = pthread_create(&tid, NULL, sysring_worker, r);
+		if (err) {
+			if (i == 0) {
+				munmap(r, PAGESIZE * pages);
+				return -err;
+			}
+			pr_warn("sysring: only %d of %d workers created", i,
+				nr_workers);
+			break;
+		}
+		pthread_detach(tid);
+	}
+
+	__atomic_store_n(&ring, r, __ATOMIC_RELEASE);
+	return 0;
+}
+
+// worker 线程不会被 fork 到 child 中，child 中的 ring 没有消费者
+static void sysring_atfork_child()
+{
+	ring = NULL;
+}
+
+static void sysring_register_atfork()
+{
+	pthread_atfork(NULL, NULL, sysring_atfork_child);
+}
+
+int dune_sysring_init(int nr_workers)
+{
+	pthread_once(&atfork_once, sysring_register_atfork);
+
+	// 在 dune 中，ring 和 worker 由 host_loop 创建，worker 在 host 中执行
+	// syscall ; 不在 dune 中的时候内核返回 ENOSYS, 直接创建普通的线程即可
+	long ret = syscall(DUNE_SYS_SYSRING_INIT, nr_workers);
+	if (ret == -1 && errno == ENOSYS)
+		return sysring_start(nr_workers);
+
+	return ret == -1 ? -errno : ret;
+}
+
+long dune_syscall_submit(const struct dune_sysreq *req)
+{
+	struct sysring *r = __atomic_load_n(&ring, __ATOMIC_ACQUIRE);
+	if (!r)
+		return -ENOSYS;
+
+	u64 pos = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+	struct sysring_entry *e;
+	for (;;) {
+		e = &r->entries[pos % SYSRING_SIZE];
+		u64 seq = __atomic_load_n(&e->seq, __ATOMIC_ACQUIRE);
+		long diff = (long)(seq - pos);
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&r->tail, &pos, pos + 1,
+							true, __ATOMIC_SEQ_CST,
+							__ATOMIC_RELAXED))
+				break;
+		} else if (diff < 0) {
+			return -EAGAIN;
+		} else {
+			pos = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+		}
+	}
+
+	e->req = *req;
+	e->done = 0;
+	__atomic_store_n(&e->seq, pos + 1, __ATOMIC_RELEASE);
+
+	// 只有在 worker 睡眠的时候才需要 futex, 这是唯一可能导致 vm exit 的地方
+	if (__atomic_load_n(&r->sleepers, __ATOMIC_SEQ_CST)) {
+		__atomic_add_fetch(&r->wake_seq, 1, __ATOMIC_RELEASE);
+		futex(&r->wake_seq, FUTEX_WAKE_PRIVATE, 1);
+	}
+
+	return pos;
+}
+
+long dune_syscall_wait(long ticket)
+{
+	struct sysring *r = __atomic_load_n(&ring, __ATOMIC_ACQUIRE);
+	if (!r)
+		return -ENOSYS;
+
+	struct sysring_entry *e = &r->entries[(u64)ticket % SYSRING_SIZE];
+	while (!__atomic_load_n(&e->done, __ATOMIC_ACQUIRE))
+		cpu_relax();
+
+	long ret = e->req.ret;
+	__atomic_store_n(&e->seq, (u64)ticket + SYSRING_SIZE, __ATOMIC_RELEASE);
+	return ret;
+}
@@ -0,0 +1,121 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "interface.h"
+#include "trace.h"
+
+// DUNE_TRACE=<prefix> 打开 syscall trace, 每一个 vcpu 写自己的文件，
+// 只有 vcpu 自己的 host 线程写入，所以不需要任何锁。文件通过 MAP_SHARED 映射,
+// 进程崩溃之后内容仍然保留，使用 tools/dune-trace 解析。
+// DUNE_TRACE_RECORDS 设置每一个文件中 record 的个数，默认 65536 。
+
+#define TRACE_DEFAULT_RECORDS 65536
+
+void trace_init(struct kvm_vm *vm)
+{
+	BUILD_ASSERT(sizeof(struct trace_header) <= TRACE_RECORDS_OFFSET);
+
+	vm->trace_prefix = NULL;
+	vm->trace_capacity = 0;
+
+	const char *prefix = getenv("DUNE_TRACE");
+	if (prefix == NULL || *prefix == '\0')
+		return;
+
+	const char *records = getenv("DUNE_TRACE_RECORDS");
+	long capacity = records ? atol(records) : TRACE_DEFAULT_RECORDS;
+	if (capacity <= 0)
+		capacity = TRACE_DEFAULT_RECORDS;
+
+	vm->trace_prefix = strdup(prefix);
+	vm->trace_capacity = capacity;
+}
+
+static inline struct trace_record *trace_records(struct trace_header *header)
+{
+	return (struct trace_record *)((char *)header + TRACE_RECORDS_OFFSET);
+}
+
+// 在 kvm_alloc_vcpu 中创建新的 vcpu 的时候调用，复用的 vcpu 继续使用原来的文件
+void trace_open(struct kvm_cpu *vcpu)
+{
+	struct kvm_vm *vm = vcpu->vm;
+	if (vm->trace_prefix == NULL)
+		return;
+
+	char name[256];
+	snprintf(name, sizeof(name), "%s.%d.%d", vm->trace_prefix, getpid(),
+		 vcpu_global_id(vcpu));
+
+	u64 size = TRACE_RECORDS_OFFSET +
+		   (u64)vm->trace_capacity * sizeof(struct trace_record);
+	int fd = open(name, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd == -1) {
+		pr_warn("DUNE_TRACE : unable to open %s", name);
+		return;
+	}
+
+	if (ftruncate(fd, size)) {
+		pr_warn("DUNE_TRACE : unable to truncate %s", name);
+		close(fd);
+		return;
+	}
+
+	struct trace_header *header =
+		mmap(NULL, size, PROT_RW, MAP_SHARED, fd, 0);
+	close(fd);
+	if (header == MAP_FAILED) {
+		pr_warn("DUNE_TRACE : unable to mmap %s", name);
+		return;
+	}
+
+	header->magic = TRACE_MAGIC;
+	header->version = TRACE_VERSION;
+	header->arch = ARCH == MIPS_ARCH ? TRACE_ARCH_MIPS : TRACE_ARCH_LOONGARCH;
+	header->record_size = sizeof(struct trace_record);
+	header->capacity = vm->trace_capacity;
+	header->pid = getpid();
+	header->cpu_id = vcpu_global_id(vcpu);
+	header->head = 0;
+
+	vcpu->trace = header;
+	vcpu->trace_pending = NULL;
+}
+
+void trace_syscall_begin(struct kvm_cpu *vcpu, u64 sysno, u64 ts)
+{
+	struct trace_header *header = vcpu->trace;
+	if (header == NULL)
+		return;
+
+	u64 head = header->head;
+	struct trace_record *rec = &trace_records(header)[head % header->capacity];
+
+	rec->ts_ns = ts;
+	rec->cpu_id = vcpu_global_id(vcpu);
+	rec->flags = 0;
+	rec->sysno = sysno;
+	memcpy(rec->args, vcpu->syscall_parameter, sizeof(rec->args));
+	rec->ret = 0;
+	rec->era = vcpu->syscall_era;
+	rec->dur_ns = 0;
+
+	vcpu->trace_pending = rec;
+	__atomic_store_n(&header->head, head + 1, __ATOMIC_RELEASE);
+}
+
+void trace_syscall_end(struct kvm_cpu *vcpu, u64 ns)
+{
+	struct trace_record *rec = vcpu->trace_pending;
+	if (rec == NULL)
+		return;
+
+	rec->ret = arch_get_syscall_ret(vcpu);
+	rec->dur_ns = ns;
+	__atomic_store_n(&rec->flags, TRACE_DONE, __ATOMIC_RELEASE);
+	vcpu->trace_pending = NULL;
+}
@@ -0,0 +1,48 @@
+#ifndef TRACE_H_R8WQ2KDM
+#define TRACE_H_R8WQ2KDM
+#include <stdint.h>
+
+// DUNE_TRACE 的文件格式，libdune 和 tools/dune-trace 共用
+//
+// 每一个 vcpu 对应一个文件 <prefix>.<pid>.<cpu_id> (cpu_id 为
+// shard->index * KVM_MAX_VCPUS + vcpu->cpu_id), 开头是 trace_header,
+// 之后是 capacity 个 trace_record 组成的环。head 是写入过的 record 总数,
+// 第 i 个 record 位于 records[i % capacity], 所以文件中保留的是最后
+// capacity 个 syscall 。
+
+#define TRACE_MAGIC 0x45435254454e5544ULL /* "DUNETRCE" */
+#define TRACE_VERSION 1
+
+// record 从 header 之后的第一个 cache line 开始
+#define TRACE_RECORDS_OFFSET 64
+
+#define TRACE_ARCH_MIPS 1
+#define TRACE_ARCH_LOONGARCH 2
+
+// record 在 syscall 开始的时候写入，syscall 返回之后设置 ret 和 TRACE_DONE,
+// exit 之类不会返回的 syscall 没有 TRACE_DONE
+#define TRACE_DONE 0x1
+
+struct trace_header {
+	uint64_t magic;
+	uint32_t version;
+	uint32_t arch;
+	uint32_t record_size;
+	uint32_t capacity;
+	uint32_t pid;
+	uint32_t cpu_id;
+	uint64_t head;
+};
+
+struct trace_record {
+	uint64_t ts_ns; // CLOCK_MONOTONIC
+	uint32_t cpu_id;
+	uint32_t flags;
+	uint64_t sysno;
+	uint64_t args[8]; // syscall_parameter, 布局和架构相关
+	int64_t ret;
+	uint64_t era; // syscall 指令的地址
+	uint64_t dur_ns; // host 中处理的时间
+};
+
+#endif /* end of include guard: TRACE_H_R8WQ2KDM */
@@ -0,0 +1,410 @@
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+#include "interface.h"
+#include "dune.h"
+
+#define _GNU_SOURCE
+#ifndef __USE_GNU
+#define __USE_GNU
+#endif
+#include <pthread.h>
+
+// reference : Shinjuku: Preemptive Scheduling for μsecond-scale Tail Latency
+//
+// M:N 的用户线程 : nr_workers 个 worker 线程各自占用一个 vcpu, 从同一个 FIFO
+// 队列中取出 uthread 执行。uthread 让出 cpu 的时候通过 uthread_switch 回到 worker
+// 的调度循环，由调度循环把它放回队列或者释放，所以现场保存完成之前它不会被其他
+// worker 取走。切换只是 guest 中的内存操作，不会导致 vm exit 。
+//
+// slice_us 不为 0 的时候 worker 打开 guest 的 stable timer, 时钟中断的 vector
+// 在 preempt_off 为 0 的时候把 ERA 换成 uthread_preempt_entry, 它在 uthread 的
+// 栈上保存完整的现场之后调用 uthread_preempted 。运行时自己的代码和调度循环
+// 总是在 preempt_off 不为 0 的时候执行。
+
+#define UTHREAD_MAX_WORKERS 64
+#define UTHREAD_STACK_SIZE (256 << 10)
+#define UTHREAD_SPIN 10000
+
+enum UTHREAD_REASON {
+	UTHREAD_YIELD,
+	UTHREAD_EXIT,
+};
+
+struct uthread {
+	u64 sp; // uthread_switch 保存的栈顶
+	u64 preempt_off; // 切换出去的时候的 preempt_off
+	void (*fn)(void *);
+	void *arg;
+	void *stack;
+	struct uthread *next;
+};
+
+static struct {
+	int lock __attribute__((aligned(64)));
+	struct uthread *head;
+	struct uthread *tail;
+	int live __attribute__((aligned(64))); // 还没有结束的 uthread
+	int sleepers __attribute__((aligned(64)));
+	int wake_seq;
+	int stopping;
+	int nr_workers;
+	u64 slice_ticks;
+	pthread_t threads[UTHREAD_MAX_WORKERS];
+	struct uthread_cpu cpus[UTHREAD_MAX_WORKERS];
+} rt;
+
+#ifdef ARCH_HAS_UTHREAD
+
+static inline void cpu_relax()
+{
+	__asm__ __volatile__("" ::: "memory");
+}
+
+static void futex(int *uaddr, int op, int val)
+{
+	syscall(SYS_futex, uaddr, op, val, NULL, NULL, 0);
+}
+
+static void rq_lock(void)
+{
+	while (__atomic_exchange_n(&rt.lock, 1, __ATOMIC_ACQUIRE))
+		while (__atomic_load_n(&rt.lock, __ATOMIC_RELAXED))
+			cpu_relax();
+}
+
+static void rq_unlock(void)
+{
+	__atomic_store_n(&rt.lock, 0, __ATOMIC_RELEASE);
+}
+
+static bool rq_empty(void)
+{
+	return __atomic_load_n(&rt.head, __ATOMIC_RELAXED) == NULL;
+}
+
+static void rq_push(struct uthread *t)
+{
+	t->next = NULL;
+	rq_lock();
+	if (rt.tail != NULL)
+		rt.tail->next = t;
+	else
+		__atomic_store_n(&rt.head, t, __ATOMIC_RELAXED);
+	rt.tail = t;
+	rq_unlock();
+
+	// 和 rq_pop_wait 中先增加 sleepers 再检查队列配对
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&rt.sleepers, __ATOMIC_RELAXED)) {
+		__atomic_fetch_add(&rt.wake_seq, 1, __ATOMIC_SEQ_CST);
+		futex(&rt.wake_seq, FUTEX_WAKE_PRIVATE, 1);
+	}
+}
+
+static struct uthread *rq_pop(void)
+{
+	if (rq_empty())
+		return NULL;
+
+	rq_lock();
+	struct uthread *t = rt.head;
+	if (t != NULL) {
+		__atomic_store_n(&rt.head, t->next, __ATOMIC_RELAXED);
+		if (t->next == NULL)
+			rt.tail = NULL;
+	}
+	rq_unlock();
+	return t;
+}
+
+// 队列为空的时候先自旋，然后在 wake_seq 上睡眠，stopping 之后返回 NULL
+static struct uthread *rq_pop_wait(void)
+{
+	for (;;) {
+		for (int i = 0; i < UTHREAD_SPIN; ++i) {
+			struct uthread *t = rq_pop();
+			if (t != NULL)
+				return t;
+			if (__atomic_load_n(&rt.stopping, __ATOMIC_ACQUIRE))
+				return NULL;
+			cpu_relax();
+		}
+
+		int seq = __atomic_load_n(&rt.wake_seq, __ATOMIC_SEQ_CST);
+		__atomic_fetch_add(&rt.sleepers, 1, __ATOMIC_SEQ_CST);
+		if (rq_empty() && !__atomic_load_n(&rt.stopping, __ATOMIC_SEQ_CST))
+			futex(&rt.wake_seq, FUTEX_WAIT_PRIVATE, seq);
+		__atomic_fetch_sub(&rt.sleepers, 1, __ATOMIC_SEQ_CST);
+	}
+}
+
+static void uthread_free(struct uthread *t)
+{
+	munmap(t->stack, UTHREAD_STACK_SIZE);
+	free(t);
+	if (__atomic_sub_fetch(&rt.live, 1, __ATOMIC_SEQ_CST) == 0)
+		futex(&rt.live, FUTEX_WAKE_PRIVATE, INT_MAX);
+}
+
+// preempt_off 不为 0 的时候调用，回到当前 worker 的调度循环
+static void uthread_block(enum UTHREAD_REASON reason)
+{
+	struct uthread_cpu *c = arch_uthread_cpu();
+	struct uthread *self = c->current;
+
+	self->preempt_off = c->preempt_off;
+	c->reason = reason;
+	c->preempt_off = 1;
+	uthread_switch(&self->sp, c->sched_sp);
+
+	// 重新被调度的时候可能已经在另一个 vcpu 上
+	c = arch_uthread_cpu();
+	c->preempt_off = self->preempt_off;
+}
+
+// 新的 uthread 第一次被调度的时候从这里开始，不会返回
+static void uthread_main(void)
+{
+	struct uthread_cpu *c = arch_uthread_cpu();
+	struct uthread *self = c->current;
+
+	// 调度循环中 preempt_off 为 1
+	dune_uthread_preempt_enable();
+	self->fn(self->arg);
+	dune_uthread_exit();
+}
+
+// uthread_preempt_entry 保存好现场之后调用，此时 preempt_off 为 1
+void uthread_preempted(void)
+{
+	struct uthread_cpu *c = arch_uthread_cpu();
+	c->need_resched = 0;
+	if (rq_empty())
+		return;
+	c->preemptions++;
+	uthread_block(UTHREAD_YIELD);
+}
+
+static void *uthread_worker(void *arg)
+{
+	struct uthread_cpu *c = arg;
+
+	c->preempt_off = 1;
+	c->resched_entry = (u64)uthread_preempt_entry;
+	arch_set_uthread_cpu(c);
+	if (rt.slice_ticks)
+		arch_uthread_timer_start(rt.slice_ticks);
+
+	struct uthread *t;
+	while ((t = rq_pop_wait()) != NULL) {
+		c->current = t;
+		c->need_resched = 0;
+		c->switches++;
+		uthread_switch(&c->sched_sp, t->sp);
+
+		// t 的现场已经保存好，可以交给其他的 worker
+		c->current = NULL;
+		if (c->reason == UTHREAD_EXIT)
+			uthread_free(t);
+		else
+			rq_push(t);
+	}
+
+	// vcpu 之后可能被其他线程复用
+	if (rt.slice_ticks)
+		arch_uthread_timer_stop();
+	arch_set_uthread_cpu(NULL);
+	return NULL;
+}
+
+static void uthread_stop_workers(int n)
+{
+	__atomic_store_n(&rt.stopping, 1, __ATOMIC_SEQ_CST);
+	__atomic_fetch_add(&rt.wake_seq, 1, __ATOMIC_SEQ_CST);
+	futex(&rt.wake_seq, FUTEX_WAKE_PRIVATE, INT_MAX);
+	for (int i = 0; i < n; ++i)
+		pthread_join(rt.threads[i], NULL);
+	rt.nr_workers = 0;
+}
+
+int dune_uthread_init(int nr_workers, unsigned long slice_us)
+{
+	if (nr_workers < 1 || nr_workers > UTHREAD_MAX_WORKERS)
+		return -EINVAL;
+	if (rt.nr_workers != 0)
+		return -EBUSY;
+	// worker 中不能再创建 worker
+	if (arch_uthread_cpu() != NULL)
+		return -EDEADLK;
+
+	u64 ticks = 0;
+	if (slice_us != 0) {
+		u64 freq = arch_counter_freq();
+		if (freq == 0)
+			return -ENODEV;
+		ticks = freq / 1000000 * slice_us;
+		// TCFG 的 InitVal 按照 4 对齐
+		if (ticks < 4)
+			ticks = 4;
+	}
+
+	memset(rt.cpus, 0, sizeof(rt.cpus));
+	rt.head = NULL;
+	rt.tail = NULL;
+	rt.live = 0;
+	rt.stopping = 0;
+	rt.slice_ticks = ticks;
+	rt.nr_workers = nr_workers;
+
+	for (int i = 0; i < nr_workers; ++i) {
+		int err = pthread_create(&rt.threads[i], NULL, uthread_worker,
+					 &rt.cpus[i]);
+		if (err) {
+			uthread_stop_workers(i);
+			return -err;
+		}
+	}
+	return 0;
+}
+
+int dune_uthread_spawn(void (*fn)(void *), void *arg)
+{
+	if (rt.nr_workers == 0)
+		return -EINVAL;
+
+	// malloc 的锁不能在被抢占的时候持有
+	dune_uthread_preempt_disable();
+	struct uthread *t = malloc(sizeof(struct uthread));
+	void *stack = mmap(NULL, UTHREAD_STACK_SIZE, PROT_RW,
+			   MAP_ANON_NORESERVE, -1, 0);
+	if (t == NULL || stack == MAP_FAILED) {
+		free(t);
+		if (stack != MAP_FAILED)
+			munmap(stack, UTHREAD_STACK_SIZE);
+		dune_uthread_preempt_enable();
+		return -ENOMEM;
+	}
+	// 栈溢出的时候访问 guard page, KVM_RUN 失败
+	mprotect(stack, PAGESIZE, PROT_NONE);
+
+	t->fn = fn;
+	t->arg = arg;
+	t->stack = stack;
+	t->preempt_off = 0;
+	t->sp = arch_uthread_init_stack((char *)stack + UTHREAD_STACK_SIZE,
+					uthread_main);
+	__atomic_fetch_add(&rt.live, 1, __ATOMIC_SEQ_CST);
+	rq_push(t);
+	dune_uthread_preempt_enable();
+	return 0;
+}
+
+void dune_uthread_yield(void)
+{
+	dune_uthread_preempt_disable();
+	struct uthread_cpu *c = arch_uthread_cpu();
+	if (c != NULL && c->current != NULL) {
+		c->need_resched = 0;
+		if (!rq_empty())
+			uthread_block(UTHREAD_YIELD);
+	}
+	dune_uthread_preempt_enable();
+}
+
+void dune_uthread_exit(void)
+{
+	dune_uthread_preempt_disable();
+	struct uthread_cpu *c = arch_uthread_cpu();
+	if (c == NULL || c->current == NULL)
+		die("dune_uthread_exit : not in a uthread");
+	uthread_block(UTHREAD_EXIT);
+	die("dune_uthread_exit : exited uthread is scheduled");
+}
+
+// 关中断之后修改，避免读取 vcpu 和修改之间被抢占到另一个 vcpu 上
+void dune_uthread_preempt_disable(void)
+{
+	u64 flags = arch_irq_save();
+	struct uthread_cpu *c = arch_uthread_cpu();
+	if (c != NULL)
+		c->preempt_off++;
+	arch_irq_restore(flags);
+}
+
+void dune_uthread_preempt_enable(void)
+{
+	u64 flags = arch_irq_save();
+	struct uthread_cpu *c = arch_uthread_cpu();
+	bool resched = c != NULL && --c->preempt_off == 0 && c->need_resched;
+	arch_irq_restore(flags);
+	if (resched)
+		dune_uthread_yield();
+}
+
+int dune_uthread_wait(void)
+{
+	if (rt.nr_workers == 0)
+		return -EINVAL;
+	if (arch_uthread_cpu() != NULL)
+		return -EDEADLK;
+
+	int live;
+	while ((live = __atomic_load_n(&rt.live, __ATOMIC_SEQ_CST)) != 0)
+		futex(&rt.live, FUTEX_WAIT_PRIVATE, live);
+	uthread_stop_workers(rt.nr_workers);
+	return 0;
+}
+
+#else
+
+int dune_uthread_init(int nr_workers, unsigned long slice_us)
+{
+	return -ENOSYS;
+}
+
+int dune_uthread_spawn(void (*fn)(void *), void *arg)
+{
+	return -ENOSYS;
+}
+
+void dune_uthread_yield(void)
+{
+}
+
+void dune_uthread_exit(void)
+{
+	die("dune_uthread_exit : not in a uthread");
+}
+
+void dune_uthread_preempt_disable(void)
+{
+}
+
+void dune_uthread_preempt_enable(void)
+{
+}
+
+int dune_uthread_wait(void)
+{
+	return -ENOSYS;
+}
+
+#endif
+
+int dune_uthread_stats(struct dune_uthread_stats *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+	for (int i = 0; i < UTHREAD_MAX_WORKERS; ++i) {
+		struct uthread_cpu *c = &rt.cpus[i];
+		stats->switches += __atomic_load_n(&c->switches, __ATOMIC_RELAXED);
+		stats->preemptions +=
+			__atomic_load_n(&c->preemptions, __ATOMIC_RELAXED);
+		stats->ticks += __atomic_load_n(&c->ticks, __ATOMIC_RELAXED);
+	}
+	return 0;
+}
@@ -0,0 +1,211 @@
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "interface.h"
+#include "dune.h"
+
+// kvm_shard::vcpu_pool 的 slot 分配器，不持有任何锁。
+//
+// busy 中的一位就是 slot 的所有权 : 通过 CAS 从 0 设置为 1 的线程拥有这个
+// slot, 直到 vcpu_slot_release 把它清零。created 和 warm 只能由 slot 的所有者
+// 修改，其他线程读到的值只用来挑选候选，可能是过时的，所以
+// kvm_alloc_vcpu 拿到 slot 之后还需要检查 vcpu_pool[i].vcpu 是否为 NULL 。
+//
+// 每一个 shard 只使用前 max_vcpus 个 slot 。
+//
+// vcpu_pool[i].vcpu 在设置 created 之前写入，claim 使用 acquire,
+// release 使用 release, 所以拥有 slot 之后看到的 vcpu 总是完整的。
+
+static inline u64 slot_bit(int slot)
+{
+	return 1ULL << (slot % 64);
+}
+
+static inline u64 slot_valid_mask(const struct kvm_shard *shard, int w)
+{
+	int n = shard->vm->max_vcpus - w * 64;
+	if (n <= 0)
+		return 0;
+	return n >= 64 ? ~0ULL : (1ULL << n) - 1;
+}
+
+static inline u64 load(const u64 *p)
+{
+	return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+void vcpu_slots_init(struct kvm_shard *shard)
+{
+	struct vcpu_slots *s = &shard->slots;
+	for (int w = 0; w < VCPU_SLOT_WORDS; ++w) {
+		s->busy[w] = 0;
+		s->created[w] = 0;
+		s->warm[w] = 0;
+	}
+	s->claims = 0;
+	s->contended = 0;
+}
+
+static u64 class_mask(struct vcpu_slots *s, int w, enum VCPU_SLOT_CLASS cls)
+{
+	switch (cls) {
+	case VCPU_SLOT_WARM:
+		return load(&s->warm[w]);
+	case VCPU_SLOT_CREATED:
+		return load(&s->created[w]);
+	case VCPU_SLOT_COLD:
+		return load(&s->created[w]) & ~load(&s->warm[w]);
+	case VCPU_SLOT_EMPTY:
+		return ~load(&s->created[w]);
+	}
+	return 0;
+}
+
+// 返回拥有的 slot, 没有 cls 类型的空闲 slot 的时候返回 -1
+int vcpu_slot_claim(struct kvm_shard *shard, enum VCPU_SLOT_CLASS cls)
+{
+	struct vcpu_slots *s = &shard->slots;
+
+	for (int w = 0; w < VCPU_SLOT_WORDS; ++w) {
+		u64 busy = __atomic_load_n(&s->busy[w], __ATOMIC_RELAXED);
+		for (;;) {
+			u64 candidates = ~busy & class_mask(s, w, cls) &
+					 slot_valid_mask(shard, w);
+			if (candidates == 0)
+				break;
+
+			u64 bit = candidates & -candidates;
+			// 失败的时候 busy 被更新为当前的值
+			if (!__atomic_compare_exchange_n(&s->busy[w], &busy,
+							 busy | bit, false,
+							 __ATOMIC_ACQUIRE,
+							 __ATOMIC_RELAXED)) {
+				__atomic_fetch_add(&s->contended, 1,
+						   __ATOMIC_RELAXED);
+				continue;
+			}
+
+			// 无论按照哪一种类型拿到，slot 都不再是空闲的
+			if (__atomic_fetch_and(&s->warm[w], ~bit,
+					       __ATOMIC_RELAXED) &
+			    bit)
+				__atomic_fetch_sub(&shard->vm->prewarm.warm, 1,
+						   __ATOMIC_RELAXED);
+			__atomic_fetch_add(&s->claims, 1, __ATOMIC_RELAXED);
+			return w * 64 + __builtin_ctzll(bit);
+		}
+	}
+	return -1;
+}
+
+// 由 slot 的所有者在写入 vcpu_pool[slot].vcpu 之后调用
+void vcpu_slot_set_created(struct kvm_shard *shard, int slot)
+{
+	__atomic_fetch_or(&shard->slots.created[slot / 64], slot_bit(slot),
+			  __ATOMIC_RELEASE);
+}
+
+// warm 表示 slot 中的 vcpu 已经被 prewarm 线程初始化
+void vcpu_slot_release(struct kvm_shard *shard, int slot, bool warm)
+{
+	struct vcpu_slots *s = &shard->slots;
+	u64 bit = slot_bit(slot);
+
+	if (warm) {
+		__atomic_fetch_or(&s->warm[slot / 64], bit, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&shard->vm->prewarm.warm, 1,
+				   __ATOMIC_RELAXED);
+	}
+
+	u64 old = __atomic_fetch_and(&s->busy[slot / 64], ~bit,
+				     __ATOMIC_RELEASE);
+	if (!(old & bit))
+		die("vcpu slot %d released twice", slot);
+}
+
+static int shard_load(struct kvm_shard *shard)
+{
+	int n = 0;
+	for (int w = 0; w < VCPU_SLOT_WORDS; ++w)
+		n += __builtin_popcountll(load(&shard->slots.busy[w]));
+	return n;
+}
+
+// 还有空闲 slot 的 shard 中 busy 最少的一个，都满了的时候返回 NULL
+struct kvm_shard *kvm_least_loaded_shard(struct kvm_vm *vm)
+{
+	struct kvm_shard *best = NULL;
+	int best_load = vm->max_vcpus;
+
+	int nr_shards = __atomic_load_n(&vm->nr_shards, __ATOMIC_ACQUIRE);
+	for (int i = 0; i < nr_shards; ++i) {
+		int n = shard_load(vm->shards[i]);
+		if (n < best_load) {
+			best = vm->shards[i];
+			best_load = n;
+		}
+	}
+	return best;
+}
+
+// 遍历所有 shard 中已经创建的 vcpu, iter 从 0 开始，结束的时候返回 NULL 。
+// vcpu 只会增加不会释放，所以不需要持有锁
+struct kvm_cpu *kvm_next_vcpu(struct kvm_vm *vm, int *iter)
+{
+	int nr_shards = __atomic_load_n(&vm->nr_shards, __ATOMIC_ACQUIRE);
+	for (; *iter < nr_shards * KVM_MAX_VCPUS; ++*iter) {
+		struct kvm_shard *shard = vm->shards[*iter / KVM_MAX_VCPUS];
+		int slot = *iter % KVM_MAX_VCPUS;
+		if (!(load(&shard->slots.created[slot / 64]) & slot_bit(slot)))
+			continue;
+		++*iter;
+		return shard->vcpu_pool[slot].vcpu;
+	}
+	return NULL;
+}
+
+static void slots_snapshot(struct kvm_vm *vm, struct dune_vcpu_slot_stats *out)
+{
+	memset(out, 0, sizeof(*out));
+	int nr_shards = __atomic_load_n(&vm->nr_shards, __ATOMIC_ACQUIRE);
+	for (int i = 0; i < nr_shards; ++i) {
+		struct vcpu_slots *s = &vm->shards[i]->slots;
+		out->claims += __atomic_load_n(&s->claims, __ATOMIC_RELAXED);
+		out->contended +=
+			__atomic_load_n(&s->contended, __ATOMIC_RELAXED);
+		for (int w = 0; w < VCPU_SLOT_WORDS; ++w) {
+			out->created += __builtin_popcountll(load(&s->created[w]));
+			out->busy += __builtin_popcountll(load(&s->busy[w]));
+			out->warm += __builtin_popcountll(load(&s->warm[w]));
+		}
+	}
+	out->shards = nr_shards;
+	out->max_vcpus = vm->max_vcpus;
+}
+
+long vcpu_slots_query(struct kvm_vm *vm, u64 uaddr)
+{
+	struct dune_vcpu_slot_stats *out = (struct dune_vcpu_slot_stats *)uaddr;
+	if (out == NULL)
+		return -EFAULT;
+	slots_snapshot(vm, out);
+	return 0;
+}
+
+void vcpu_slots_dump(struct kvm_vm *vm, int fd)
+{
+	struct dune_vcpu_slot_stats st;
+	slots_snapshot(vm, &st);
+	dprintf(fd, "vcpu slots : claims=%llu contended=%llu created=%llu "
+		    "busy=%llu warm=%llu shards=%llu max_vcpus=%llu\n",
+		st.claims, st.contended, st.created, st.busy, st.warm,
+		st.shards, st.max_vcpus);
+}
+
+int dune_vcpu_slot_stats(struct dune_vcpu_slot_stats *stats)
+{
+	long ret = syscall(DUNE_SYS_VCPU_SLOTS, stats);
+	return ret == -1 ? -errno : ret;
+}
@@ -0,0 +1,43 @@
+#ifndef BENCH_H_K3XN7PQ2
+#define BENCH_H_K3XN7PQ2
+
+#include <stdio.h>
+#include <stdlib.h> // qsort
+#include <time.h> // clock_gettime
+
+// example 中测量耗时的公共部分
+
+static inline long now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static inline int cmp_long(const void *a, const void *b)
+{
+	long x = *(const long *)a, y = *(const long *)b;
+	return (x > y) - (x < y);
+}
+
+static inline void sort_samples(long *samples, long n)
+{
+	qsort(samples, n, sizeof(long), cmp_long);
+}
+
+// samples 已经排序，p 为 0 到 99
+static inline long percentile(const long *samples, long n, int p)
+{
+	return samples[n * p / 100];
+}
+
+// 排序 n 个单次的耗时 (ns), 输出 p50 和 p99, what 是一次操作的名称
+static inline void report_latency(const char *name, const char *what,
+				  long *samples, long n)
+{
+	sort_samples(samples, n);
+	printf("%-18s %ld %s, p50 %ld ns, p99 %ld ns\n", name, n, what,
+	       percentile(samples, n, 50), percentile(samples, n, 99));
+}
+
+#endif
@@ -0,0 +1,72 @@
+#include <stdio.h>
+#include <stdlib.h> // atoi
+#include <time.h> // clock_gettime
+#include <pthread.h>
+#include <unistd.h>
+
+#include "../dune/dune.h"
+
+// make TESTSRCS=bench_affinity.c && DUNE_AFFINITY=pin ./bench_affinity.out [threads]
+//
+// 每一个线程反复访问自己的 4 块相距 1G 的内存 (不同的 512M 映射) 并且调用
+// sched_yield, 比较不同的 DUNE_AFFINITY 下的耗时，迁移次数和迁移之后的 TLB refill
+
+#define ROUNDS 200000
+#define SPAN (1UL << 30)
+#define NR_TOUCH 4
+
+static void *worker(void *arg)
+{
+	char *base = arg;
+	for (int i = 0; i < ROUNDS; ++i) {
+		for (int j = 0; j < NR_TOUCH; ++j)
+			((volatile char *)base)[j * SPAN] += 1;
+		if (i % 64 == 0)
+			sched_yield();
+	}
+	return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+	int nr = argc > 1 ? atoi(argv[1]) : 8;
+	pthread_t tids[64];
+	char *areas[64];
+	if (nr < 1 || nr > 64)
+		nr = 8;
+
+	for (int i = 0; i < nr; ++i) {
+		// 只访问 4 个 page, 虚拟地址空间不需要真正的内存
+		areas[i] = malloc(SPAN * (NR_TOUCH - 1) + 4096);
+		if (areas[i] == NULL) {
+			printf("malloc failed\n");
+			return 1;
+		}
+	}
+
+	DUNE_ENTER;
+
+	struct timespec a, b;
+	clock_gettime(CLOCK_MONOTONIC, &a);
+	for (int i = 0; i < nr; ++i)
+		pthread_create(&tids[i], NULL, worker, areas[i]);
+	for (int i = 0; i < nr; ++i)
+		pthread_join(tids[i], NULL);
+	clock_gettime(CLOCK_MONOTONIC, &b);
+
+	struct dune_affinity_stats st;
+	if (dune_affinity_stats(&st)) {
+		printf("dune_affinity_stats failed\n");
+		return 1;
+	}
+	long ms = (b.tv_sec - a.tv_sec) * 1000 + (b.tv_nsec - a.tv_nsec) / 1000000;
+	printf("%d threads, policy %llu : %ld ms, %llu migrations, "
+	       "%llu refills\n",
+	       nr, st.policy, ms, st.migrations, st.refills);
+	if (st.post_migration_ns)
+		printf("after migration : %llu refills in %llu windows, "
+		       "%.1f refills/ms\n",
+		       st.post_migration_refills, st.windows,
+		       st.post_migration_refills * 1e6 / st.post_migration_ns);
+	return 0;
+}
@@ -0,0 +1,70 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h> // atol
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "../dune/dune.h"
+#include "bench.h"
+
+// make TESTSRCS=bench_batch.c && ./bench_batch.out [iterations]
+//
+// 模拟日志代码中连续的 write / fstat / lseek : 逐个调用的时候每一个都是一次
+// vm exit, 通过 dune_syscall_batch 提交的时候三个 syscall 只需要一次 。
+// loongarch 没有 fstat, glibc 使用 statx 实现，所以这里直接使用 statx
+
+static char buf[64];
+static char stx[256]; // struct statx
+
+static void bench_single(int fd, long iters)
+{
+	long begin = now_ns();
+	for (long i = 0; i < iters; ++i) {
+		write(fd, buf, sizeof(buf));
+		syscall(SYS_statx, fd, "", AT_EMPTY_PATH, 0, stx);
+		lseek(fd, 0, SEEK_CUR);
+	}
+	long end = now_ns();
+
+	printf("%-8s %ld groups, %.1f ns/group\n", "single", iters,
+	       (double)(end - begin) / iters);
+}
+
+static void bench_batch(int fd, long iters)
+{
+	struct dune_sysreq reqs[] = {
+		{ .sysno = SYS_write, .args = { fd, (long)buf, sizeof(buf) } },
+		{ .sysno = SYS_statx,
+		  .args = { fd, (long)"", AT_EMPTY_PATH, 0, (long)stx } },
+		{ .sysno = SYS_lseek, .args = { fd, 0, SEEK_CUR } },
+	};
+	int n = sizeof(reqs) / sizeof(reqs[0]);
+
+	long begin = now_ns();
+	for (long i = 0; i < iters; ++i) {
+		if (dune_syscall_batch(reqs, n) != n || reqs[0].ret != sizeof(buf)) {
+			printf("dune_syscall_batch failed\n");
+			exit(1);
+		}
+	}
+	long end = now_ns();
+
+	printf("%-8s %ld groups, %.1f ns/group\n", "batch", iters,
+	       (double)(end - begin) / iters);
+}
+
+int main(int argc, char *argv[])
+{
+	long iters = argc > 1 ? atol(argv[1]) : 1000000;
+	int fd = open("/dev/null", O_WRONLY);
+	if (fd < 0) {
+		perror("open");
+		return 1;
+	}
+
+	DUNE_ENTER;
+	bench_single(fd, iters);
+	bench_batch(fd, iters);
+	return 0;
+}
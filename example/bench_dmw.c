@@ -0,0 +1,60 @@
+#include <stdio.h>
+#include <stdlib.h> // atoi
+#include <sys/mman.h>
+
+#include "../dune/dune.h"
+#include "bench.h"
+
+// make TESTSRCS=bench_dmw.c && DUNE_TRANSLATION=dmw ./bench_dmw.out [chunks]
+//
+// 在 chunks 个相距 512M 的区域中随机地读写，每一个区域只使用开头的 256K, 工作集
+// 超过 MTLB 能够容纳的 512M 映射。分别使用 DUNE_TRANSLATION=tlb 和 dmw 运行,
+// 比较耗时和 guest 中的 TLB refill 次数，dmw 的时候 refill 应该为 0 。
+
+#define ROUNDS 20000000
+#define CHUNK (512UL << 20)
+#define USED (256UL << 10)
+
+int main(int argc, char *argv[])
+{
+	int chunks = argc > 1 ? atoi(argv[1]) : 256;
+	if (chunks < 1 || chunks > 1024)
+		chunks = 256;
+
+	// 只有被访问的部分需要真正的内存
+	char *base = mmap(NULL, CHUNK * chunks, PROT_READ | PROT_WRITE,
+			  MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (base == MAP_FAILED) {
+		printf("mmap failed\n");
+		return 1;
+	}
+	for (int i = 0; i < chunks; ++i)
+		for (unsigned long off = 0; off < USED; off += 4096)
+			base[i * CHUNK + off] = 1;
+
+	DUNE_ENTER;
+
+	struct dune_affinity_stats before, after;
+	if (dune_affinity_stats(&before)) {
+		printf("dune_affinity_stats failed\n");
+		return 1;
+	}
+
+	unsigned long seed = 1, sum = 0;
+	long begin = now_ns();
+	for (int i = 0; i < ROUNDS; ++i) {
+		seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+		unsigned long chunk = (seed >> 33) % chunks;
+		unsigned long off = (seed >> 13) % USED;
+		sum += ++((volatile char *)base)[chunk * CHUNK + off];
+	}
+	long ns = now_ns() - begin;
+
+	dune_affinity_stats(&after);
+	const char *mode = getenv("DUNE_TRANSLATION");
+	printf("%s, %d chunks : %ld ms, %.2f ns per access, %llu refills "
+	       "(sum %lu)\n",
+	       mode ? mode : "tlb", chunks, ns / 1000000, (double)ns / ROUNDS,
+	       after.refills - before.refills, sum);
+	return 0;
+}
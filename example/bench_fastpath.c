@@ -0,0 +1,48 @@
+#include <stdio.h>
+#include <stdlib.h> // atol
+#include <unistd.h> // syscall
+#include <sys/syscall.h>
+
+#include "../dune/dune.h"
+#include "bench.h"
+
+// make TESTSRCS=bench_fastpath.c && ./bench_fastpath.out [iterations]
+//
+// getpid 和 gettid 默认在 guest 中直接返回，getppid 仍然需要 vm exit,
+// 两者之差就是一次 vm exit 的开销。sched_yield 通过 dune_fastpath_set 设置之后
+// 同样不再导致 vm exit 。
+
+static void bench(const char *name, long sysno, long iters)
+{
+	long begin = now_ns();
+	for (long i = 0; i < iters; ++i)
+		syscall(sysno);
+	long end = now_ns();
+
+	printf("%-12s %ld syscalls, %.1f ns/syscall\n", name, iters,
+	       (double)(end - begin) / iters);
+}
+
+int main(int argc, char *argv[])
+{
+	long iters = argc > 1 ? atol(argv[1]) : 1000000;
+	pid_t pid = getpid();
+
+	DUNE_ENTER;
+	if (syscall(SYS_getpid) != pid) {
+		printf("getpid returns a wrong value\n");
+		return 1;
+	}
+
+	bench("getpid", SYS_getpid, iters);
+	bench("gettid", SYS_gettid, iters);
+	bench("getppid", SYS_getppid, iters);
+	bench("sched_yield", SYS_sched_yield, iters);
+
+	if (dune_fastpath_set(SYS_sched_yield, 0)) {
+		printf("dune_fastpath_set failed\n");
+		return 1;
+	}
+	bench("sched_yield", SYS_sched_yield, iters);
+	return 0;
+}
@@ -0,0 +1,75 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h> // atol
+#include <unistd.h> // fork
+#include <sys/wait.h>
+
+#include "../dune/dune.h"
+#include "bench.h"
+
+// make TESTSRCS=bench_fork.c && ./bench_fork.out [iterations]
+//
+// 统计 native 和 dune 中 pthread_create + pthread_join 以及 fork + waitpid
+// 的单次延迟，输出 p50 和 p99 。每一次创建线程或者进程需要的 ioctl 个数使用
+// strace 统计，并除以 iterations :
+//
+//   strace -f -c -e trace=ioctl ./bench_fork.out 1000
+//
+// DUNE_VCPU_POOL=4 ./bench_fork.out 比较提前初始化 vcpu 的效果
+
+static long *samples;
+
+static void *thread_fn(void *arg)
+{
+	return arg;
+}
+
+static void bench_pthread(const char *name, long iters)
+{
+	for (long i = 0; i < iters; ++i) {
+		pthread_t th;
+		long begin = now_ns();
+		if (pthread_create(&th, NULL, thread_fn, NULL)) {
+			printf("pthread_create failed\n");
+			exit(1);
+		}
+		pthread_join(th, NULL);
+		samples[i] = now_ns() - begin;
+	}
+	report_latency(name, "iterations", samples, iters);
+}
+
+static void bench_fork(const char *name, long iters)
+{
+	for (long i = 0; i < iters; ++i) {
+		long begin = now_ns();
+		pid_t pid = fork();
+		if (pid == 0)
+			_exit(0);
+		if (pid < 0) {
+			printf("fork failed\n");
+			exit(1);
+		}
+		waitpid(pid, NULL, 0);
+		samples[i] = now_ns() - begin;
+	}
+	report_latency(name, "iterations", samples, iters);
+}
+
+int main(int argc, char *argv[])
+{
+	long iters = argc > 1 ? atol(argv[1]) : 1000;
+
+	samples = malloc(sizeof(long) * iters);
+	if (samples == NULL) {
+		printf("malloc failed\n");
+		return 1;
+	}
+
+	bench_pthread("native pthread", iters);
+	bench_fork("native fork", iters);
+	DUNE_ENTER;
+	bench_pthread("dune pthread", iters);
+	bench_fork("dune fork", iters);
+	return 0;
+}
@@ -0,0 +1,104 @@
+#include <stdio.h>
+#include <stdlib.h> // atoi
+#include <pthread.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+#include "../dune/dune.h"
+#include "bench.h"
+
+// make TESTSRCS=bench_ipi.c && ./bench_ipi.out [rounds]
+//
+// 两个线程之间的 ping-pong, 分别使用 dune_ipi_send 和 futex 唤醒对方，
+// 统计一次往返的平均时间。使用 IPI 的时候接收者在 guest 中自旋等待标志。
+
+static volatile int ipi_flag[2];
+static int ipi_cpu[2];
+static volatile int ipi_ready;
+static int futex_word[2];
+static int rounds;
+
+static void ipi_handler(int vector)
+{
+	ipi_flag[vector] = 1;
+}
+
+static void ipi_wait(int self)
+{
+	while (!ipi_flag[self])
+		;
+	ipi_flag[self] = 0;
+}
+
+static void *ipi_pong(void *arg)
+{
+	ipi_cpu[1] = dune_ipi_register(ipi_handler);
+	__atomic_store_n(&ipi_ready, 1, __ATOMIC_RELEASE);
+	for (int i = 0; i < rounds; ++i) {
+		ipi_wait(1);
+		dune_ipi_send(ipi_cpu[0], 0);
+	}
+	return NULL;
+}
+
+static void futex_wait(int self)
+{
+	while (!__atomic_exchange_n(&futex_word[self], 0, __ATOMIC_ACQUIRE))
+		syscall(SYS_futex, &futex_word[self], FUTEX_WAIT_PRIVATE, 0,
+			NULL, NULL, 0);
+}
+
+static void futex_wake(int peer)
+{
+	__atomic_store_n(&futex_word[peer], 1, __ATOMIC_RELEASE);
+	syscall(SYS_futex, &futex_word[peer], FUTEX_WAKE_PRIVATE, 1, NULL,
+		NULL, 0);
+}
+
+static void *futex_pong(void *arg)
+{
+	for (int i = 0; i < rounds; ++i) {
+		futex_wait(1);
+		futex_wake(0);
+	}
+	return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+	rounds = argc > 1 ? atoi(argv[1]) : 100000;
+
+	DUNE_ENTER;
+
+	ipi_cpu[0] = dune_ipi_register(ipi_handler);
+	if (ipi_cpu[0] < 0) {
+		printf("dune_ipi_register failed : %d\n", ipi_cpu[0]);
+		return 1;
+	}
+
+	pthread_t t;
+	pthread_create(&t, NULL, ipi_pong, NULL);
+	while (!__atomic_load_n(&ipi_ready, __ATOMIC_ACQUIRE))
+		;
+	long begin = now_ns();
+	for (int i = 0; i < rounds; ++i) {
+		dune_ipi_send(ipi_cpu[1], 1);
+		ipi_wait(0);
+	}
+	long ipi_ns = now_ns() - begin;
+	pthread_join(t, NULL);
+
+	pthread_create(&t, NULL, futex_pong, NULL);
+	begin = now_ns();
+	for (int i = 0; i < rounds; ++i) {
+		futex_wake(1);
+		futex_wait(0);
+	}
+	long futex_ns = now_ns() - begin;
+	pthread_join(t, NULL);
+
+	printf("%d rounds : ipi %ld ns, futex %ld ns per round trip\n", rounds,
+	       ipi_ns / rounds, futex_ns / rounds);
+	return 0;
+}
@@ -0,0 +1,122 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h> // atoi
+#include <string.h>
+#include <sys/mman.h>
+
+#include "../dune/dune.h"
+#include "bench.h"
+
+// make TESTSRCS=bench_jit.c && ./bench_jit.out [rounds] [threads]
+//
+// 模拟 JIT 的 W^X 循环 : 把代码页切换为可写，写入一个返回 i 的函数，切换为可执行
+// 然后调用。比较 DUNE_ENTER 之前的 mprotect, guest 中的 mprotect 和
+// dune_jit_writable / dune_jit_executable 每一轮的耗时。threads 个 attach 了
+// region 的线程在 guest 中自旋，dune_jit 的切换需要 shootdown 它们。
+
+#define CODE_SIZE (16UL << 10)
+
+static int failed;
+static volatile int stop;
+
+static void check(const char *what, long got, long expect)
+{
+	if (got != expect) {
+		printf("FAIL %s : got %ld, expect %ld\n", what, got, expect);
+		failed = 1;
+	}
+}
+
+// addi.w $a0, $zero, value; jirl $zero, $ra, 0
+static void emit(unsigned *code, int value)
+{
+	code[0] = 0x02800004 | (value & 0x7ff) << 10;
+	code[1] = 0x4c000020;
+}
+
+static int run(unsigned *code, int value)
+{
+#ifdef __loongarch__
+	return ((int (*)(void))code)();
+#else
+	return value & 0x7ff;
+#endif
+}
+
+static long bench_mprotect(unsigned *code, int rounds)
+{
+	long begin = now_ns();
+	for (int i = 0; i < rounds; ++i) {
+		mprotect(code, CODE_SIZE, PROT_READ | PROT_WRITE);
+		emit(code, i);
+		mprotect(code, CODE_SIZE, PROT_READ | PROT_EXEC);
+		__builtin___clear_cache((char *)code, (char *)(code + 2));
+		if (run(code, i) != (i & 0x7ff))
+			failed = 1;
+	}
+	return now_ns() - begin;
+}
+
+static void *spinner(void *arg)
+{
+	dune_jit_attach(arg);
+	while (!stop)
+		;
+	return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+	int rounds = argc > 1 ? atoi(argv[1]) : 100000;
+	int threads = argc > 2 ? atoi(argv[2]) : 0;
+
+	unsigned *native = mmap(NULL, CODE_SIZE, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (native == MAP_FAILED) {
+		printf("mmap failed\n");
+		return 1;
+	}
+	long native_ns = bench_mprotect(native, rounds);
+	check("native mprotect", failed, 0);
+
+	DUNE_ENTER;
+
+	long guest_ns = bench_mprotect(native, rounds);
+	check("guest mprotect", failed, 0);
+
+	struct dune_jit_region region;
+	int err = dune_jit_region_init(&region, CODE_SIZE);
+	if (err) {
+		printf("dune_jit_region_init failed : %d\n", err);
+		return 1;
+	}
+	unsigned *code = region.addr;
+
+	pthread_t tids[64];
+	if (threads > 64)
+		threads = 64;
+	for (int i = 0; i < threads; ++i)
+		pthread_create(&tids[i], NULL, spinner, &region);
+
+	long begin = now_ns();
+	for (int i = 0; i < rounds; ++i) {
+		dune_jit_writable(&region, code, CODE_SIZE);
+		emit(code, i);
+		dune_jit_executable(&region, code, CODE_SIZE);
+		if (run(code, i) != (i & 0x7ff)) {
+			check("jit result", run(code, i), i & 0x7ff);
+			break;
+		}
+	}
+	long jit_ns = now_ns() - begin;
+
+	stop = 1;
+	for (int i = 0; i < threads; ++i)
+		pthread_join(tids[i], NULL);
+
+	printf("W^X round, %d other threads : native mprotect %ld ns, "
+	       "guest mprotect %ld ns, dune_jit %ld ns\n",
+	       threads, native_ns / rounds, guest_ns / rounds, jit_ns / rounds);
+	printf("%s\n", failed ? "FAIL" : "PASS");
+	return failed;
+}
@@ -0,0 +1,52 @@
+#include <stdio.h>
+#include <stdlib.h> // atoi
+#include <pthread.h>
+
+#include "../dune/dune.h"
+#include "bench.h"
+
+// make TESTSRCS=bench_mutex.c && DUNE_FUTEX_ELIDE=1 ./bench_mutex.out [threads]
+//
+// 多个线程竞争同一个 pthread mutex, 临界区很短，统计每次加锁解锁的平均时间和
+// futex 的次数。DUNE_STATS=1 可以看到 futex 在 host 中的处理时间。
+
+#define ITERS 200000
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static volatile long counter;
+
+static void *worker(void *arg)
+{
+	for (int i = 0; i < ITERS; ++i) {
+		pthread_mutex_lock(&lock);
+		counter++;
+		pthread_mutex_unlock(&lock);
+	}
+	return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+	int nr = argc > 1 ? atoi(argv[1]) : 4;
+	pthread_t tids[64];
+	if (nr < 1 || nr > 64)
+		nr = 4;
+
+	DUNE_ENTER;
+
+	struct dune_syscall_stat before, after;
+	int has_stats = dune_stats_syscall(98, &before) == 0; // loongarch futex
+
+	long begin = now_ns();
+	for (int i = 0; i < nr; ++i)
+		pthread_create(&tids[i], NULL, worker, NULL);
+	for (int i = 0; i < nr; ++i)
+		pthread_join(tids[i], NULL);
+	long ns = now_ns() - begin;
+
+	printf("%d threads : %ld ns per lock/unlock, counter %ld\n", nr,
+	       ns / ((long)nr * ITERS), counter);
+	if (has_stats && dune_stats_syscall(98, &after) == 0)
+		printf("futex hypercalls : %llu\n", after.count - before.count);
+	return 0;
+}
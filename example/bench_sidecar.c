@@ -0,0 +1,49 @@
+#include <stdio.h>
+#include <stdlib.h> // atol
+#include <unistd.h> // syscall
+#include <sys/syscall.h>
+
+#include "../dune/dune.h"
+#include "bench.h"
+
+// make TESTSRCS=bench_sidecar.c && ./bench_sidecar.out [iterations] [sidecar_cpu]
+//
+// 分别统计 native, host_loop (每一个 syscall 一次 vm exit) 和 sidecar
+// (guest 在 syscall vector 中自旋等待 sidecar 线程) 三种情况下 getppid
+// 的单次延迟，输出 p50 和 p99 。sidecar_cpu 最好是和当前 cpu 相邻的核。
+
+static long *samples;
+
+static void bench(const char *name, long iters)
+{
+	for (long i = 0; i < iters; ++i) {
+		long begin = now_ns();
+		syscall(SYS_getppid);
+		samples[i] = now_ns() - begin;
+	}
+
+	report_latency(name, "syscalls", samples, iters);
+}
+
+int main(int argc, char *argv[])
+{
+	long iters = argc > 1 ? atol(argv[1]) : 1000000;
+	int cpu = argc > 2 ? atoi(argv[2]) : -1;
+
+	samples = malloc(sizeof(long) * iters);
+	if (samples == NULL) {
+		printf("malloc failed\n");
+		return 1;
+	}
+
+	bench("native", iters);
+	DUNE_ENTER;
+	bench("host_loop", iters);
+
+	if (dune_sidecar_enable(cpu)) {
+		printf("dune_sidecar_enable failed\n");
+		return 1;
+	}
+	bench("sidecar", iters);
+	return 0;
+}
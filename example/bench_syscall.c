@@ -0,0 +1,35 @@
+#include <stdio.h>
+#include <stdlib.h> // atol
+#include <unistd.h> // syscall
+#include <sys/syscall.h>
+
+#include "../dune/dune.h"
+#include "bench.h"
+
+// make TESTSRCS=bench_syscall.c && ./bench_syscall.out [iterations]
+//
+// getppid 在 host 中没有任何副作用，并且 glibc 不会缓存它的结果，
+// 所以每一次调用都是一次完整的 hypercall : guest syscall vector => KVM_RUN
+// 返回 => host_loop 分发 => arch_do_syscall => 重新进入 guest 。
+// 在修改 host_loop 前后分别运行，两次 dune 结果之差就是分发部分的开销。
+
+static void bench(const char *name, long iters)
+{
+	long begin = now_ns();
+	for (long i = 0; i < iters; ++i)
+		syscall(SYS_getppid);
+	long end = now_ns();
+
+	printf("%-8s %ld syscalls, %.1f ns/syscall\n", name, iters,
+	       (double)(end - begin) / iters);
+}
+
+int main(int argc, char *argv[])
+{
+	long iters = argc > 1 ? atol(argv[1]) : 1000000;
+
+	bench("native", iters);
+	DUNE_ENTER;
+	bench("dune", iters);
+	return 0;
+}
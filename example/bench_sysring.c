@@ -0,0 +1,94 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h> // atol
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "../dune/dune.h"
+#include "bench.h"
+
+// make TESTSRCS=bench_sysring.c && ./bench_sysring.out [iterations] [batch]
+//
+// 对比同步的 write 和通过 sysring 异步提交的 write : 同步的每一次调用都是一次
+// hypercall, 而异步的一次提交 batch 个请求 (最多 MAX_BATCH 个), 然后再统一
+// 等待结果。
+// 在 dune 中两者之差就是节省下来的 vm exit 的开销
+
+#define MAX_BATCH 256
+
+static char buf[64];
+
+static void bench_sync(int fd, long iters)
+{
+	long begin = now_ns();
+	for (long i = 0; i < iters; ++i)
+		write(fd, buf, sizeof(buf));
+	long end = now_ns();
+
+	printf("%-8s %ld writes, %.1f ns/write\n", "sync", iters,
+	       (double)(end - begin) / iters);
+}
+
+static void bench_async(int fd, long iters, int batch)
+{
+	struct dune_sysreq req = {
+		.sysno = SYS_write,
+		.args = { fd, (long)buf, sizeof(buf) },
+	};
+	long tickets[MAX_BATCH];
+	long done = 0;
+
+	// ring 满的时候提前结束这一批，只统计实际完成的 write
+	long begin = now_ns();
+	while (done < iters) {
+		int n = 0;
+		for (; n < batch && done + n < iters; ++n) {
+			tickets[n] = dune_syscall_submit(&req);
+			if (tickets[n] < 0)
+				break;
+		}
+		if (n == 0 && tickets[0] != -EAGAIN) {
+			printf("dune_syscall_submit failed : %ld\n", tickets[0]);
+			exit(1);
+		}
+		for (int j = 0; j < n; ++j) {
+			if (dune_syscall_wait(tickets[j]) != sizeof(buf)) {
+				printf("async write failed\n");
+				exit(1);
+			}
+		}
+		done += n;
+	}
+	long end = now_ns();
+
+	printf("%-8s %ld writes, %.1f ns/write (batch %d)\n", "async", done,
+	       (double)(end - begin) / done, batch);
+}
+
+int main(int argc, char *argv[])
+{
+	long iters = argc > 1 ? atol(argv[1]) : 1000000;
+	if (iters < 1)
+		iters = 1;
+	int batch = argc > 2 ? atoi(argv[2]) : 32;
+	if (batch < 1)
+		batch = 1;
+	if (batch > MAX_BATCH)
+		batch = MAX_BATCH;
+	int fd = open("/dev/null", O_WRONLY);
+	if (fd < 0) {
+		perror("open");
+		return 1;
+	}
+
+	DUNE_ENTER;
+	if (dune_sysring_init(1)) {
+		printf("dune_sysring_init failed\n");
+		return 1;
+	}
+
+	bench_sync(fd, iters);
+	bench_async(fd, iters, batch);
+	return 0;
+}
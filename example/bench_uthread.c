@@ -0,0 +1,79 @@
+#include <stdio.h>
+#include <stdlib.h> // atoi
+
+#include "../dune/dune.h"
+#include "bench.h"
+
+// make TESTSRCS=bench_uthread.c && ./bench_uthread.out [workers] [slice_us]
+//
+// 每一个 worker 上先放一个一直占用 cpu 的长任务，然后每隔 SHORT_GAP_US 提交一个
+// 短任务，统计短任务从提交到开始执行的延迟。slice_us 为 0 的时候短任务需要等到
+// 长任务结束，打开抢占之后延迟在 slice_us 的量级。
+
+#define LONG_MS 200
+#define NR_SHORT 1000
+#define SHORT_GAP_US 100
+
+struct short_task {
+	long submit_ns;
+	long latency_ns;
+};
+
+static struct short_task shorts[NR_SHORT];
+
+static void long_fn(void *arg)
+{
+	long end = now_ns() + LONG_MS * 1000000L;
+	while (now_ns() < end)
+		;
+}
+
+static void short_fn(void *arg)
+{
+	struct short_task *t = arg;
+	t->latency_ns = now_ns() - t->submit_ns;
+}
+
+int main(int argc, char *argv[])
+{
+	int workers = argc > 1 ? atoi(argv[1]) : 2;
+	unsigned long slice_us = argc > 2 ? atoi(argv[2]) : 50;
+
+	DUNE_ENTER;
+
+	int err = dune_uthread_init(workers, slice_us);
+	if (err) {
+		printf("dune_uthread_init failed : %d\n", err);
+		return 1;
+	}
+
+	for (int i = 0; i < workers; ++i)
+		dune_uthread_spawn(long_fn, NULL);
+
+	for (int i = 0; i < NR_SHORT; ++i) {
+		long next = now_ns() + SHORT_GAP_US * 1000L;
+		shorts[i].submit_ns = now_ns();
+		if (dune_uthread_spawn(short_fn, &shorts[i])) {
+			printf("dune_uthread_spawn failed\n");
+			return 1;
+		}
+		while (now_ns() < next)
+			;
+	}
+	dune_uthread_wait();
+
+	static long lat[NR_SHORT];
+	for (int i = 0; i < NR_SHORT; ++i)
+		lat[i] = shorts[i].latency_ns;
+	sort_samples(lat, NR_SHORT);
+
+	struct dune_uthread_stats st;
+	dune_uthread_stats(&st);
+	printf("%d workers, slice %lu us : short task latency p50 %ld us, "
+	       "p99 %ld us, max %ld us\n",
+	       workers, slice_us, percentile(lat, NR_SHORT, 50) / 1000,
+	       percentile(lat, NR_SHORT, 99) / 1000, lat[NR_SHORT - 1] / 1000);
+	printf("uthread : %llu switches, %llu preemptions, %llu ticks\n",
+	       st.switches, st.preemptions, st.ticks);
+	return 0;
+}
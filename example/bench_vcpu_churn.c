@@ -0,0 +1,101 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h> // atoi
+#include <string.h>
+#include <time.h> // clock_gettime
+#include <unistd.h> // sysconf
+
+#include "../dune/dune.h"
+
+// make TESTSRCS=bench_vcpu_churn.c && ./bench_vcpu_churn.out [seconds] [spawners]
+//
+// 每一个 spawner 线程不停地 pthread_create + pthread_join, 统计 native 和 dune
+// 中每秒创建的线程数。dune 中同时输出 vcpu slot 分配器的 claims 和 contended,
+// contended / claims 越大说明创建和退出的线程在 slot 上竞争越激烈。
+//
+// 每一个 spawner 和它的 child 各占用一个 vcpu, 一个 vm 放不下的时候 dune 会
+// 创建新的 shard, 输出中的 shards 就是最后的 vm 数量
+
+#define MAX_SPAWNERS 64
+
+static volatile int stop;
+static long created[MAX_SPAWNERS];
+
+static void *child_fn(void *arg)
+{
+	return arg;
+}
+
+static void *spawner_fn(void *arg)
+{
+	long id = (long)arg;
+	while (!stop) {
+		pthread_t th;
+		if (pthread_create(&th, NULL, child_fn, NULL)) {
+			printf("pthread_create failed\n");
+			exit(1);
+		}
+		pthread_join(th, NULL);
+		created[id]++;
+	}
+	return NULL;
+}
+
+static void run(const char *name, int seconds, int spawners)
+{
+	pthread_t th[MAX_SPAWNERS];
+	struct timespec begin, end;
+
+	stop = 0;
+	memset(created, 0, sizeof(created));
+	clock_gettime(CLOCK_MONOTONIC, &begin);
+	for (long i = 0; i < spawners; ++i) {
+		if (pthread_create(&th[i], NULL, spawner_fn, (void *)i)) {
+			printf("pthread_create failed\n");
+			exit(1);
+		}
+	}
+	sleep(seconds);
+	stop = 1;
+	for (int i = 0; i < spawners; ++i)
+		pthread_join(th[i], NULL);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	long total = 0;
+	for (int i = 0; i < spawners; ++i)
+		total += created[i];
+	double secs = (end.tv_sec - begin.tv_sec) +
+		      (end.tv_nsec - begin.tv_nsec) / 1e9;
+	printf("%-8s %d spawners, %ld threads, %.0f threads/s\n", name,
+	       spawners, total, total / secs);
+}
+
+int main(int argc, char *argv[])
+{
+	int seconds = argc > 1 ? atoi(argv[1]) : 5;
+	int spawners = argc > 2 ? atoi(argv[2]) : sysconf(_SC_NPROCESSORS_ONLN);
+	if (spawners < 1)
+		spawners = 1;
+	if (spawners > MAX_SPAWNERS)
+		spawners = MAX_SPAWNERS;
+
+	run("native", seconds, spawners);
+
+	DUNE_ENTER;
+
+	struct dune_vcpu_slot_stats before, after;
+	if (dune_vcpu_slot_stats(&before)) {
+		printf("dune_vcpu_slot_stats failed\n");
+		return 1;
+	}
+	run("dune", seconds, spawners);
+	dune_vcpu_slot_stats(&after);
+
+	unsigned long long claims = after.claims - before.claims;
+	unsigned long long contended = after.contended - before.contended;
+	printf("vcpu slots : %llu claims, %llu contended (%.3f%%), %llu created, "
+	       "%llu shards (max_vcpus %llu)\n",
+	       claims, contended, claims ? 100.0 * contended / claims : 0.0,
+	       after.created, after.shards, after.max_vcpus);
+	return 0;
+}
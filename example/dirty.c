@@ -0,0 +1,109 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h> // atoi
+#include <string.h>
+#include <sys/mman.h>
+
+#include "../dune/dune.h"
+#include "bench.h"
+
+// make TESTSRCS=dirty.c && ./dirty.out [pages]
+//
+// 在 dune_vm_reserve 保留的地址中用 16K 的页映射 pages 页，dune_dirty_begin 之后
+// 写入其中的一部分，检查 dune_dirty_collect 返回的 bitmap 和写入的页一致，再次
+// collect 的时候为空。最后比较第一次写入被跟踪的页 (经过 PME 的 vector) 和普通
+// 写入的耗时，以及 collect 一轮的耗时。
+
+#define PAGE (16UL << 10)
+
+static int failed;
+
+static void check(const char *what, long got, long expect)
+{
+	if (got != expect) {
+		printf("FAIL %s : got %ld, expect %ld\n", what, got, expect);
+		failed = 1;
+	}
+}
+
+static long touch(char *base, int pages, int stride)
+{
+	long begin = now_ns();
+	for (int i = 0; i < pages; i += stride)
+		((volatile char *)base)[i * PAGE + 8] = i;
+	return now_ns() - begin;
+}
+
+int main(int argc, char *argv[])
+{
+	int pages = argc > 1 ? atoi(argv[1]) : 4096;
+	if (pages < 64)
+		pages = 64;
+
+	char *mem = mmap(NULL, PAGE * pages, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	unsigned long long *bitmap = calloc((pages + 63) / 64, 8);
+	if (mem == MAP_FAILED || bitmap == NULL) {
+		printf("allocation failed\n");
+		return 1;
+	}
+	memset(mem, 0, PAGE * pages);
+
+	DUNE_ENTER;
+
+	void *arena;
+	int err = dune_vm_reserve(PAGE * pages, &arena);
+	if (err == 0)
+		err = dune_vm_map(arena, mem, PAGE * pages,
+				  PROT_READ | PROT_WRITE | DUNE_VM_NOHUGE);
+	if (err) {
+		printf("dune_vm_reserve / dune_vm_map failed : %d\n", err);
+		return 1;
+	}
+	char *base = arena;
+	struct dune_dirty_region region = { .addr = base,
+					    .size = PAGE * pages };
+	struct dune_dirty_region bad = { .addr = base + 1, .size = PAGE };
+
+	check("begin unaligned", dune_dirty_begin(&bad), -EINVAL);
+	check("begin", dune_dirty_begin(&region), 0);
+	check("collect clean", dune_dirty_collect(&region, bitmap), 0);
+
+	// 每 3 页写一次，读取不会标记
+	volatile char sum = 0;
+	for (int i = 0; i < pages; ++i)
+		sum += base[i * PAGE];
+	touch(base, pages, 3);
+	check("collect", dune_dirty_collect(&region, bitmap), (pages + 2) / 3);
+	for (int i = 0; i < pages; ++i)
+		check("bitmap", !!(bitmap[i / 64] & (1ULL << (i % 64))),
+		      i % 3 == 0);
+	check("written", mem[3 * PAGE + 8], 3);
+	check("collect again", dune_dirty_collect(&region, bitmap), 0);
+
+	// 只读的页不会变为可写，恢复权限之后仍然被跟踪
+	check("protect", dune_vm_protect(base, PAGE, PROT_READ), 0);
+	check("protect back",
+	      dune_vm_protect(base, PAGE, PROT_READ | PROT_WRITE), 0);
+	base[16] = 1;
+	check("collect after protect", dune_dirty_collect(&region, bitmap), 1);
+	check("bitmap after protect", bitmap[0], 1);
+
+	long first_ns = touch(base, pages, 1);
+	long again_ns = touch(base, pages, 1);
+	long begin = now_ns();
+	long dirty = dune_dirty_collect(&region, bitmap);
+	long collect_ns = now_ns() - begin;
+	check("collect all", dirty, pages);
+
+	check("end", dune_dirty_end(&region), 0);
+	touch(base, pages, 1);
+	check("collect after end", dune_dirty_collect(&region, bitmap), 0);
+
+	printf("%d pages : first write %ld ns, later write %ld ns per page, "
+	       "collect %ld us (sum %d)\n",
+	       pages, first_ns / pages, again_ns / pages, collect_ns / 1000,
+	       sum);
+	printf("%s\n", failed ? "FAIL" : "PASS");
+	return failed;
+}
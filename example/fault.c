@@ -0,0 +1,207 @@
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h> // atoi
+#include <string.h>
+#include <ucontext.h>
+#include <sys/mman.h>
+
+#include "../dune/dune.h"
+#include "bench.h"
+
+// make TESTSRCS=fault.c && ./fault.out [rounds]
+//
+// 在 dune_vm_reserve 保留的地址中测试 dune_fault_register 的 handler :
+// 第一次访问的时候才映射的页 (类似 userfaultfd), 读取空页的时候由 handler 设置
+// 结果并跳过指令 (隐式的空指针检查), 写入只读的页，以及在 dune_fault_altstack
+// 上处理栈溢出并扩展栈。最后比较 DUNE_ENTER 之前通过 SIGSEGV 和 mprotect 恢复
+// 写入的耗时，以及 handler 和 dune_vm_protect 的耗时。
+
+#define PAGE (16UL << 10)
+#define ARENA_PAGES 64
+#define LAZY_PAGES 16
+#define NULL_PAGE 16 // 永远不映射
+#define RO_PAGE 17
+#define BENCH_PAGE 18
+#define STACK_PAGE 32 // [STACK_PAGE, ARENA_PAGES) 是 deep_main 的栈
+#define DEPTH ((ARENA_PAGES - STACK_PAGE - 8) * PAGE / 1024)
+
+static int failed;
+static char *arena, *backing;
+static int faults[DUNE_FAULT_ADDR + 1];
+static ucontext_t main_ctx, deep_ctx;
+
+static void check(const char *what, long got, long expect)
+{
+	if (got != expect) {
+		printf("FAIL %s : got %ld, expect %ld\n", what, got, expect);
+		failed = 1;
+	}
+}
+
+static int map_page(unsigned long page, int prot)
+{
+	return dune_vm_map(arena + page * PAGE, backing + page * PAGE, PAGE,
+			   prot | DUNE_VM_NOHUGE);
+}
+
+static int handler(struct dune_fault *fault)
+{
+	if (fault->addr < (unsigned long)arena ||
+	    fault->addr >= (unsigned long)arena + ARENA_PAGES * PAGE)
+		return -1;
+	unsigned long page = (fault->addr - (unsigned long)arena) / PAGE;
+	faults[fault->type]++;
+
+	switch (fault->type) {
+	case DUNE_FAULT_LOAD:
+	case DUNE_FAULT_STORE:
+		if (page == NULL_PAGE) {
+			// 只有 null_load 访问空页，结果在 t0 (r12) 中
+			fault->regs[12] = -1;
+			fault->pc += 4;
+			return 0;
+		}
+		return map_page(page, PROT_READ | PROT_WRITE);
+	case DUNE_FAULT_MODIFY:
+		return dune_vm_protect(arena + page * PAGE, PAGE,
+				       PROT_READ | PROT_WRITE);
+	default:
+		return -1;
+	}
+}
+
+static long null_load(long *p)
+{
+#ifdef __loongarch__
+	register long v asm("$t0");
+	asm volatile("ld.d %0, %1, 0" : "=r"(v) : "r"(p) : "memory");
+	return v;
+#else
+	return -1;
+#endif
+}
+
+// 每一层使用大约 1K 的栈，depth 层需要扩展多个页
+static long deep(int depth)
+{
+	volatile char buf[1000];
+	buf[0] = depth;
+	buf[sizeof(buf) - 1] = depth;
+	if (depth == 0)
+		return 0;
+	return deep(depth - 1) + buf[0] - buf[sizeof(buf) - 1] + 1;
+}
+
+static long deep_result;
+
+static void deep_main(void)
+{
+	deep_result = deep(DEPTH);
+}
+
+static void native_handler(int sig, siginfo_t *info, void *uc)
+{
+	char *page = (char *)((unsigned long)info->si_addr & ~(PAGE - 1));
+	mprotect(page, PAGE, PROT_READ | PROT_WRITE);
+}
+
+static long bench_native(char *page, int rounds)
+{
+	struct sigaction sa = { .sa_sigaction = native_handler,
+				.sa_flags = SA_SIGINFO };
+	sigaction(SIGSEGV, &sa, NULL);
+	long begin = now_ns();
+	for (int i = 0; i < rounds; ++i) {
+		mprotect(page, PAGE, PROT_READ);
+		((volatile char *)page)[8] = i;
+	}
+	long ns = now_ns() - begin;
+	signal(SIGSEGV, SIG_DFL);
+	return ns;
+}
+
+static long bench_dune(char *page, int rounds)
+{
+	long begin = now_ns();
+	for (int i = 0; i < rounds; ++i) {
+		dune_vm_protect(page, PAGE, PROT_READ);
+		((volatile char *)page)[8] = i;
+	}
+	return now_ns() - begin;
+}
+
+int main(int argc, char *argv[])
+{
+	int rounds = argc > 1 ? atoi(argv[1]) : 10000;
+
+	backing = mmap(NULL, PAGE * ARENA_PAGES, PROT_READ | PROT_WRITE,
+		       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	char *native = mmap(NULL, PAGE, PROT_READ | PROT_WRITE,
+			    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	char *altstack = malloc(4 * PAGE);
+	if (backing == MAP_FAILED || native == MAP_FAILED || altstack == NULL) {
+		printf("allocation failed\n");
+		return 1;
+	}
+	memset(backing, 0, PAGE * ARENA_PAGES);
+	long native_ns = bench_native(native, rounds);
+
+	DUNE_ENTER;
+
+	void *va;
+	int err = dune_vm_reserve(PAGE * ARENA_PAGES, &va);
+	if (err == 0)
+		err = dune_fault_register(handler);
+	if (err) {
+		printf("dune_vm_reserve / dune_fault_register failed : %d\n",
+		       err);
+		return 1;
+	}
+	arena = va;
+
+	// 第一次读取和写入的时候映射
+	backing[3 * PAGE] = 3;
+	check("lazy load", arena[3 * PAGE], 3);
+	for (int i = 0; i < LAZY_PAGES; ++i)
+		arena[i * PAGE + 8] = i;
+	for (int i = 0; i < LAZY_PAGES; ++i)
+		check("lazy backing", backing[i * PAGE + 8], i);
+	check("lazy faults", faults[DUNE_FAULT_LOAD] + faults[DUNE_FAULT_STORE],
+	      LAZY_PAGES);
+
+	// 空页的读取由 handler 返回 -1
+	check("null load", null_load((long *)(arena + NULL_PAGE * PAGE)), -1);
+	check("null page", faults[DUNE_FAULT_LOAD], 2);
+
+	// 写入只读的页
+	check("map ro", map_page(RO_PAGE, PROT_READ), 0);
+	arena[RO_PAGE * PAGE] = 17;
+	check("modify", faults[DUNE_FAULT_MODIFY], 1);
+	check("modify backing", backing[RO_PAGE * PAGE], 17);
+
+	// 栈只映射了最高的一页，溢出的时候在备用的栈上扩展
+	check("altstack", dune_fault_altstack(altstack, 4 * PAGE), 0);
+	check("map stack", map_page(ARENA_PAGES - 1, PROT_READ | PROT_WRITE),
+	      0);
+	getcontext(&deep_ctx);
+	deep_ctx.uc_stack.ss_sp = arena + STACK_PAGE * PAGE;
+	deep_ctx.uc_stack.ss_size = (ARENA_PAGES - STACK_PAGE) * PAGE;
+	deep_ctx.uc_link = &main_ctx;
+	makecontext(&deep_ctx, deep_main, 0);
+	int before = faults[DUNE_FAULT_STORE];
+	swapcontext(&main_ctx, &deep_ctx);
+	check("deep", deep_result, DEPTH);
+	check("stack growth", faults[DUNE_FAULT_STORE] - before > 1, 1);
+	check("altstack off", dune_fault_altstack(NULL, 0), 0);
+
+	check("map bench", map_page(BENCH_PAGE, PROT_READ | PROT_WRITE), 0);
+	before = faults[DUNE_FAULT_MODIFY];
+	long dune_ns = bench_dune(arena + BENCH_PAGE * PAGE, rounds);
+	check("bench faults", faults[DUNE_FAULT_MODIFY] - before, rounds);
+
+	printf("write fault round : SIGSEGV + mprotect %ld ns, "
+	       "dune_fault + dune_vm_protect %ld ns\n",
+	       native_ns / rounds, dune_ns / rounds);
+	printf("%s\n", failed ? "FAIL" : "PASS");
+	return failed;
+}
@@ -0,0 +1,121 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h> // atoi
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "../dune/dune.h"
+#include "bench.h"
+
+// make TESTSRCS=getcpu.c && ./getcpu.out [rounds]
+//
+// 把线程依次绑定在 cpuset 中的每一个 cpu 上，检查 dune_getcpu, sched_getcpu 和
+// getcpu syscall 在 guest 中看到的 cpu 和 host 看到的一致。host 的值来自
+// /proc/thread-self/stat 的第 39 项，由 vcpu 线程在 host 中读取。不在栈上的
+// 指针交给 host 处理，非法的地址返回 EFAULT 。
+// 最后不绑定 cpu, 统计 dune_getcpu 落后于 host 的比例和几种方法的耗时。
+
+static int failed;
+
+static void check(const char *what, long got, long expect)
+{
+	if (got != expect) {
+		printf("FAIL %s : got %ld, expect %ld\n", what, got, expect);
+		failed = 1;
+	}
+}
+
+// 上一次被调度时所在的 cpu, 读取本身就是一次 exit
+static int host_cpu(void)
+{
+	FILE *f = fopen("/proc/thread-self/stat", "r");
+	if (f == NULL)
+		return -1;
+	char buf[1024];
+	int cpu = -1;
+	if (fgets(buf, sizeof(buf), f)) {
+		// comm 可能包含空格，从最后一个 ')' 之后开始，第 3 项是 state
+		char *p = strrchr(buf, ')');
+		for (int field = 2; p && field < 39; ++field)
+			p = strchr(p + 1, ' ');
+		if (p)
+			cpu = atoi(p + 1);
+	}
+	fclose(f);
+	return cpu;
+}
+
+int main(int argc, char *argv[])
+{
+	int rounds = argc > 1 ? atoi(argv[1]) : 100000;
+	cpu_set_t all;
+	if (sched_getaffinity(0, sizeof(all), &all)) {
+		printf("sched_getaffinity failed\n");
+		return 1;
+	}
+
+	DUNE_ENTER;
+
+	int nr = 0;
+	for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+		if (!CPU_ISSET(cpu, &all))
+			continue;
+		cpu_set_t one;
+		CPU_ZERO(&one);
+		CPU_SET(cpu, &one);
+		if (sched_setaffinity(0, sizeof(one), &one))
+			continue;
+		nr++;
+
+		unsigned c = -1, node = -1;
+		check("host", host_cpu(), cpu);
+		check("dune_getcpu", dune_getcpu(), cpu);
+		check("sched_getcpu", sched_getcpu(), cpu);
+		check("getcpu", syscall(SYS_getcpu, &c, &node, NULL), 0);
+		check("getcpu cpu", c, cpu);
+		// 只取 cpu 的时候 node 不能被写入
+		c = -1;
+		check("getcpu cpu only", syscall(SYS_getcpu, &c, NULL, NULL), 0);
+		check("getcpu cpu only", c, cpu);
+	}
+	sched_setaffinity(0, sizeof(all), &all);
+
+	static unsigned global_cpu = -1;
+	check("getcpu global", syscall(SYS_getcpu, &global_cpu, NULL, NULL), 0);
+	check("getcpu global", global_cpu != -1, 1);
+	check("getcpu bad pointer", syscall(SYS_getcpu, (unsigned *)8, NULL, NULL),
+	      -1);
+	check("getcpu bad pointer", errno, EFAULT);
+
+	// 不绑定的时候 dune_getcpu 只在 exit 的时候更新，统计它和紧接着的 exit
+	// 中 host 看到的 cpu 不同的次数
+	int stale = 0;
+	for (int i = 0; i < 1000; ++i) {
+		for (volatile int j = 0; j < 100000; ++j)
+			;
+		int guest = dune_getcpu();
+		if (guest != host_cpu())
+			stale++;
+	}
+
+	long begin = now_ns();
+	for (int i = 0; i < rounds; ++i)
+		dune_getcpu();
+	long dune_ns = now_ns() - begin;
+	begin = now_ns();
+	for (int i = 0; i < rounds; ++i)
+		sched_getcpu();
+	long sched_ns = now_ns() - begin;
+	begin = now_ns();
+	for (int i = 0; i < rounds; ++i)
+		syscall(SYS_getcpu, NULL, NULL, NULL);
+	long syscall_ns = now_ns() - begin;
+
+	printf("%d cpus checked, unpinned stale %d / 1000\n", nr, stale);
+	printf("dune_getcpu %ld ns, sched_getcpu %ld ns, getcpu syscall %ld ns\n",
+	       dune_ns / rounds, sched_ns / rounds, syscall_ns / rounds);
+	printf("%s\n", failed ? "FAIL" : "PASS");
+	return failed;
+}
@@ -0,0 +1,43 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "../dune/dune.h"
+
+// 在 dune/Makefile 中打开 -DDUNE_PHASE_TIMING, 然后
+// make TESTSRCS=phase.c && ./phase.out
+//
+// 输出 getppid 的 hypercall 往返中每一个阶段的平均时间和直方图
+
+static const char *names[DUNE_PHASE_NR] = {
+	"vector", "exit", "dispatch", "syscall", "return", "entry",
+};
+
+int main(int argc, char *argv[])
+{
+	DUNE_ENTER;
+
+	for (int i = 0; i < 100000; ++i)
+		syscall(SYS_getppid);
+
+	struct dune_syscall_stat stats[DUNE_PHASE_NR];
+	int err = dune_stats_phase(stats);
+	if (err) {
+		printf("dune_stats_phase failed : %d, "
+		       "is libdune built with DUNE_PHASE_TIMING ?\n",
+		       err);
+		return 1;
+	}
+
+	for (int i = 0; i < DUNE_PHASE_NR; ++i) {
+		struct dune_syscall_stat *stat = &stats[i];
+		printf("%-8s : count %llu, mean %llu ns\n", names[i],
+		       stat->count, stat->count ? stat->total_ns / stat->count : 0);
+		for (int j = 0; j < DUNE_STATS_BUCKETS; ++j) {
+			if (stat->hist[j])
+				printf("  [%llu, %llu) ns : %llu\n", 1ULL << j,
+				       2ULL << j, stat->hist[j]);
+		}
+	}
+	return 0;
+}
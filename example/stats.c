@@ -0,0 +1,38 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "../dune/dune.h"
+
+// make TESTSRCS=stats.c && DUNE_STATS=1 ./stats.out
+//
+// 通过 C API 查询 getppid 的统计，退出的时候 DUNE_STATS 输出全部的统计
+
+int main(int argc, char *argv[])
+{
+	DUNE_ENTER;
+
+	for (int i = 0; i < 10000; ++i)
+		syscall(SYS_getppid);
+
+	struct dune_syscall_stat stat;
+	if (dune_stats_syscall(SYS_getppid, &stat)) {
+		printf("dune_stats_syscall failed\n");
+		return 1;
+	}
+	printf("getppid : count %llu, mean %llu ns\n", stat.count,
+	       stat.count ? stat.total_ns / stat.count : 0);
+	for (int i = 0; i < DUNE_STATS_BUCKETS; ++i) {
+		if (stat.hist[i])
+			printf("  [%llu, %llu) ns : %llu\n", 1ULL << i,
+			       2ULL << i, stat.hist[i]);
+	}
+
+	unsigned long long exits[64];
+	int n = dune_stats_exits(exits, 64);
+	for (int i = 0; i < n; ++i) {
+		if (exits[i])
+			printf("exit_reason %d : %llu\n", i, exits[i]);
+	}
+	return 0;
+}
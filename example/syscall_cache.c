@@ -0,0 +1,59 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/utsname.h>
+#include <sys/wait.h>
+
+#include "../dune/dune.h"
+
+// make TESTSRCS=syscall_cache.c && ./syscall_cache.out
+//
+// 检查 host_loop 缓存的结果在 fork 和 setrlimit 之后仍然正确，并且输出命中率
+
+static void check(int cond, const char *msg)
+{
+	if (!cond) {
+		printf("FAILED: %s\n", msg);
+		exit(1);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	DUNE_ENTER;
+
+	pid_t pid = syscall(SYS_getpid);
+	struct utsname uts;
+	struct rlimit rlim;
+	for (int i = 0; i < 1000; ++i) {
+		check(syscall(SYS_getpid) == pid, "getpid");
+		check(uname(&uts) == 0, "uname");
+		check(getrlimit(RLIMIT_NOFILE, &rlim) == 0, "getrlimit");
+	}
+
+	// setrlimit 之后 getrlimit 必须看到新的结果
+	rlim.rlim_cur = rlim.rlim_cur > 64 ? rlim.rlim_cur - 1 : rlim.rlim_cur;
+	check(setrlimit(RLIMIT_NOFILE, &rlim) == 0, "setrlimit");
+	struct rlimit now;
+	check(getrlimit(RLIMIT_NOFILE, &now) == 0, "getrlimit");
+	check(now.rlim_cur == rlim.rlim_cur, "getrlimit after setrlimit");
+
+	// child 中 getpid 不能返回 parent 的缓存
+	pid_t child = fork();
+	if (child == 0) {
+		check(syscall(SYS_getpid) != pid, "getpid in child");
+		exit(0);
+	}
+	int status;
+	check(waitpid(child, &status, 0) == child, "waitpid");
+	check(WIFEXITED(status) && WEXITSTATUS(status) == 0, "child");
+
+	struct dune_cache_stats stats;
+	check(dune_syscall_cache_stats(&stats) == 0, "dune_syscall_cache_stats");
+	printf("hits %llu, misses %llu, invalidations %llu, hit rate %.1f%%\n",
+	       stats.hits, stats.misses, stats.invalidations,
+	       100.0 * stats.hits / (stats.hits + stats.misses));
+	return 0;
+}
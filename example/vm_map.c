@@ -0,0 +1,112 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h> // atoi
+#include <string.h>
+#include <sys/mman.h>
+
+#include "../dune/dune.h"
+#include "bench.h"
+
+// make TESTSRCS=vm_map.c && ./vm_map.out [rounds]
+//
+// 在 dune_vm_reserve 保留的地址中用 16K 的页和 32M 的大页映射同一块内存，检查
+// 通过两个地址看到的内容一致，然后比较 dune_vm_protect + dune_vm_shootdown
+// 和 mprotect 切换权限的耗时。
+
+#define HUGE (32UL << 20)
+#define SMALL (16UL << 10)
+
+static int failed;
+
+static void check(const char *what, long got, long expect)
+{
+	if (got != expect) {
+		printf("FAIL %s : got %ld, expect %ld\n", what, got, expect);
+		failed = 1;
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	int rounds = argc > 1 ? atoi(argv[1]) : 10000;
+
+	// 按照 32M 对齐的内存，大页才能使用
+	char *raw = mmap(NULL, HUGE * 3, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (raw == MAP_FAILED) {
+		printf("mmap failed\n");
+		return 1;
+	}
+	char *mem = (char *)(((unsigned long)raw + HUGE - 1) & ~(HUGE - 1));
+	memset(mem, 0, HUGE * 2);
+
+	DUNE_ENTER;
+
+	void *arena;
+	int err = dune_vm_reserve(1UL << 36, &arena);
+	if (err) {
+		printf("dune_vm_reserve failed : %d\n", err);
+		return 1;
+	}
+	char *small = arena;
+	char *huge = (char *)arena + HUGE * 4;
+
+	check("map small", dune_vm_map(small, mem, SMALL * 4,
+				       PROT_READ | PROT_WRITE), 0);
+	check("map huge", dune_vm_map(huge, mem, HUGE * 2,
+				      PROT_READ | PROT_WRITE), 0);
+	check("map outside", dune_vm_map(mem, mem, SMALL, PROT_READ), -EINVAL);
+	check("map unaligned", dune_vm_map(small + 1, mem, SMALL, PROT_READ),
+	      -EINVAL);
+	check("map over huge", dune_vm_map(huge, mem, SMALL, PROT_READ), -EBUSY);
+	check("protect part of huge", dune_vm_protect(huge, SMALL, PROT_READ),
+	      -EINVAL);
+
+	mem[0] = 1;
+	small[SMALL + 8] = 2;
+	huge[HUGE + 16] = 3;
+	check("small alias", small[0], 1);
+	check("small write", mem[SMALL + 8], 2);
+	check("huge alias", huge[SMALL + 8], 2);
+	check("huge write", mem[HUGE + 16], 3);
+
+	// 同一个地址重新映射到另一块内存
+	check("remap", dune_vm_map(small, mem + SMALL, SMALL,
+				   PROT_READ | PROT_WRITE), 0);
+	check("remap alias", small[8], 2);
+	check("unmap", dune_vm_unmap(huge, HUGE), 0);
+	check("map small after unmap", dune_vm_map(huge, mem, SMALL,
+						  PROT_READ | PROT_WRITE), 0);
+	check("small after unmap", huge[8], 0);
+	check("shootdown", dune_vm_shootdown(), 0);
+
+	long begin = now_ns();
+	for (int i = 0; i < rounds; ++i) {
+		dune_vm_protect(small, SMALL, PROT_READ);
+		dune_vm_protect(small, SMALL, PROT_READ | PROT_WRITE);
+	}
+	long local_ns = now_ns() - begin;
+
+	begin = now_ns();
+	for (int i = 0; i < rounds; ++i) {
+		dune_vm_protect(small, SMALL, PROT_READ);
+		dune_vm_shootdown();
+		dune_vm_protect(small, SMALL, PROT_READ | PROT_WRITE);
+		dune_vm_shootdown();
+	}
+	long shootdown_ns = now_ns() - begin;
+
+	begin = now_ns();
+	for (int i = 0; i < rounds; ++i) {
+		mprotect(mem, SMALL, PROT_READ);
+		mprotect(mem, SMALL, PROT_READ | PROT_WRITE);
+	}
+	long mprotect_ns = now_ns() - begin;
+
+	printf("protect flip : dune_vm_protect %ld ns, with shootdown %ld ns, "
+	       "mprotect %ld ns\n",
+	       local_ns / (2L * rounds), shootdown_ns / (2L * rounds),
+	       mprotect_ns / (2L * rounds));
+	printf("%s\n", failed ? "FAIL" : "PASS");
+	return failed;
+}
@@ -0,0 +1,229 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "../dune/trace.h"
+#include "syscall_names.h"
+
+// 解析 DUNE_TRACE 输出的文件
+//
+// dune-trace [-s] <prefix>.<pid>.<cpu_id> ...
+//   默认按照时间顺序输出类似 strace 的文本，多个文件 (多个 vcpu) 合并在一起
+//   -s 输出每一个 syscall 的次数，错误次数，总时间和平均时间。没有结束的
+//   syscall (例如 exit) 只计入次数
+
+struct event {
+	uint32_t pid;
+	uint32_t arch;
+	const struct trace_record *rec;
+};
+
+static struct event *events;
+static size_t nr_events, max_events;
+
+static void add_event(const struct trace_header *header,
+		      const struct trace_record *rec)
+{
+	if (nr_events == max_events) {
+		max_events = max_events ? max_events * 2 : 4096;
+		events = realloc(events, max_events * sizeof(*events));
+		if (events == NULL) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	events[nr_events++] = (struct event){ header->pid, header->arch, rec };
+}
+
+static int load(const char *path)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) || st.st_size < TRACE_RECORDS_OFFSET) {
+		fprintf(stderr, "%s: too small\n", path);
+		close(fd);
+		return -1;
+	}
+
+	// 成功的时候不释放，record 在整个程序中被引用
+	void *base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	const struct trace_header *header = base;
+	if (header->magic != TRACE_MAGIC || header->version != TRACE_VERSION ||
+	    header->record_size != sizeof(struct trace_record) ||
+	    header->capacity == 0 ||
+	    TRACE_RECORDS_OFFSET + (uint64_t)header->capacity * header->record_size >
+		    (uint64_t)st.st_size) {
+		fprintf(stderr, "%s: not a dune trace\n", path);
+		munmap(base, st.st_size);
+		return -1;
+	}
+
+	const struct trace_record *records =
+		(const struct trace_record *)((const char *)base + TRACE_RECORDS_OFFSET);
+	uint64_t head = header->head;
+	uint64_t first = head > header->capacity ? head - header->capacity : 0;
+	for (uint64_t i = first; i < head; ++i)
+		add_event(header, &records[i % header->capacity]);
+	return 0;
+}
+
+static int cmp_event(const void *a, const void *b)
+{
+	const struct trace_record *x = ((const struct event *)a)->rec;
+	const struct trace_record *y = ((const struct event *)b)->rec;
+	return x->ts_ns < y->ts_ns ? -1 : x->ts_ns > y->ts_ns;
+}
+
+static const char *syscall_name(uint32_t arch, uint64_t sysno, char *buf)
+{
+	const size_t n = sizeof(loongarch_syscall_names) /
+			 sizeof(loongarch_syscall_names[0]);
+	if (arch == TRACE_ARCH_LOONGARCH && sysno < n &&
+	    loongarch_syscall_names[sysno])
+		return loongarch_syscall_names[sysno];
+	sprintf(buf, "syscall_%" PRIu64, sysno);
+	return buf;
+}
+
+// MIPS 的 syscall_parameter[0] 是 v0, 参数从 [1] 开始
+static const uint64_t *syscall_args(const struct event *ev)
+{
+	return ev->arch == TRACE_ARCH_MIPS ? &ev->rec->args[1] :
+					     &ev->rec->args[0];
+}
+
+static void print_events(void)
+{
+	uint64_t base = nr_events ? events[0].rec->ts_ns : 0;
+	for (size_t i = 0; i < nr_events; ++i) {
+		const struct event *ev = &events[i];
+		const struct trace_record *rec = ev->rec;
+		const uint64_t *args = syscall_args(ev);
+		char buf[32];
+		uint64_t ts = rec->ts_ns - base;
+
+		printf("%6" PRIu64 ".%06" PRIu64 " [%u:%u] %s(%#" PRIx64
+		       ", %#" PRIx64 ", %#" PRIx64 ", %#" PRIx64 ", %#" PRIx64
+		       ", %#" PRIx64 ")",
+		       ts / 1000000000, ts / 1000 % 1000000, ev->pid, rec->cpu_id,
+		       syscall_name(ev->arch, rec->sysno, buf), args[0], args[1],
+		       args[2], args[3], args[4], args[5]);
+		if (rec->flags & TRACE_DONE) {
+			printf(" = %" PRId64, rec->ret);
+			if (rec->ret < 0 && rec->ret > -4096)
+				printf(" %s", strerror(-rec->ret));
+			printf(" <%" PRIu64 "ns>", rec->dur_ns);
+		} else {
+			printf(" = ?");
+		}
+		printf(" @%#" PRIx64 "\n", rec->era);
+	}
+}
+
+struct summary {
+	uint32_t arch;
+	uint64_t sysno;
+	uint64_t count;
+	uint64_t errors;
+	uint64_t done; // 有结束时间的次数，total_ns 只包括这些
+	uint64_t total_ns;
+};
+
+static int cmp_summary(const void *a, const void *b)
+{
+	const struct summary *x = a, *y = b;
+	return x->total_ns > y->total_ns ? -1 : x->total_ns < y->total_ns;
+}
+
+static void print_summary(void)
+{
+	struct summary *sum = calloc(nr_events + 1, sizeof(*sum));
+	size_t n = 0;
+	if (sum == NULL) {
+		perror("calloc");
+		exit(1);
+	}
+
+	// 不同的 syscall 只有几百个，线性查找足够了
+	for (size_t i = 0; i < nr_events; ++i) {
+		const struct trace_record *rec = events[i].rec;
+		size_t j;
+		for (j = 0; j < n; ++j)
+			if (sum[j].sysno == rec->sysno &&
+			    sum[j].arch == events[i].arch)
+				break;
+		if (j == n) {
+			sum[n].arch = events[i].arch;
+			sum[n].sysno = rec->sysno;
+			n++;
+		}
+		sum[j].count++;
+		if (!(rec->flags & TRACE_DONE))
+			continue;
+		if (rec->ret < 0 && rec->ret > -4096)
+			sum[j].errors++;
+		sum[j].done++;
+		sum[j].total_ns += rec->dur_ns;
+	}
+
+	qsort(sum, n, sizeof(*sum), cmp_summary);
+	printf("%-20s %10s %10s %14s %10s\n", "syscall", "calls", "errors",
+	       "total_ns", "mean_ns");
+	for (size_t j = 0; j < n; ++j) {
+		char buf[32];
+		uint64_t mean = sum[j].done ? sum[j].total_ns / sum[j].done : 0;
+		printf("%-20s %10" PRIu64 " %10" PRIu64 " %14" PRIu64
+		       " %10" PRIu64 "\n",
+		       syscall_name(sum[j].arch, sum[j].sysno, buf), sum[j].count,
+		       sum[j].errors, sum[j].total_ns, mean);
+	}
+	free(sum);
+}
+
+int main(int argc, char *argv[])
+{
+	int opt, summary = 0;
+	while ((opt = getopt(argc, argv, "s")) != -1) {
+		switch (opt) {
+		case 's':
+			summary = 1;
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (optind == argc)
+		goto usage;
+
+	for (int i = optind; i < argc; ++i)
+		if (load(argv[i]))
+			return 1;
+
+	qsort(events, nr_events, sizeof(*events), cmp_event);
+	if (summary)
+		print_summary();
+	else
+		print_events();
+	return 0;
+
+usage:
+	fprintf(stderr, "usage: %s [-s] <trace file>...\n", argv[0]);
+	return 1;
+}